@@ -72,7 +72,7 @@ build.o: $(OBJS)
 
 %.elf: $(OBJS) %.ld Makefile
 	@echo LD $@
-	$(CC) $(LDFLAGS) -T$(*F).ld $(OBJS) -o $@
+	$(CC) $(LDFLAGS) -T$(*F).ld $(OBJS) -lgcc -o $@
 	chmod a-x $@
 
 %.hex: %.elf
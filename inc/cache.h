@@ -9,27 +9,82 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+struct cache_stats {
+    uint32_t lookups, hits, misses;
+    uint32_t evictions;
+    uint32_t bytes_copied;
+    uint16_t max_chain; /* longest hash chain walked */
+};
+
 #if !defined(BOOTLOADER) && !defined(RELOADER)
 
-/* Use memory range (@start,@end) to cache data items of size @item_sz. */
+/* Cached items are partitioned into pools, each with its own LRU. */
+#define CACHE_NR_POOLS 2
+
+/* Use memory range (@start,@end) to cache data items of size @item_sz. 
+ * Initially each pool may grow to occupy the entire cache. */
 struct cache *cache_init(void *start, void *end, unsigned int item_sz);
 
+/* Limit @pool to at most @pct percent of cache items. A pool below its quota
+ * grows by taking free items, or by stealing the other pool's least-recently
+ * used items. A pool at its quota recycles its own least-recently used. */
+void cache_set_pool_quota(struct cache *c, unsigned int pool,
+                          unsigned int pct);
+
+/* Account all subsequent cache activity to @s. */
+void cache_set_stats(struct cache *c, struct cache_stats *s);
+
 /* Look up item @id in the cache. Return a pointer to cached data, or NULL. */
 const void *cache_lookup(struct cache *c, uint32_t id);
 
-/* Update item @id with data @dat. Inserts the item if not present.*/
-void cache_update(struct cache *c, uint32_t id, const void *dat);
+/* Update item @id with data @dat. Inserts the item into @pool if not 
+ * present. */
+void cache_update(struct cache *c, uint32_t id, const void *dat,
+                  unsigned int pool);
 
 /* Update @N items (@id..@id+@N-1) with data @dat. Calls cache_update(). */
 void cache_update_N(struct cache *c, uint32_t id,
-                    const void *dat, unsigned int N);
+                    const void *dat, unsigned int N, unsigned int pool);
+
+/* Write-back support. A dirty item is never evicted from the cache: the 
+ * caller must write it back and then mark it clean. cache_update() also 
+ * marks an item clean. */
+
+/* Update item @id with data @dat, and mark it dirty. Inserts the item into 
+ * @pool if not present. Returns FALSE if there is no clean item to evict. */
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat,
+                   unsigned int pool);
+
+/* Mark item @id clean. Returns a pointer to cached data, or NULL. */
+const void *cache_clean(struct cache *c, uint32_t id);
+
+/* Zero-copy fills. Reserve @N items (@id..@id+@N-1) in @pool, with their 
+ * data contiguous in memory. Returns a pointer to the data, to be filled by 
+ * the caller, or NULL if no suitable run of items can be recycled. */
+void *cache_reserve(struct cache *c, uint32_t id, unsigned int N,
+                    unsigned int pool);
+
+/* Remove @N items (@id..@id+@N-1), eg. after a failed fill. */
+void cache_invalidate_N(struct cache *c, uint32_t id, unsigned int N);
+
+/* Return the @n'th most-recently-used clean item of @pool (protected items 
+ * first), and its id in @id. Returns NULL if there are fewer items. */
+const void *cache_mru(struct cache *c, unsigned int pool, unsigned int n,
+                      uint32_t *id);
 
 #else
 
 #define cache_init(a,b,c) NULL
+#define cache_set_pool_quota(a,b,c) ((void)0)
+#define cache_set_stats(a,b) ((void)0)
 #define cache_lookup(a,b) NULL
-#define cache_update(a,b,c) ((void)0)
-#define cache_update_N(a,b,c,d) ((void)0)
+#define cache_update(a,b,c,d) ((void)0)
+#define cache_update_N(a,b,c,d,e) ((void)0)
+#define cache_write(a,b,c,d) FALSE
+#define cache_clean(a,b) NULL
+#define cache_reserve(a,b,c,d) NULL
+#define cache_invalidate_N(a,b,c) ((void)0)
+#define cache_mru(a,b,c,d) NULL
 
 #endif
 
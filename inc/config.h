@@ -130,6 +130,13 @@ struct __packed ff_cfg {
     uint8_t oled_contrast;
     char indexed_prefix[8];
     uint8_t display_mode;
+    uint8_t metadata_cache_pct;
+    uint8_t data_cache_pct;
+    uint16_t write_back_ms;
+    uint8_t read_ahead;
+    bool_t diagnostics;
+    bool_t nav_index_file;
+    bool_t benchmark;
 };
 
 extern struct ff_cfg ff_cfg;
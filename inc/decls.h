@@ -29,8 +29,8 @@
 #include "spi.h"
 #include "timer.h"
 #include "fs.h"
-#include "floppy.h"
 #include "volume.h"
+#include "floppy.h"
 #include "config.h"
 
 /*
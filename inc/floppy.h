@@ -42,6 +42,8 @@ struct hfe_image {
         uint16_t off, len;
         bool_t dirty;
     } write_batch;
+    /* Batch of track data being read from the volume (count != 0). */
+    struct volume_req read_batch;
 };
 
 struct raw_sec {
@@ -100,6 +102,10 @@ struct directaccess {
     int32_t decode_pos;
     uint16_t trk_sec;
     uint16_t idx_sz, idam_sz, dam_sz;
+    /* Read-ahead window. */
+    uint32_t ra_lba;
+    uint16_t ra_nr;
+    bool_t ra_seq;
 };
 
 struct image_buf {
@@ -229,6 +235,7 @@ uint16_t fm_sync(uint8_t dat, uint8_t clk);
 void floppy_init(void);
 bool_t floppy_ribbon_is_reversed(void);
 void floppy_insert(unsigned int unit, struct slot *slot);
+unsigned int floppy_image_frags(void);
 void floppy_cancel(void);
 bool_t floppy_handle(void); /* TRUE -> re-read config file */
 void floppy_set_cyl(uint8_t unit, uint8_t cyl);
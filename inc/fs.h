@@ -24,6 +24,7 @@ void F_truncate(FIL *fp);
 void F_opendir(DIR *dp, const TCHAR *path);
 void F_closedir(DIR *dp);
 void F_readdir(DIR *dp, FILINFO *fno);
+void F_seekdir(DIR *dp, DWORD ofs);
 void F_findfirst(DIR *dp, FILINFO *fno, const TCHAR *path,
                  const TCHAR *pattern);
 void F_findnext(DIR *dp, FILINFO *fno);
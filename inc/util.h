@@ -54,7 +54,21 @@ struct slot {
     uint32_t firstCluster;
     uint32_t size;
     uint32_t dir_sect, dir_ptr;
+#if FF_FS_EXFAT
+    uint32_t c_scl, c_size, c_ofs; /* exFAT: location of directory entry */
+#endif
 };
+/* Slot attribute beyond those of FatFS: an exFAT file with no FAT chain. Only
+ * slots built from an open file carry it, so HxC selector mode (whose slots 
+ * are written by external tools) is refused on exFAT. */
+#define AM_CONTIG 0x80
+/* Slot attributes of an open file. */
+#if FF_FS_EXFAT
+#define file_attributes(f) \
+    ((f)->obj.attr | (((f)->obj.stat == 2) ? AM_CONTIG : 0))
+#else
+#define file_attributes(f) ((f)->obj.attr)
+#endif
 void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode);
 
 void filename_extension(const char *filename, char *extension, size_t size);
@@ -162,11 +176,83 @@ void usbh_msc_init(void);
 void usbh_msc_buffer_set(uint8_t *buf);
 void usbh_msc_process(void);
 bool_t usbh_msc_inserted(void);
+/* VID:PID of the attached device, as (VID << 16) | PID, or 0 if none. */
+uint32_t usbh_msc_id(void);
+
+/* Bytes moved through the USB OTG FIFOs, and the CPU cycles taken. These are 
+ * accumulated only while enabled, as timing costs cycles in the IRQ path. */
+struct usb_fifo_stats {
+    uint32_t rx_bytes, rx_cycles;
+    uint32_t tx_bytes, tx_cycles;
+};
+void usb_fifo_stats_enable(bool_t enable);
+const struct usb_fifo_stats *usb_fifo_stats(void);
+
+/* SD card statistics, per type of FatFS operation: bytes clocked on the bus
+ * and time spent waiting for the card to be ready. Write busy time is how 
+ * long the card held the bus while programming written blocks, whenever we 
+ * next waited for it. */
+#define SD_OP_init  0
+#define SD_OP_read  1
+#define SD_OP_write 2
+#define SD_OP_sync  3
+#define SD_OP_nr    4
+struct sd_op_stats {
+    uint32_t ops, cmds, bytes, wait_us;
+    uint32_t crc_errs; /* data blocks failing CRC, in either direction */
+};
+struct sd_stats {
+    struct sd_op_stats op[SD_OP_nr];
+    uint32_t blocks_written;
+    uint32_t busy_us, busy_max_us;
+};
+const struct sd_stats *sd_stats(void);
+
+/* USB MSC command latency histograms, since the device was attached. READ10 
+ * and WRITE10 are further split by transfer size, rounded down to a power of
+ * two sectors (1 to 64+). Latency bucket 0 counts commands taking under 
+ * 128us; each further bucket doubles the limit, and the last is unbounded. */
+#define MSC_LAT_SIZES   7
+#define MSC_LAT_BUCKETS 16
+#define MSC_LAT_read10(sz)  (sz)
+#define MSC_LAT_write10(sz) (MSC_LAT_SIZES + (sz))
+#define MSC_LAT_test_unit_ready (2*MSC_LAT_SIZES)
+#define MSC_LAT_request_sense   (2*MSC_LAT_SIZES + 1)
+#define MSC_LAT_ROWS            (2*MSC_LAT_SIZES + 2)
+/* BOT transaction counters, over the same commands. Time is split between 
+ * the CBW, data and CSW phases of each command: the CBW and CSW phases are 
+ * per-command overhead. The 16-bit counts saturate. */
+struct msc_bot_stats {
+    uint32_t cmds;
+    uint32_t cbw_us, data_us, csw_us;
+    uint16_t nak;       /* NAKs seen by the BOT layer (bulk OUT) */
+    uint16_t stall;     /* STALLs, recovered by clearing the endpoint */
+    uint16_t xfer_err;  /* transaction errors, retried */
+    uint16_t phase_err; /* unrecovered: leads to a device reset */
+    uint16_t fail;      /* failed CSW status, or timeout */
+};
+struct msc_lat {
+    char serial[24];
+    uint16_t hist[MSC_LAT_ROWS][MSC_LAT_BUCKETS]; /* saturating counts */
+    struct msc_bot_stats bot;
+};
+#if !defined(BOOTLOADER) && !defined(RELOADER)
+const struct msc_lat *usbh_msc_lat(void);
+/* Called by the BOT layer as each command's CBW is sent, and after each step 
+ * of the BOT state machine with its new BOT state, the URB state it acted 
+ * upon, and the transfer status (USBH_MSC_BUSY until complete). */
+void usbh_msc_lat_start(const uint8_t *cb, uint32_t len);
+void usbh_msc_lat_step(uint8_t bot_state, uint8_t urb_state, uint8_t status);
+#else
+#define usbh_msc_lat_start(cb, len) ((void)0)
+#define usbh_msc_lat_step(bot_state, urb_state, status) ((void)0)
+#endif
 
 /* Navigation/UI frontend */
 uint16_t get_slot_nr(void);
 bool_t set_slot_nr(uint16_t slot_nr);
 int set_slot_by_name(const char *name, void *scratch);
+void invalidate_slot_names(void);
 bool_t get_img_cfg(struct slot *slot);
 
 extern uint8_t board_id;
@@ -17,6 +17,12 @@ struct volume_ops {
     DRESULT (*read)(BYTE, BYTE *, DWORD, UINT);
     DRESULT (*write)(BYTE, const BYTE *, DWORD, UINT);
     DRESULT (*ioctl)(BYTE, BYTE, void *);
+    /* Optional asynchronous interface: submit() starts a transfer, which is 
+     * advanced by calls to poll() until it returns TRUE with the result. */
+    DRESULT (*submit)(bool_t write, BYTE *, DWORD, UINT);
+    bool_t (*poll)(DRESULT *);
+    /* Optional: called from the main loop while no request is in flight. */
+    void (*idle)(void);
     bool_t (*connected)(void);
     bool_t (*readonly)(void);
 };
@@ -26,7 +32,49 @@ bool_t volume_readonly(void);
 
 void volume_cache_init(void *start, void *end);
 void volume_cache_destroy(void);
-void volume_cache_metadata_only(FIL *fp);
+void volume_cache_metadata_only(void);
+
+/* Periodic work: advances queued requests, lets an idle driver tidy up, and
+ * writes back dirty cached sectors older than write-back-ms. */
+DRESULT volume_poll(void);
+
+/* Asynchronous requests. Requests are queued by volume_submit() and issued 
+ * to the volume in order, progressing whenever the queue is polled. The 
+ * buffer belongs to the volume until the request is complete. Writes are 
+ * visible to subsequent reads as soon as they are submitted. */
+struct volume_req {
+    BYTE *buff;
+    uint32_t lba;
+    uint16_t count;
+    bool_t write;
+    bool_t busy;
+    DRESULT res;
+    /* Optional: called on completion, from the context which polled. */
+    void (*done)(struct volume_req *);
+};
+
+/* Queue @req. Returns RES_NOTRDY if the queue is full. */
+DRESULT volume_submit(struct volume_req *req);
+
+/* Poll the queue. Returns TRUE if @req is complete (result in req->res). */
+bool_t volume_req_done(struct volume_req *req);
+
+/* Wait for @req to complete, and return its result. */
+DRESULT volume_complete(struct volume_req *req);
+
+/* Reads and writes via @win (the FatFS sector window) are of metadata. */
+void volume_set_metadata_window(void *win);
+
+/* Cache statistics are accounted to the subsystem on whose behalf the volume 
+ * is accessed. Accesses via the FatFS sector window are always VOL_TAG_fatfs;
+ * all others are accounted to the tag most recently set. */
+#define VOL_TAG_fatfs 0
+#define VOL_TAG_image 1
+#define VOL_TAG_da    2
+#define VOL_TAG_cfg   3
+#define VOL_TAG_nr    4
+void volume_set_tag(unsigned int tag);
+const struct cache_stats *volume_cache_stats(unsigned int tag);
 
 /*
  * Local variables:
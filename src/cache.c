@@ -9,29 +9,57 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* Entry headers are kept apart from item data, which is a single array 
+ * indexed in parallel with the headers. Thus a run of neighbouring entries 
+ * holds a run of contiguous item data, which a driver can fill directly. */
 struct cache_ent {
     uint32_t id;
     struct list_head lru;
     struct list_head hash;
-    uint8_t dat[0];
+    uint8_t pool; /* POOL_free, or owning pool */
+    bool_t protected; /* on the protected LRU of its pool? */
+    bool_t dirty; /* not yet written back? never evicted while set */
+    uint8_t _pad;
+};
+
+#define POOL_free 0xff
+
+/* Each pool is a Segmented LRU. New items enter at the head of the 
+ * probationary segment, and are promoted to the protected segment only when
+ * they are hit. Thus items which are used only once (eg. streamed data) cannot
+ * displace the pool's working set. */
+struct cache_pool {
+    struct list_head prob, prot;
+    uint16_t nr, nr_prot, quota;
 };
 
 struct cache {
     uint32_t item_sz;
-    struct list_head lru;
-    struct list_head hash[32];
-    struct cache_ent ents[0];
+    uint16_t nr_items, hash_mask;
+    struct list_head free;
+    struct cache_pool pool[CACHE_NR_POOLS];
+    struct cache_ent *ent;
+    uint8_t *dat;
+    struct cache_stats *stats;
+    struct list_head hash[0];
 };
 
-static struct cache *cache;
-#define CACHE_HASH(_id) ((_id)&31)
+#define CACHE_HASH(_c, _id) (&(_c)->hash[(_id) & (_c)->hash_mask])
+#define CACHE_DAT(_c, _cent) ((_c)->dat + ((_cent) - (_c)->ent) * (_c)->item_sz)
+
+/* Statistics sink until the cache owner provides one. */
+static struct cache_stats dummy_stats;
+
+/* Maximum number of items in a pool's protected segment. */
+#define MAX_PROT(_p) ((_p)->nr - (_p)->nr/4)
 
 struct cache *cache_init(void *start, void *end, unsigned int item_sz)
 {
     uint8_t *s, *e;
-    int i, nitm;
+    int i, nitm, nhash;
     struct cache *c;
     struct cache_ent *cent;
+    struct cache_pool *p;
 
     /* Cache boundaries are four-byte aligned. */
     s = (uint8_t *)(((uint32_t)start + 3) & ~3);
@@ -43,87 +71,354 @@ struct cache *cache_init(void *start, void *end, unsigned int item_sz)
         return NULL;
     }
 
+    /* Hash table has a chain per item (rounded down to a power of two). 
+     * Make room for it, and recalculate the number of items. */
+    for (nhash = 8; (nhash*2) <= nitm; nhash *= 2)
+        continue;
+    nitm = ((e - s) - (int)sizeof(*c) - nhash*(int)sizeof(c->hash[0]))
+        / (int)(sizeof(*cent) + item_sz);
+
     /* Initialise the empty cache structure. */
-    cache = c = (struct cache *)s;
+    c = (struct cache *)s;
     c->item_sz = item_sz;
-    list_init(&c->lru);
-    for (i = 0; i < ARRAY_SIZE(c->hash); i++)
+    c->nr_items = nitm;
+    c->hash_mask = nhash - 1;
+    c->ent = (struct cache_ent *)&c->hash[nhash];
+    c->dat = (uint8_t *)&c->ent[nitm];
+    c->stats = &dummy_stats;
+    list_init(&c->free);
+    for (i = 0; i < ARRAY_SIZE(c->pool); i++) {
+        p = &c->pool[i];
+        list_init(&p->prob);
+        list_init(&p->prot);
+        p->nr = p->nr_prot = 0;
+        p->quota = nitm;
+    }
+    for (i = 0; i < nhash; i++)
         list_init(&c->hash[i]);
 
-    /* Insert all the cache entries into the LRU list. They are not present 
+    /* Insert all the cache entries into the free list. They are not present 
      * in any hash chain as none of the cache entries are yet in use. */
-    cent = c->ents;
     for (i = 0; i < nitm; i++) {
-        list_insert_tail(&c->lru, &cent->lru);
+        cent = &c->ent[i];
+        list_insert_tail(&c->free, &cent->lru);
         list_init(&cent->hash);
-        cent = (struct cache_ent *)((uint32_t)cent + sizeof(*cent) + item_sz);
+        cent->pool = POOL_free;
+        cent->dirty = FALSE;
     }
 
-    printk("Cache %u items\n", nitm);
+    printk("Cache %u items, %u chains\n", nitm, nhash);
 
     return c;
 }
 
-const void *cache_lookup(struct cache *c, uint32_t id)
+void cache_set_pool_quota(struct cache *c, unsigned int pool,
+                          unsigned int pct)
+{
+    c->pool[pool].quota = (c->nr_items * min_t(unsigned int, pct, 100)) / 100;
+}
+
+void cache_set_stats(struct cache *c, struct cache_stats *s)
+{
+    c->stats = s;
+}
+
+static struct cache_ent *cache_find(struct cache *c, uint32_t id)
 {
     struct list_head *hash, *ent;
-    struct cache_ent *cent;
+    struct cache_ent *cent = NULL;
+    unsigned int len = 0;
 
     /* Look up the item in the appropriate hash chain. */
-    hash = &c->hash[CACHE_HASH(id)];
+    hash = CACHE_HASH(c, id);
     for (ent = hash->next; ent != hash; ent = ent->next) {
+        len++;
         cent = container_of(ent, struct cache_ent, hash);
         if (cent->id == id)
-            goto found;
+            break;
+        cent = NULL;
     }
-    return NULL;
 
-found:
-    /* Item is cached. Move it to head of LRU and return the data. */
+    if (len > c->stats->max_chain)
+        c->stats->max_chain = len;
+    return cent;
+}
+
+/* Item is cached. Move it to head of its pool's protected LRU. */
+static void cache_touch(struct cache *c, struct cache_ent *cent)
+{
+    struct cache_pool *p = &c->pool[cent->pool];
+
     list_remove(&cent->lru);
-    list_insert_head(&c->lru, &cent->lru);
-    return cent->dat;
+    list_insert_head(&p->prot, &cent->lru);
+    if (!cent->protected) {
+        cent->protected = TRUE;
+        /* Protected segment is full? Demote its oldest item. */
+        if (++p->nr_prot > MAX_PROT(p)) {
+            struct cache_ent *old = container_of(
+                p->prot.prev, struct cache_ent, lru);
+            old->protected = FALSE;
+            p->nr_prot--;
+            list_remove(&old->lru);
+            list_insert_head(&p->prob, &old->lru);
+        }
+    }
 }
 
-void cache_update(struct cache *c, uint32_t id, const void *dat)
+const void *cache_lookup(struct cache *c, uint32_t id)
 {
     struct cache_ent *cent;
-    void *p;
 
-    /* Already in the cache? Just update the existing data. */
-    if ((p = (void *)cache_lookup(c, id)) != NULL)
-        goto found;
+    c->stats->lookups++;
+    if ((cent = cache_find(c, id)) == NULL) {
+        c->stats->misses++;
+        return NULL;
+    }
 
-    /* Steal the oldest cache entry from the LRU. */
-    cent = container_of(c->lru.prev, struct cache_ent, lru);
-    p = cent->dat;
+    c->stats->hits++;
+    cache_touch(c, cent);
+    return CACHE_DAT(c, cent);
+}
+
+/* Remove in-use entry @cent from its pool and hash chain. */
+static void ent_remove(struct cache *c, struct cache_ent *cent)
+{
+    struct cache_pool *p = &c->pool[cent->pool];
 
-    /* Remove the selected cache entry from the cache. */
     list_remove(&cent->lru);
-    if (!list_is_empty(&cent->hash))
-        list_remove(&cent->hash);
+    list_remove(&cent->hash);
+    if (cent->protected)
+        p->nr_prot--;
+    p->nr--;
+}
+
+/* Insert entry @cent as item @id, at head of @pool's probationary LRU. */
+static void ent_insert(struct cache *c, struct cache_ent *cent,
+                       uint32_t id, unsigned int pool)
+{
+    struct cache_pool *p = &c->pool[pool];
 
-    /* Reinsert the cache entry in the correct hash chain, and head of LRU. */
     cent->id = id;
-    list_insert_head(&c->lru, &cent->lru);
-    list_insert_head(&c->hash[CACHE_HASH(id)], &cent->hash);
+    cent->pool = pool;
+    cent->protected = cent->dirty = FALSE;
+    p->nr++;
+    list_insert_head(&p->prob, &cent->lru);
+    list_insert_head(CACHE_HASH(c, id), &cent->hash);
+}
+
+/* Remove and return the least-recently-used clean item of pool @p. */
+static struct cache_ent *pool_steal(struct cache *c, struct cache_pool *p)
+{
+    struct list_head *lru, *ent;
+    struct cache_ent *cent;
+
+    for (lru = &p->prob; ; lru = &p->prot) {
+        for (ent = lru->prev; ent != lru; ent = ent->prev) {
+            cent = container_of(ent, struct cache_ent, lru);
+            if (!cent->dirty)
+                goto found;
+        }
+        if (lru == &p->prot)
+            return NULL;
+    }
 
 found:
+    ent_remove(c, cent);
+    c->stats->evictions++;
+    return cent;
+}
+
+/* Find or insert item @id. Returns NULL if there is no room for it. */
+static struct cache_ent *cache_get(struct cache *c, uint32_t id,
+                                   unsigned int pool)
+{
+    struct cache_pool *p = &c->pool[pool];
+    struct cache_ent *cent = NULL;
+
+    /* Already in the cache? */
+    if ((cent = cache_find(c, id)) != NULL) {
+        cache_touch(c, cent);
+        return cent;
+    }
+
+    /* Find an entry for the new item: Grow the pool if it is below quota, 
+     * else recycle the pool's own least-recently-used item. */
+    if ((p->nr < p->quota) && !list_is_empty(&c->free)) {
+        cent = container_of(c->free.next, struct cache_ent, lru);
+        list_remove(&cent->lru);
+    } else if ((p->nr < p->quota) && c->pool[pool^1].nr) {
+        cent = pool_steal(c, &c->pool[pool^1]);
+    }
+    if ((cent == NULL) && p->nr)
+        cent = pool_steal(c, p);
+    if (cent == NULL)
+        return NULL;
+
+    ent_insert(c, cent, id, pool);
+    return cent;
+}
+
+void cache_update(struct cache *c, uint32_t id, const void *dat,
+                  unsigned int pool)
+{
+    struct cache_ent *cent;
+
+    if ((cent = cache_get(c, id, pool)) == NULL)
+        return;
+
     /* Finally, store away the actual item data. */
-    memcpy(p, dat, c->item_sz);
+    memcpy(CACHE_DAT(c, cent), dat, c->item_sz);
+    c->stats->bytes_copied += c->item_sz;
+    cent->dirty = FALSE;
+}
+
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat,
+                   unsigned int pool)
+{
+    struct cache_ent *cent;
+
+    if ((cent = cache_get(c, id, pool)) == NULL)
+        return FALSE;
+
+    memcpy(CACHE_DAT(c, cent), dat, c->item_sz);
+    c->stats->bytes_copied += c->item_sz;
+    cent->dirty = TRUE;
+    return TRUE;
+}
+
+const void *cache_clean(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    if ((cent = cache_find(c, id)) == NULL)
+        return NULL;
+
+    cent->dirty = FALSE;
+    return CACHE_DAT(c, cent);
 }
 
 void cache_update_N(struct cache *c, uint32_t id,
-                    const void *dat, unsigned int N)
+                    const void *dat, unsigned int N, unsigned int pool)
 {
     const uint8_t *p = dat;
     while (N--) {
-        cache_update(c, id, p);
+        cache_update(c, id, p, pool);
         id++;
         p += c->item_sz;
     }
 }
 
+/* Cost of recycling entry @cent for a reservation in @pool. */
+#define COST_NONE 0xffff
+static unsigned int ent_cost(struct cache_ent *cent, unsigned int pool)
+{
+    if (cent->pool == POOL_free)
+        return 0;
+    if ((cent->pool != pool) || cent->dirty)
+        return COST_NONE;
+    return cent->protected ? 2 : 1;
+}
+
+void *cache_reserve(struct cache *c, uint32_t id, unsigned int N,
+                    unsigned int pool)
+{
+    struct cache_pool *p = &c->pool[pool];
+    struct cache_ent *cent;
+    unsigned int i, cost, bad, nfree, grow, best, best_cost, w;
+
+    if ((N == 0) || (N > c->nr_items))
+        return NULL;
+
+    /* Existing copies of the items are superseded. */
+    for (i = 0; i < N; i++) {
+        if ((cent = cache_find(c, id + i)) == NULL)
+            continue;
+        if (cent->dirty)
+            return NULL;
+        ent_remove(c, cent);
+        cent->pool = POOL_free;
+        list_insert_tail(&c->free, &cent->lru);
+    }
+
+    /* Slide a window of N entries across the cache, looking for the run of 
+     * free and least-valuable entries of @pool. Entries of the other pool 
+     * and dirty entries are unusable. As in cache_get(), free entries may 
+     * grow the pool only up to its quota. */
+    grow = (p->nr < p->quota) ? p->quota - p->nr : 0;
+    best = best_cost = COST_NONE;
+    cost = bad = nfree = 0;
+    for (i = 0; i < c->nr_items; i++) {
+        if ((w = ent_cost(&c->ent[i], pool)) == COST_NONE)
+            bad++;
+        else
+            cost += w;
+        nfree += (c->ent[i].pool == POOL_free);
+        if (i >= N) {
+            if ((w = ent_cost(&c->ent[i-N], pool)) == COST_NONE)
+                bad--;
+            else
+                cost -= w;
+            nfree -= (c->ent[i-N].pool == POOL_free);
+        }
+        if ((i >= N-1) && !bad && (nfree <= grow) && (cost < best_cost)) {
+            best = i - (N-1);
+            if ((best_cost = cost) == 0)
+                break;
+        }
+    }
+    if (best == COST_NONE)
+        return NULL;
+
+    /* Recycle the chosen entries. */
+    for (i = 0; i < N; i++) {
+        cent = &c->ent[best + i];
+        if (cent->pool == POOL_free) {
+            list_remove(&cent->lru);
+        } else {
+            ent_remove(c, cent);
+            c->stats->evictions++;
+        }
+        ent_insert(c, cent, id + i, pool);
+    }
+
+    return CACHE_DAT(c, &c->ent[best]);
+}
+
+const void *cache_mru(struct cache *c, unsigned int pool, unsigned int n,
+                      uint32_t *id)
+{
+    struct cache_pool *p = &c->pool[pool];
+    struct list_head *lru, *ent;
+    struct cache_ent *cent;
+
+    for (lru = &p->prot; ; lru = &p->prob) {
+        for (ent = lru->next; ent != lru; ent = ent->next) {
+            cent = container_of(ent, struct cache_ent, lru);
+            if (!cent->dirty && !n--)
+                goto found;
+        }
+        if (lru == &p->prob)
+            return NULL;
+    }
+
+found:
+    *id = cent->id;
+    return CACHE_DAT(c, cent);
+}
+
+void cache_invalidate_N(struct cache *c, uint32_t id, unsigned int N)
+{
+    struct cache_ent *cent;
+    while (N--) {
+        if ((cent = cache_find(c, id)) != NULL) {
+            ent_remove(c, cent);
+            cent->pool = POOL_free;
+            list_insert_tail(&c->free, &cent->lru);
+        }
+        id++;
+    }
+}
+
 /*
  * Local variables:
  * mode: C
@@ -1194,6 +1194,29 @@ FRESULT change_bitmap (
 }
 
 
+/*----------------------------------------------------*/
+/* Count free clusters from a cluster (FlashFloppy)   */
+/*----------------------------------------------------*/
+
+static
+DWORD free_run_bitmap (	/* Number of free clusters (up to ncl), 0xFFFFFFFF:Disk error */
+	FATFS* fs,	/* Filesystem object */
+	DWORD clst,	/* Cluster number to count from */
+	DWORD ncl	/* Maximum number of clusters to count */
+)
+{
+	DWORD val, n;
+
+
+	for (n = 0; n < ncl && clst + n < fs->n_fatent; n++) {
+		val = clst + n - 2;	/* The first bit corresponds to cluster #2 */
+		if (move_window(fs, fs->database + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
+		if (fs->win[val / 8 % SS(fs)] & (1 << (val % 8))) break;	/* Cluster in use? */
+	}
+	return n;
+}
+
+
 /*---------------------------------------------*/
 /* Fill the first fragment of the FAT chain    */
 /*---------------------------------------------*/
@@ -1447,25 +1470,82 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 /* FAT handling - Convert offset into cluster with link map table        */
 /*-----------------------------------------------------------------------*/
 
+/* The link map table is packed to hold many fragments in little memory:
+   tbl[0]: Table size in DWORDs (in), or required size (out)
+   tbl[1]: Number of fragments
+   tbl[2..4]: Cursor (byte offset, cluster order, and previous fragment end)
+   tbl[5..]: Byte stream of fragments, each a length in clusters followed by
+             the signed distance of its top cluster from the end of the
+             previous fragment. Both are 7-bits-per-byte variable length.
+             A zero length terminates the table.
+   Lookups resume from the cursor when seeking forwards, so sequential
+   access does not rescan the table. */
+#define CLMT_HDR	5
+
+static
+BYTE* clmt_get (	/* Returns the next byte of the stream */
+	BYTE* p,		/* Pointer to the encoded value */
+	DWORD* v		/* Decoded value */
+)
+{
+	DWORD val = 0;
+	UINT sh = 0;
+
+
+	do {
+		val |= (DWORD)(*p & 0x7F) << sh;
+		sh += 7;
+	} while (*p++ & 0x80);
+	*v = val;
+	return p;
+}
+
+static
+UINT clmt_put (		/* Returns the encoded length in bytes */
+	BYTE* p,		/* Destination, or null to only measure */
+	DWORD v			/* Value to be encoded */
+)
+{
+	UINT n = 0;
+
+
+	do {
+		if (p) *p++ = (BYTE)(v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+		v >>= 7; n++;
+	} while (v);
+	return n;
+}
+
 static
 DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t ofs		/* File offset to be converted to cluster# */
 )
 {
-	DWORD cl, ncl, *tbl;
+	DWORD cl, ncl, d, ord, lcl, *tbl;
+	BYTE *bp, *fbp;
 	FATFS *fs = fp->obj.fs;
 
 
-	tbl = fp->cltbl + 1;	/* Top of CLMT */
+	tbl = fp->cltbl;
 	cl = (DWORD)(ofs / SS(fs) / fs->csize);	/* Cluster order from top of the file */
+	if (cl >= tbl[3]) {		/* Resume from the cursor */
+		bp = (BYTE*)(tbl + CLMT_HDR) + tbl[2]; ord = tbl[3]; lcl = tbl[4];
+	} else {				/* Rewind to top of CLMT */
+		bp = (BYTE*)(tbl + CLMT_HDR); ord = 0; lcl = 0;
+	}
 	for (;;) {
-		ncl = *tbl++;			/* Number of cluters in the fragment */
-		if (ncl == 0) return 0;	/* End of table? (error) */
-		if (cl < ncl) break;	/* In this fragment? */
-		cl -= ncl; tbl++;		/* Next fragment */
+		fbp = bp;
+		bp = clmt_get(bp, &ncl);	/* Number of clusters in the fragment */
+		if (ncl == 0) return 0;		/* End of table? (error) */
+		bp = clmt_get(bp, &d);
+		d = lcl + ((d >> 1) ^ (0 - (d & 1)));	/* Top cluster of the fragment */
+		if (cl - ord < ncl) break;	/* In this fragment? */
+		ord += ncl; lcl = d + ncl;	/* Next fragment */
 	}
-	return cl + *tbl;	/* Return the cluster number */
+	tbl[2] = (DWORD)(fbp - (BYTE*)(tbl + CLMT_HDR));	/* Cursor at this fragment */
+	tbl[3] = ord; tbl[4] = lcl;
+	return cl - ord + d;	/* Return the cluster number */
 }
 
 #endif	/* FF_USE_FASTSEEK */
@@ -3794,7 +3874,7 @@ FRESULT f_sync (
 			/* Update the directory entry */
 			tm = GET_FATTIME();				/* Modified time */
 #if FF_FS_EXFAT
-			if (fs->fs_type == FS_EXFAT) {
+			if (fs->fs_type == FS_EXFAT && fp->dir_ptr) {	/* FlashFloppy: see below */
 				res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
 				if (res == FR_OK) {
 					res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
@@ -4056,6 +4136,9 @@ FRESULT f_lseek (
 	FSIZE_t ifptr;
 #if FF_USE_FASTSEEK
 	DWORD cl, pcl, ncl, tcl, dsc, tlen, ulen, *tbl;
+	DWORD lcl, d, nfrag;
+	BYTE *bp;
+	UINT n;
 #endif
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -4069,28 +4152,35 @@ FRESULT f_lseek (
 
 #if FF_USE_FASTSEEK
 	if (fp->cltbl) {	/* Fast seek */
-		if (ofs == CREATE_LINKMAP) {	/* Create CLMT */
+		if (ofs == CREATE_LINKMAP) {	/* Create CLMT (see clmt_clust) */
 			tbl = fp->cltbl;
-			tlen = *tbl++; ulen = 2;	/* Given table size and required table size */
+			tlen = (tbl[0] - CLMT_HDR) * 4; ulen = 1;	/* Given stream size and required stream size (bytes) */
+			bp = (BYTE*)(tbl + CLMT_HDR);
+			lcl = nfrag = 0;
 			cl = fp->obj.sclust;		/* Origin of the chain */
 			if (cl != 0) {
 				do {
 					/* Get a fragment */
-					tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
+					tcl = cl; ncl = 0; nfrag++;	/* Top, length and number of fragments */
 					do {
 						pcl = cl; ncl++;
 						cl = get_fat(&fp->obj, cl);
 						if (cl <= 1) ABORT(fs, FR_INT_ERR);
 						if (cl == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					} while (cl == pcl + 1);
-					if (ulen <= tlen) {		/* Store the length and top of the fragment */
-						*tbl++ = ncl; *tbl++ = tcl;
+					d = tcl - lcl; d = (d << 1) ^ (0 - (d >> 31));	/* Signed distance from end of previous fragment */
+					n = clmt_put(0, ncl) + clmt_put(0, d);
+					if (ulen + n <= tlen) {		/* Store the length and top of the fragment */
+						bp += clmt_put(bp, ncl); bp += clmt_put(bp, d);
 					}
+					ulen += n; lcl = tcl + ncl;
 				} while (cl < fs->n_fatent);	/* Repeat until end of chain */
 			}
-			*fp->cltbl = ulen;	/* Number of items used */
+			tbl[0] = CLMT_HDR + (ulen + 3) / 4;	/* Number of items used */
+			tbl[1] = nfrag;
+			tbl[2] = tbl[3] = tbl[4] = 0;	/* Cursor at top of the table */
 			if (ulen <= tlen) {
-				*tbl = 0;		/* Terminate table */
+				*bp = 0;		/* Terminate table */
 			} else {
 				res = FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
 			}
@@ -4201,6 +4291,67 @@ FRESULT f_lseek (
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Map a File Offset to Volume Sectors (FlashFloppy)                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_sector (
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t ofs,	/* Sector-aligned file offset */
+	DWORD* sect,	/* Pointer to return the sector number at ofs */
+	UINT* nr		/* Pointer to return the number of consecutive sectors */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, ord, ncl, csect, n;
+	FSIZE_t bcs;
+
+
+	*nr = 0;
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (ofs % SS(fs) || ofs >= fp->obj.objsize) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+	bcs = (FSIZE_t)fs->csize * SS(fs);	/* Cluster size in unit of byte */
+	ord = (DWORD)(ofs / bcs);			/* Cluster order of ofs from top of the file */
+#if FF_FS_EXFAT
+	if (fp->obj.stat == 2) {			/* Contiguous file: one fragment */
+		clst = fp->obj.sclust + ord;
+		ncl = (DWORD)((fp->obj.objsize - 1) / bcs) + 1 - ord;
+	} else
+#endif
+#if FF_USE_FASTSEEK
+	if (fp->cltbl) {					/* Fragment of ofs, from the CLMT */
+		clst = clmt_clust(fp, ofs);		/* Leaves the cursor at the fragment */
+		if (clst < 2) ABORT(fs, FR_INT_ERR);
+		clmt_get((BYTE*)(fp->cltbl + CLMT_HDR) + fp->cltbl[2], &ncl);
+		ncl -= ord - fp->cltbl[3];		/* Clusters from clst to the end of the fragment */
+	} else
+#endif
+	{
+		LEAVE_FF(fs, FR_DENIED);		/* Mapping would follow the FAT chain */
+	}
+	*sect = clst2sect(fs, clst);
+	if (*sect == 0) ABORT(fs, FR_INT_ERR);
+	csect = (DWORD)(ofs / SS(fs) & (fs->csize - 1));	/* Sector offset in the cluster */
+	*sect += csect;
+	n = ncl * fs->csize - csect;
+	if (n > (fp->obj.objsize - ofs + SS(fs) - 1) / SS(fs)) {	/* Clip at end of the file */
+		n = (DWORD)((fp->obj.objsize - ofs + SS(fs) - 1) / SS(fs));
+	}
+#if !FF_FS_READONLY && !FF_FS_TINY
+	if ((fp->flag & FA_DIRTY) && fp->sect - *sect < n) {	/* Stop at the dirty sector cache */
+		n = fp->sect - *sect;
+	}
+#endif
+	*nr = (UINT)n;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+
 #if FF_FS_MINIMIZE <= 1
 /*-----------------------------------------------------------------------*/
 /* Create a Directory Object                                             */
@@ -4335,6 +4486,139 @@ FRESULT f_readdir (
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Move to a Directory Entry (FlashFloppy)                               */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_seekdir (
+	DIR* dp,			/* Pointer to the open directory object */
+	DWORD ofs			/* Byte offset of the entry, as dp->dptr */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		res = dir_sdi(dp, ofs);		/* Next f_readdir() reads from this entry */
+	}
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Open the File at a Directory Entry (FlashFloppy)                      */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_openent (
+	FIL* fp,			/* Pointer to the blank file object */
+	DIR* dp,			/* Pointer to the open directory object */
+	FILINFO* fno		/* Pointer to file information to return */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DEF_NAMBUF
+
+
+	if (!fp || !fno) return FR_INVALID_OBJECT;
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		INIT_NAMBUF(fs);
+		res = dir_read(dp, 0);		/* Read the item which f_readdir() would return */
+		if (res == FR_OK) {
+			get_fileinfo(dp, fno);	/* Get the object information */
+			if (dp->obj.attr & AM_DIR) res = FR_NO_FILE;	/* Cannot open a directory */
+		}
+		if (res == FR_OK) {		/* Open it read-only, as f_open() would */
+			fp->dir_sect = fs->winsect;			/* Pointer to the directory entry */
+			fp->dir_ptr = dp->dir;
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				fp->obj.c_scl = dp->obj.sclust;							/* Get containing directory info */
+				fp->obj.c_size = ((DWORD)dp->obj.objsize & 0xFFFFFF00) | dp->obj.stat;
+				fp->obj.c_ofs = dp->blk_ofs;
+				fp->obj.sclust = ld_dword(fs->dirbuf + XDIR_FstClus);	/* Get object allocation info */
+				fp->obj.objsize = ld_qword(fs->dirbuf + XDIR_FileSize);
+				fp->obj.stat = fs->dirbuf[XDIR_GenFlags] & 2;
+				fp->obj.n_frag = 0;
+			} else
+#endif
+			{
+				fp->obj.sclust = ld_clust(fs, dp->dir);					/* Get object allocation info */
+				fp->obj.objsize = ld_dword(dp->dir + DIR_FileSize);
+			}
+#if FF_USE_FASTSEEK
+			fp->cltbl = 0;			/* Disable fast seek mode */
+#endif
+			fp->obj.fs = fs;	 	/* Validate the file object */
+			fp->obj.id = fs->id;
+			fp->obj.attr = dp->obj.attr;
+			fp->flag = FA_READ;		/* Set file access mode */
+			fp->err = 0;			/* Clear error flag */
+			fp->sect = 0;			/* Invalidate current data sector */
+			fp->fptr = 0;			/* Set file pointer top of the file */
+#if !FF_FS_TINY
+			mem_set(fp->buf, 0, FF_MAX_SS);	/* Clear sector buffer */
+#endif
+		}
+		FREE_NAMBUF();
+	}
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Raw Directory Sectors (FlashFloppy)                              */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readdir_raw (
+	DIR* dp,			/* Pointer to the open directory object */
+	BYTE* buff,			/* Pointer to the sector buffer */
+	UINT n,				/* Maximum number of sectors to read */
+	UINT* nr			/* Number of sectors read (0:end of directory) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD left;
+	UINT cnt;
+
+
+	*nr = 0;
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+#if !FF_FS_READONLY
+	if (res == FR_OK) res = sync_window(fs);	/* Raw sectors must match the window */
+#endif
+	if (res == FR_OK && dp->sect != 0 && n != 0) {
+		if (dp->clust == 0) {	/* Static table: sectors to end of the root directory */
+			left = fs->dirbase + (DWORD)fs->n_rootdir * SZDIRE / SS(fs) - dp->sect;
+		} else {				/* Dynamic table: sectors to end of the current cluster */
+			left = fs->csize - (dp->sect - fs->database) % fs->csize;
+		}
+		cnt = (left < n) ? (UINT)left : n;
+		if (disk_read(fs->pdrv, buff, dp->sect, cnt) != RES_OK) {
+			res = FR_DISK_ERR;
+		} else {
+			*nr = cnt;
+			for (cnt *= SS(fs) / SZDIRE; cnt && res == FR_OK; cnt--) {
+				res = dir_next(dp, 0);	/* Step over the sectors just read */
+			}
+			if (res == FR_NO_FILE) res = FR_OK;	/* Ignore end of directory now */
+		}
+	}
+	LEAVE_FF(fs, res);
+}
+
+
+
 #if FF_USE_FIND
 /*-----------------------------------------------------------------------*/
 /* Find Next File                                                        */
@@ -5172,6 +5456,14 @@ FRESULT f_setlabel (
 /* Allocate a Contiguous Blocks to the File                              */
 /*-----------------------------------------------------------------------*/
 
+/* FlashFloppy: A non-empty file may be grown (opt 1). On FAT the new 
+   clusters are allocated as one contiguous block: immediately following the 
+   file's last cluster if possible, else the best-fitting free block. On exFAT
+   only a contiguous (NoFatChain) file may grow, and only into the clusters 
+   immediately following it, so that it stays contiguous. */
+
+#define EXPAND_SCAN_BUDGET	16384	/* Clusters scanned once a fitting block is seen */
+
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
@@ -5180,23 +5472,47 @@ FRESULT f_expand (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst, ecl, ocl, bcl, bncl, budget;
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
-	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (fsz == 0 || fsz <= fp->obj.objsize || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (fp->obj.objsize != 0 && !opt) LEAVE_FF(fs, FR_DENIED);
 #if FF_FS_EXFAT
 	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
-	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
+	ocl = (DWORD)(fp->obj.objsize / n) + ((fp->obj.objsize & (n - 1)) ? 1 : 0);	/* Number of clusters allocated */
+	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0) - ocl;	/* Number of clusters required */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
 
+	/* Find the file's last cluster */
+	ecl = 0;
+	if (ocl != 0) {
+		ecl = fp->obj.sclust;
+		for (n = 1; n < ocl; n++) {
+			ecl = get_fat(&fp->obj, ecl);
+			if (ecl == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+			if (ecl < 2 || ecl >= fs->n_fatent) LEAVE_FF(fs, FR_INT_ERR);
+		}
+	}
+	if (tcl == 0) {		/* Grows within the last cluster */
+		fp->obj.objsize = fsz;
+		fp->flag |= FA_MODIFIED;
+		LEAVE_FF(fs, FR_OK);
+	}
+
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
-		scl = find_bitmap(fs, stcl, tcl);			/* Find a contiguous cluster block */
+		if (ecl != 0) {		/* A contiguous (NoFatChain) file can only grow into the block following it */
+			ncl = (fp->obj.stat == 2) ? free_run_bitmap(fs, ecl + 1, tcl) : 0;
+			scl = (ncl == tcl) ? ecl + 1 : 0;
+			if (ncl == 0xFFFFFFFF) scl = 0xFFFFFFFF;
+		} else {
+			scl = find_bitmap(fs, stcl, tcl);		/* Find a contiguous cluster block */
+		}
 		if (scl == 0) res = FR_DENIED;				/* No contiguous cluster block was found */
 		if (scl == 0xFFFFFFFF) res = FR_DISK_ERR;
 		if (res == FR_OK) {	/* A contiguous free area is found */
@@ -5210,18 +5526,38 @@ FRESULT f_expand (
 	} else
 #endif
 	{
-		scl = clst = stcl; ncl = 0;
-		for (;;) {	/* Find a contiguous cluster block */
-			n = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
-			if (n == 1) { res = FR_INT_ERR; break; }
-			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-			if (n == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
-			} else {
-				scl = clst; ncl = 0;		/* Not a free cluster */
+		scl = 0;
+		if (ecl != 0) {		/* Is the block following the file free? */
+			for (clst = ecl + 1, ncl = 0; ncl < tcl && clst < fs->n_fatent; clst++, ncl++) {
+				n = get_fat(&fp->obj, clst);
+				if (n == 1) { res = FR_INT_ERR; break; }
+				if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (n != 0) break;
+			}
+			if (ncl == tcl) scl = ecl + 1;
+		}
+		if (res == FR_OK && scl == 0) {	/* Find the best-fitting free block */
+			bcl = 0; bncl = 0xFFFFFFFF; budget = EXPAND_SCAN_BUDGET;
+			stcl = ncl = 0;
+			for (clst = 2; clst < fs->n_fatent && budget != 0; clst++) {
+				n = get_fat(&fp->obj, clst);
+				if (n == 1) { res = FR_INT_ERR; break; }
+				if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (n == 0 && ncl++ == 0) stcl = clst;	/* Free cluster: extend the current block */
+				if (n != 0 || clst == fs->n_fatent - 1) {	/* End of a free block? */
+					if (ncl >= tcl && ncl < bncl) {
+						bcl = stcl; bncl = ncl;
+						if (ncl == tcl) break;		/* Exact fit */
+					}
+					ncl = 0;
+				}
+				if (bcl != 0 || ncl >= tcl) budget--;	/* Some block fits: limit the search */
+			}
+			if (ncl >= tcl && ncl < bncl) bcl = stcl;	/* Budget ran out within a fitting block */
+			if (res == FR_OK) {
+				if (bcl == 0) res = FR_DENIED;	/* No contiguous cluster? */
+				scl = bcl;
 			}
-			if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous cluster? */
 		}
 		if (res == FR_OK) {	/* A contiguous free area is found */
 			if (opt) {		/* Allocate it now */
@@ -5230,6 +5566,7 @@ FRESULT f_expand (
 					if (res != FR_OK) break;
 					lclst = clst;
 				}
+				if (res == FR_OK && ecl != 0) res = put_fat(fs, ecl, scl);	/* Link to the file's chain */
 			} else {		/* Set it as suggested point for next allocation */
 				lclst = scl - 1;
 			}
@@ -5239,7 +5576,7 @@ FRESULT f_expand (
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
-			fp->obj.sclust = scl;		/* Update object allocation information */
+			if (ecl == 0) fp->obj.sclust = scl;		/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
 			fp->flag |= FA_MODIFIED;
@@ -239,6 +239,7 @@ typedef enum {
 	FR_BAD_IMAGECFG,	/* (33) Bad IMAGE_A.CFG file */
 	FR_NO_DIRENTS,		/* (34) No valid directory entries */
 	FR_PATH_TOO_DEEP,	/* (35) Folders nested too deeply */
+	FR_HXC_EXFAT,		/* (36) HxC selector mode on an exFAT volume */
 } FRESULT;
 
 
@@ -251,11 +252,15 @@ FRESULT f_close (FIL* fp);											/* Close an open file object */
 FRESULT f_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from the file */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to the file */
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
+FRESULT f_sector (FIL* fp, FSIZE_t ofs, DWORD* sect, UINT* nr);	/* Map a file offset to volume sectors */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
+FRESULT f_seekdir (DIR* dp, DWORD ofs);								/* Move to a directory item */
+FRESULT f_openent (FIL* fp, DIR* dp, FILINFO* fno);					/* Open the file at a directory item */
+FRESULT f_readdir_raw (DIR* dp, BYTE* buff, UINT n, UINT* nr);		/* Read raw directory sectors */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
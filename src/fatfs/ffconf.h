@@ -58,7 +58,11 @@
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
+#if defined(BOOTLOADER) || defined(RELOADER)
 #define FF_USE_EXPAND	0
+#else
+#define FF_USE_EXPAND	1
+#endif
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -222,7 +226,11 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#if defined(BOOTLOADER) || defined(RELOADER)
 #define FF_FS_EXFAT		0
+#else
+#define FF_FS_EXFAT		1
+#endif
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled.
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
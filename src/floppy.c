@@ -235,6 +235,10 @@ void floppy_cancel(void)
     dma_rdata.ccr = 0;
     dma_wdata.ccr = 0;
 
+    /* The image's buffers are about to be released: complete any volume 
+     * requests into them, and tear down the volume cache which they hold. */
+    volume_cache_destroy();
+
     /* Clear soft state. */
     timer_cancel(&index.timer);
     barrier(); /* cancel index.timer /then/ clear soft state */
@@ -377,6 +381,14 @@ void floppy_init(void)
     timer_init(&index.timer_deassert, index_deassert, NULL);
 }
 
+/* Number of fragments in the most recently inserted image file. */
+static uint32_t image_frags;
+
+unsigned int floppy_image_frags(void)
+{
+    return image_frags;
+}
+
 void floppy_insert(unsigned int unit, struct slot *slot)
 {
     struct image *im;
@@ -396,15 +408,17 @@ void floppy_insert(unsigned int unit, struct slot *slot)
         im = arena_alloc(sizeof(*im));
         memset(im, 0, sizeof(*im));
 
-        /* Create a fast-seek cluster table for the image. */
-#define MAX_FILE_FRAGS 511 /* up to a 4kB cluster table */
+        /* Create a fast-seek cluster table for the image. The table is packed,
+         * typically holding over a thousand fragments. */
+#define MAX_CLTBL_SZ 4096 /* up to a 4kB cluster table */
         cltbl = arena_alloc(0);
-        *cltbl = (MAX_FILE_FRAGS + 1) * 2;
+        *cltbl = MAX_CLTBL_SZ / 4;
         fatfs_from_slot(&im->fp, slot, FA_READ);
         fastseek_sz = f_size(&im->fp);
         im->fp.cltbl = cltbl;
         fr = f_lseek(&im->fp, CREATE_LINKMAP);
-        printk("Fast Seek: %u frags\n", (*cltbl / 2) - 1);
+        image_frags = cltbl[1];
+        printk("Fast Seek: %u frags, %u bytes\n", image_frags, *cltbl * 4);
         if (fr == FR_OK) {
             DWORD *_cltbl = arena_alloc(*cltbl * 4);
             ASSERT(_cltbl == cltbl);
@@ -437,6 +451,7 @@ void floppy_insert(unsigned int unit, struct slot *slot)
         ASSERT(im->bufs.read_data.len >= 20*1024);
 
         /* Mount the image file. */
+        volume_set_tag(VOL_TAG_image);
         image_open(im, slot, cltbl);
         if (!im->handler->write_track || volume_readonly())
             slot->attributes |= AM_RDO;
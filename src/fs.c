@@ -130,7 +130,7 @@ void F_lseek(FIL *fp, DWORD ofs)
 #if !FF_FS_READONLY
     if (!fp->dir_ptr) {
         /* File cannot be resized. Clip the seek offset. */
-        ofs = min(ofs, f_size(fp));
+        ofs = min_t(FSIZE_t, ofs, f_size(fp));
     }
 #endif
     fr = f_lseek(fp, ofs);
@@ -155,6 +155,12 @@ void F_readdir(DIR *dp, FILINFO *fno)
     handle_fr(fr);
 }
 
+void F_seekdir(DIR *dp, DWORD ofs)
+{
+    FRESULT fr = f_seekdir(dp, ofs);
+    handle_fr(fr);
+}
+
 void F_findfirst(DIR *dp, FILINFO *fno, const TCHAR *path,
                  const TCHAR *pattern)
 {
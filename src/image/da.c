@@ -15,6 +15,14 @@
 
 #define SEC_SZ 512
 
+/* Layout of the write_data buffer in D-A mode:
+ *  [0,RA_OFF): Single-sector staging for reads and writes.
+ *  [RA_OFF,CACHE_OFF): Read-ahead window (also name-search scratch space).
+ *  [CACHE_OFF,len): Volume cache. */
+#define RA_NR     16 /* Read-ahead window, in sectors */
+#define RA_OFF    1024
+#define CACHE_OFF (RA_OFF + RA_NR*SEC_SZ)
+
 #define CMD_NOP          0
 #define CMD_SET_LBA      1 /* p[0-3] = LBA (little endian) */
 #define CMD_SET_CYL      2 /* p[0] = drive A cyl, p[1] = drive B cyl */
@@ -55,8 +63,14 @@ static void da_seek_track(struct image *im, uint16_t track)
         return;
     im->cur_track = track;
 
-    volume_cache_init(im->bufs.write_data.p + SEC_SZ + 2,
+    /* Reset all state, including the read-ahead window: it describes 
+     * sectors parked in the cache which we are about to re-initialise. */
+    memset(&im->da, 0, sizeof(im->da));
+
+    ASSERT(CACHE_OFF < im->bufs.write_data.len);
+    volume_cache_init(im->bufs.write_data.p + CACHE_OFF,
                       im->bufs.write_data.p + im->bufs.write_data.len);
+    volume_set_tag(VOL_TAG_da);
 
     switch (display_mode) {
     case DM_LED_7SEG:
@@ -69,8 +83,6 @@ static void da_seek_track(struct image *im, uint16_t track)
         break;
     }
 
-    memset(&im->da, 0, sizeof(im->da));
-
     snprintf(dass->sig, sizeof(dass->sig), "%s", DA_SIG);
     snprintf(dass->fw_ver, sizeof(dass->fw_ver),
              version_override ? "%s" : "FF-v%s",
@@ -164,6 +176,32 @@ static void da_setup_track(
     }
 }
 
+static void da_read_sector(struct image *im, uint8_t *buf, uint32_t lba)
+{
+    struct directaccess *da = &im->da;
+    uint32_t base = da->dass.lba_base, start, end;
+    FATFS *fs = im->fp.obj.fs;
+
+    /* If the host is walking the LBA space sequentially (eg. reading a 
+     * directory), fetch a whole window of sectors in a single mass-storage 
+     * read. The window is parked in the volume cache, from which this and 
+     * subsequent sector requests are served. */
+    if (da->ra_seq && ((lba - da->ra_lba) >= da->ra_nr)) {
+        start = ((lba - base) < RA_NR) ? base : lba;
+        end = fs->database + (fs->n_fatent - 2) * fs->csize;
+        if (start < end) {
+            da->ra_lba = start;
+            da->ra_nr = min_t(uint32_t, RA_NR, end - start);
+            if (disk_read(0, im->bufs.write_data.p + RA_OFF,
+                          da->ra_lba, da->ra_nr) != RES_OK)
+                F_die(FR_DISK_ERR);
+        }
+    }
+
+    if (disk_read(0, buf, lba, 1) != RES_OK)
+        F_die(FR_DISK_ERR);
+}
+
 static bool_t da_read_track(struct image *im)
 {
     struct da_status_sector *dass = &im->da.dass;
@@ -182,8 +220,7 @@ static bool_t da_read_track(struct image *im)
             if (sec == 1)
                 strcpy((char *)buf, im->slot->name);
         } else {
-            if (disk_read(0, buf, dass->lba_base+sec-1, 1) != RES_OK)
-                F_die(FR_DISK_ERR);
+            da_read_sector(im, buf, dass->lba_base+sec-1);
         }
         rd->prod++;
         if (++im->da.trk_sec >= (dass->nr_sec + 1))
@@ -496,15 +533,20 @@ static void process_wdata(struct image *im, unsigned int sect, uint16_t crc)
         case CMD_NOP:
             dass->last_cmd_status = 0; /* ok */
             break;
-        case CMD_SET_LBA:
+        case CMD_SET_LBA: {
+            uint32_t prev_lba = dass->lba_base, prev_nr = dass->nr_sec;
             for (i = 0; i < 4; i++) {
                 dass->lba_base <<= 8;
                 dass->lba_base |= dac->param[3-i];
             }
             dass->nr_sec = dac->param[5] ?: (im->sync == SYNC_fm) ? 4 : 8;
-            printk("D-A LBA %08x, nr=%u\n", dass->lba_base, dass->nr_sec);
+            /* Read ahead if the host is stepping forward through the LBAs. */
+            im->da.ra_seq = ((dass->lba_base - prev_lba - 1) < prev_nr);
+            printk("D-A LBA %08x, nr=%u%s\n", dass->lba_base, dass->nr_sec,
+                   im->da.ra_seq ? " (seq)" : "");
             dass->last_cmd_status = 0; /* ok */
             break;
+        }
         case CMD_SET_CYL:
             printk("D-A Cyl A=%u B=%u\n", dac->param[0], dac->param[1]);
             for (i = 0; i < 2; i++)
@@ -526,7 +568,10 @@ static void process_wdata(struct image *im, unsigned int sect, uint16_t crc)
             int index;
             char *name = (char *)dac->param;
             name[FF_MAX_LFN] = '\0';
-            index = set_slot_by_name(name, wrbuf + 512);
+            index = set_slot_by_name(name, wrbuf + RA_OFF);
+            /* The name search scribbles on the read-ahead window and churns 
+             * the cache: refetch the window on the next sequential read. */
+            im->da.ra_nr = 0;
             printk("D-A Img By Name \"%s\" %u -> %d\n",
                    name, dass->current_index, index);
             if (index >= 0) {
@@ -546,6 +591,8 @@ static void process_wdata(struct image *im, unsigned int sect, uint16_t crc)
         t = time_now();
         if (disk_write(0, wrbuf, dass->lba_base+sect-1, 1) != RES_OK)
             F_die(FR_DISK_ERR);
+        /* The host may have changed the current folder. */
+        invalidate_slot_names();
         printk("%u us\n", time_diff(t, time_now()) / TIME_MHZ);
     }
 }
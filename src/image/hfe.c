@@ -71,6 +71,7 @@ enum {
 #define RDATA_BUFLEN 16384
 
 static void hfe_seek_track(struct image *im, uint16_t track);
+static bool_t hfe_read_batch(struct image *im, bool_t async);
 
 static bool_t hfe_open(struct image *im)
 {
@@ -108,7 +109,7 @@ static bool_t hfe_open(struct image *im)
     ASSERT(RDATA_BUFLEN + 8*512 <= im->bufs.read_data.len);
     volume_cache_init(im->bufs.read_data.p + RDATA_BUFLEN + 8*512,
                       im->bufs.read_data.p + im->bufs.read_data.len);
-    volume_cache_metadata_only(&im->fp);
+    volume_cache_metadata_only();
 
     /* Get an initial value for ticks per revolution. */
     hfe_seek_track(im, 0);
@@ -143,6 +144,12 @@ static void hfe_setup_track(
     side = min_t(uint8_t, side, im->nr_sides-1);
     track = cyl*2 + side;
 
+    /* The ring is about to be reset: abandon any batch being read into it. */
+    if (im->hfe.read_batch.count) {
+        (void)volume_complete(&im->hfe.read_batch);
+        im->hfe.read_batch.count = 0;
+    }
+
     if (track != im->cur_track)
         hfe_seek_track(im, track);
 
@@ -165,7 +172,7 @@ static void hfe_setup_track(
     if (start_pos) {
         /* Read mode. */
         im->hfe.trk_pos = (im->cur_bc/8) & ~255;
-        image_read_track(im);
+        (void)hfe_read_batch(im, FALSE);
         rd->cons = im->cur_bc & 2047;
         *start_pos = sys_ticks;
     } else {
@@ -176,21 +183,54 @@ static void hfe_setup_track(
     }
 }
 
-static bool_t hfe_read_track(struct image *im)
+/* Read the next batch of track data into the staging area which follows the
+ * ring buffer, and copy this side's half of each sector into the ring. If 
+ * @async, and the batch is a contiguous run of volume sectors, the read is 
+ * submitted to the volume and the batch is copied on a later call, once the 
+ * read is complete. This leaves the main loop free while USB is busy. */
+static bool_t hfe_read_batch(struct image *im, bool_t async)
 {
     const unsigned int buflen = RDATA_BUFLEN, bufmask = buflen - 1;
     struct image_buf *rd = &im->bufs.read_data;
+    struct volume_req *req = &im->hfe.read_batch;
     uint8_t *buf = rd->p;
     unsigned int i, nr_sec;
+    FSIZE_t off;
+    DWORD sect;
+    UINT nr;
+
+    if (req->count == 0) {
+        nr_sec = min_t(unsigned int, im->hfe.batch_secs,
+                       (im->hfe.trk_len+255 - im->hfe.trk_pos) / 256);
+        if ((uint32_t)(rd->prod - rd->cons) > (buflen - nr_sec*256) * 8)
+            return FALSE;
+        off = im->hfe.trk_off * 512 + im->hfe.trk_pos * 2;
+        if (async && (f_sector(&im->fp, off, &sect, &nr) == FR_OK)
+            && (nr >= nr_sec)) {
+            req->buff = &buf[buflen];
+            req->lba = sect;
+            req->count = nr_sec;
+            req->write = FALSE;
+            req->done = NULL;
+            if (volume_submit(req) != RES_OK)
+                req->count = 0;
+        }
+        if (req->count == 0) {
+            F_lseek(&im->fp, off);
+            F_read(&im->fp, &buf[buflen], nr_sec*512, NULL);
+            goto copy;
+        }
+    }
 
-    nr_sec = min_t(unsigned int, im->hfe.batch_secs,
-                   (im->hfe.trk_len+255 - im->hfe.trk_pos) / 256);
-    if ((uint32_t)(rd->prod - rd->cons) > (buflen - nr_sec*256) * 8)
+    /* Batch in flight: copy it once it is read. */
+    if (!volume_req_done(req))
         return FALSE;
+    if (req->res != RES_OK)
+        F_die(FR_DISK_ERR);
+    nr_sec = req->count;
+    req->count = 0;
 
-    F_lseek(&im->fp, im->hfe.trk_off * 512 + im->hfe.trk_pos * 2);
-    F_read(&im->fp, &buf[buflen], nr_sec*512, NULL);
-
+copy:
     for (i = 0; i < nr_sec; i++) {
         memcpy(&buf[(rd->prod/8) & bufmask],
                &buf[buflen + i*512 + (im->cur_track&1)*256],
@@ -206,6 +246,11 @@ static bool_t hfe_read_track(struct image *im)
     return TRUE;
 }
 
+static bool_t hfe_read_track(struct image *im)
+{
+    return hfe_read_batch(im, TRUE);
+}
+
 static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
 {
     const unsigned int buflen = RDATA_BUFLEN, bufmask = buflen - 1;
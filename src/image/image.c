@@ -180,6 +180,7 @@ void image_open(struct image *im, struct slot *slot, DWORD *cltbl)
 void image_extend(struct image *im)
 {
     FSIZE_t new_sz;
+    FRESULT fr;
 
     if (!(im->handler->extend && im->fp.dir_ptr && ff_cfg.extend_image))
         return;
@@ -188,17 +189,28 @@ void image_extend(struct image *im)
     if (f_size(&im->fp) >= new_sz)
         return;
 
-    /* Disable fast-seek mode, as it disallows extending the file. */
+    /* Disable fast-seek mode, as it disallows extending the file. The caller
+     * re-opens the extended image, with a new fast-seek map. */
     im->fp.cltbl = NULL;
 
-    /* Attempt to extend the file. */
-    F_lseek(&im->fp, new_sz);
+    /* Attempt to extend the file with one contiguous run of clusters, else 
+     * with whatever free clusters can be found. */
+    fr = f_expand(&im->fp, new_sz, 1);
+    if (fr == FR_DENIED) {
+        printk("Extend: no contiguous space\n");
+        F_lseek(&im->fp, new_sz);
+    } else if (fr) {
+        F_die(fr);
+    }
     F_sync(&im->fp);
-    if (f_tell(&im->fp) != new_sz)
+    if (f_size(&im->fp) != new_sz)
         F_die(FR_DISK_FULL);
 
-    /* Update the slot for the new file size. */
+    /* Update the slot for the new file size. A contiguous exFAT file which
+     * was extended by F_lseek() now has a FAT chain: the re-opened image must
+     * follow it. */
     im->slot->size = new_sz;
+    im->slot->attributes = file_attributes(&im->fp);
 }
 
 bool_t image_setup_track(
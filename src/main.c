@@ -19,6 +19,35 @@ static struct {
     char buf[512];
 } *fs;
 
+/* A current directory, as saved and restored around FatFS calls. On exFAT the
+ * location of the directory's own entry is needed as well as its cluster. */
+struct fs_cdir {
+    uint32_t cdir;
+#if FF_FS_EXFAT
+    uint32_t cdc_scl, cdc_size, cdc_ofs;
+#endif
+};
+
+static void cdir_save(struct fs_cdir *c)
+{
+    c->cdir = fatfs.cdir;
+#if FF_FS_EXFAT
+    c->cdc_scl = fatfs.cdc_scl;
+    c->cdc_size = fatfs.cdc_size;
+    c->cdc_ofs = fatfs.cdc_ofs;
+#endif
+}
+
+static void cdir_restore(const struct fs_cdir *c)
+{
+    fatfs.cdir = c->cdir;
+#if FF_FS_EXFAT
+    fatfs.cdc_scl = c->cdc_scl;
+    fatfs.cdc_size = c->cdc_size;
+    fatfs.cdc_ofs = c->cdc_ofs;
+#endif
+}
+
 static struct {
     uint16_t slot_nr, max_slot_nr;
     uint8_t slot_map[1000/8];
@@ -27,9 +56,9 @@ static struct {
         struct { struct short_slot imgcfg; };
     };
     struct slot slot;
-    uint32_t cfg_cdir, cur_cdir;
+    struct fs_cdir cfg_cdir, cur_cdir;
     struct {
-        uint32_t cdir;
+        struct fs_cdir cdir;
         uint16_t slot;
     } stack[20];
     uint8_t depth;
@@ -38,6 +67,7 @@ static struct {
     uint8_t hxc_mode:1;
     uint8_t ejected:1;
     uint8_t ima_ej_flag:1; /* "\\EJ" flag in IMAGE_A.CFG? */
+    uint8_t has_ff_dir:1; /* FF/ folder exists? (cfg_cdir is root if not) */
     /* FF.CFG values which override HXCSDFE.CFG. */
     uint8_t ffcfg_has_step_volume:1;
     uint8_t ffcfg_has_display_off_secs:1;
@@ -473,6 +503,9 @@ static void slot_from_short_slot(
     slot->firstCluster = short_slot->firstCluster;
     slot->size = short_slot->size;
     slot->dir_sect = slot->dir_ptr = 0;
+#if FF_FS_EXFAT
+    slot->c_scl = slot->c_size = slot->c_ofs = 0;
+#endif
 }
 
 static void fatfs_to_short_slot(
@@ -481,7 +514,7 @@ static void fatfs_to_short_slot(
     char *dot;
     unsigned int i;
 
-    slot->attributes = file->obj.attr;
+    slot->attributes = file_attributes(file);
     slot->firstCluster = file->obj.sclust;
     slot->size = file->obj.objsize;
     snprintf(slot->name, sizeof(slot->name), "%s", name);
@@ -500,9 +533,15 @@ void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode)
     memset(file, 0, sizeof(*file));
     file->obj.fs = &fatfs;
     file->obj.id = fatfs.id;
-    file->obj.attr = slot->attributes;
+    file->obj.attr = slot->attributes & ~AM_CONTIG;
     file->obj.sclust = slot->firstCluster;
     file->obj.objsize = slot->size;
+#if FF_FS_EXFAT
+    file->obj.stat = (slot->attributes & AM_CONTIG) ? 2 : 0;
+    file->obj.c_scl = slot->c_scl;
+    file->obj.c_size = slot->c_size;
+    file->obj.c_ofs = slot->c_ofs;
+#endif
     file->flag = mode;
     file->dir_sect = slot->dir_sect;
     file->dir_ptr = (void *)slot->dir_ptr;
@@ -513,11 +552,16 @@ static void fatfs_to_slot(struct slot *slot, FIL *file, const char *name)
     char *dot;
     unsigned int i;
 
-    slot->attributes = file->obj.attr;
+    slot->attributes = file_attributes(file);
     slot->firstCluster = file->obj.sclust;
     slot->size = file->obj.objsize;
     slot->dir_sect = file->dir_sect;
     slot->dir_ptr = (uint32_t)file->dir_ptr;
+#if FF_FS_EXFAT
+    slot->c_scl = file->obj.c_scl;
+    slot->c_size = file->obj.c_size;
+    slot->c_ofs = file->obj.c_ofs;
+#endif
     snprintf(slot->name, sizeof(slot->name), "%s", name);
     if ((dot = strrchr(slot->name, '.')) != NULL) {
         snprintf(slot->type, sizeof(slot->type), "%s", dot+1);
@@ -551,9 +595,39 @@ static void dump_file(void)
 #endif
 }
 
+/* Native navigation: index of the directory entries of the current folder's
+ * slots, so that any slot is found without a directory scan. NAVMODE_indexed
+ * uses it to map slot numbers to image entries. The index lives in the 
+ * navigation arena, and so is rebuilt after an image has been run. */
+#define DIR_INDEX_MAX 4000
+static struct {
+    uint16_t *ent; /* entry number (byte offset / 32) of each slot */
+    uint16_t nr, max;
+    bool_t valid;
+} dir_index;
+
+/* Native navigation: hashes of the current folder's entry names, for lookup 
+ * by name. This is static, so that it survives while an image is mounted. A 
+ * hash hit is checked against the entry itself; a miss falls back to a scan, 
+ * which rebuilds the table. */
+#define NAME_INDEX_MAX 256
+static struct {
+    uint32_t cdir;
+    uint16_t nr;
+    bool_t valid;
+    struct {
+        uint16_t hash; /* crc16 of the name */
+        uint16_t ent;  /* entry number (byte offset / 32) */
+    } ent[NAME_INDEX_MAX];
+} name_index;
+
+/* Directory offset of the entry last returned by native_dir_next(). */
+static uint32_t dir_pos;
+
 static bool_t native_dir_next(void)
 {
     for (;;) {
+        dir_pos = fs->dp.dptr;
         F_readdir(&fs->dp, &fs->fp);
         if (fs->fp.fname[0] == '\0')
             return FALSE;
@@ -577,9 +651,276 @@ static bool_t native_dir_next(void)
     return TRUE;
 }
 
-int set_slot_by_name(const char *name, void *scratch)
+/* Record the name of the @nr'th entry of the current folder, now in fs->fp. */
+static void name_index_add(unsigned int nr)
+{
+    if (nr >= NAME_INDEX_MAX)
+        return;
+    name_index.ent[nr].hash = crc16_ccitt(
+        fs->fp.fname, strnlen(fs->fp.fname, sizeof(fs->fp.fname)), 0xffff);
+    name_index.ent[nr].ent = dir_pos / 32;
+    name_index.nr = nr + 1;
+}
+
+void invalidate_slot_names(void)
+{
+    name_index.valid = FALSE;
+}
+
+/* Index the current folder. Returns the number of entries found. */
+static unsigned int native_dir_index(void)
+{
+    unsigned int nr = 0;
+
+    name_index.valid = FALSE;
+    name_index.nr = 0;
+
+    F_opendir(&fs->dp, "");
+    while (native_dir_next()) {
+        if (nr < dir_index.max)
+            dir_index.ent[nr] = dir_pos / 32;
+        name_index_add(nr);
+        nr++;
+    }
+    F_closedir(&fs->dp);
+
+    dir_index.nr = min_t(unsigned int, nr, dir_index.max);
+    dir_index.valid = TRUE;
+    name_index.cdir = fatfs.cdir;
+    name_index.valid = TRUE;
+    return nr;
+}
+
+/* Find the slot of the current folder's entry named @name, leaving the entry 
+ * in fs->fp. If @prefix, the first entry whose name begins with @name will do.
+ * Returns -1 if there is no such entry. */
+static int native_dir_find(const char *name, bool_t prefix)
+{
+    unsigned int i, len = strnlen(name, FF_MAX_LFN+1);
+    uint16_t hash = crc16_ccitt(name, len, 0xffff);
+    bool_t ok;
+
+    /* Exact match by name hash. A prefix match must be the first in folder 
+     * order, so needs a scan. */
+    if (!prefix && name_index.valid && (name_index.cdir == fatfs.cdir)) {
+        for (i = 0; i < name_index.nr; i++) {
+            if (name_index.ent[i].hash != hash)
+                continue;
+            F_opendir(&fs->dp, "");
+            F_seekdir(&fs->dp, name_index.ent[i].ent * 32);
+            ok = native_dir_next() && !strcmp(fs->fp.fname, name);
+            F_closedir(&fs->dp);
+            if (ok)
+                return i + (cfg.depth ? 1 : 0);
+        }
+    }
+
+    /* Scan the folder, hashing names as we go. */
+    name_index.valid = FALSE;
+    name_index.nr = 0;
+    F_opendir(&fs->dp, "");
+    for (i = 0; (ok = native_dir_next()); i++) {
+        name_index_add(i);
+        if (prefix ? !strncmp(fs->fp.fname, name, len)
+            : !strcmp(fs->fp.fname, name))
+            break;
+    }
+    F_closedir(&fs->dp);
+    name_index.cdir = fatfs.cdir;
+    name_index.valid = TRUE;
+
+    return ok ? i + (cfg.depth ? 1 : 0) : -1;
+}
+
+/* Optional on-stick copy of the folder indexes, in FF/DIRINDEX.DAT. Each
+ * record is keyed by the folder's start cluster, and is valid only while a
+ * CRC over the folder's raw directory sectors, and over the configuration
+ * which decides what is indexed, is unchanged. The raw sectors are read in
+ * bulk, which is much quicker than the entry-by-entry scan they replace. */
+#define DIR_INDEX_FILE "DIRINDEX.DAT"
+#define DIR_INDEX_FILE_MAX 65536
+struct dir_index_rec {
+    uint32_t cdir;   /* folder start cluster, or DIR_INDEX_DEAD */
+    uint16_t crc;
+    uint16_t nr;     /* entries in the folder */
+    uint16_t nr_ent; /* entries in this record: min(nr, DIR_INDEX_MAX) */
+    uint16_t rsvd;
+};
+#define DIR_INDEX_DEAD 0xffffffffu
+
+/* CRC of the current folder's directory sectors. Clobbers the index. */
+static uint16_t native_dir_crc(void)
+{
+    uint8_t *buf = (uint8_t *)dir_index.ent;
+    UINT max = dir_index.max * sizeof(*dir_index.ent) / FF_MAX_SS, nr;
+    uint16_t crc;
+    FRESULT fr;
+
+    dir_index.valid = FALSE;
+
+    crc = crc16_ccitt(&ff_cfg, sizeof(ff_cfg), 0xffff);
+    crc = crc16_ccitt(&display_mode, sizeof(display_mode), crc);
+
+    F_opendir(&fs->dp, "");
+    do {
+        if ((fr = f_readdir_raw(&fs->dp, buf, max, &nr)) != FR_OK)
+            F_die(fr);
+        crc = crc16_ccitt(buf, nr * FF_MAX_SS, crc);
+    } while (nr);
+    F_closedir(&fs->dp);
+
+    return crc;
+}
+
+/* Find the record for folder @cdir in the open index file. Returns the
+ * record's file offset, with the file positioned at its entries, or -1. */
+static int dir_index_find(uint32_t cdir, struct dir_index_rec *rec)
+{
+    int off = 0;
+    UINT nr;
+
+    for (;;) {
+        F_read(&fs->file, rec, sizeof(*rec), &nr);
+        if (nr != sizeof(*rec))
+            return -1;
+        if (rec->cdir == cdir)
+            return off;
+        off += sizeof(*rec) + rec->nr_ent * sizeof(*dir_index.ent);
+        F_lseek(&fs->file, off);
+    }
+}
+
+static bool_t dir_index_load(uint32_t cdir, uint16_t crc, unsigned int *p_nr)
+{
+    struct dir_index_rec rec;
+    struct fs_cdir cur;
+    UINT sz, nr;
+    bool_t ok = FALSE;
+
+    cdir_save(&cur);
+    cdir_restore(&cfg.cfg_cdir);
+    if (F_try_open(&fs->file, DIR_INDEX_FILE, FA_READ) != FR_OK)
+        goto out;
+    if ((dir_index_find(cdir, &rec) >= 0) && (rec.crc == crc)
+        && (rec.nr_ent == min_t(unsigned int, rec.nr, dir_index.max))) {
+        sz = rec.nr_ent * sizeof(*dir_index.ent);
+        F_read(&fs->file, dir_index.ent, sz, &nr);
+        ok = (nr == sz);
+    }
+    F_close(&fs->file);
+
+out:
+    cdir_restore(&cur);
+    if (ok) {
+        dir_index.nr = rec.nr_ent;
+        dir_index.valid = TRUE;
+        *p_nr = rec.nr;
+    }
+    return ok;
+}
+
+static void dir_index_save(uint32_t cdir, uint16_t crc, unsigned int nr)
+{
+    struct dir_index_rec rec;
+    struct fs_cdir cur;
+    UINT sz = dir_index.nr * sizeof(*dir_index.ent);
+    int off;
+
+    if (volume_readonly())
+        return;
+
+    cdir_save(&cur);
+    cdir_restore(&cfg.cfg_cdir);
+    if (F_try_open(&fs->file, DIR_INDEX_FILE,
+                   FA_READ|FA_WRITE|FA_OPEN_ALWAYS) != FR_OK)
+        goto out;
+
+    off = dir_index_find(cdir, &rec);
+    if ((off >= 0) && (rec.nr_ent != dir_index.nr)) {
+        /* Record cannot be rewritten in place: retire it. */
+        rec.cdir = DIR_INDEX_DEAD;
+        F_lseek(&fs->file, off);
+        F_write(&fs->file, &rec, sizeof(rec), NULL);
+        off = -1;
+    }
+    if (off < 0) {
+        /* Append a new record, first discarding all others if the file 
+         * would grow too large. */
+        off = f_size(&fs->file);
+        if ((off + sizeof(rec) + sz) > DIR_INDEX_FILE_MAX) {
+            F_lseek(&fs->file, 0);
+            F_truncate(&fs->file);
+            off = 0;
+        }
+    }
+
+    rec.cdir = cdir;
+    rec.crc = crc;
+    rec.nr = min_t(unsigned int, nr, 0xffff);
+    rec.nr_ent = dir_index.nr;
+    rec.rsvd = 0;
+    F_lseek(&fs->file, off);
+    F_write(&fs->file, &rec, sizeof(rec), NULL);
+    F_write(&fs->file, dir_index.ent, sz, NULL);
+    F_close(&fs->file);
+
+out:
+    cdir_restore(&cur);
+}
+
+/* Index the current folder, via the index file if enabled. The file lives in 
+ * FF/, so is not used for the folder containing it, nor at all if there is 
+ * no FF/ folder. */
+static unsigned int native_dir_index_cached(void)
+{
+    uint32_t cdir = fatfs.cdir;
+    unsigned int nr;
+    uint16_t crc;
+
+    if (!ff_cfg.nav_index_file || !cfg.has_ff_dir
+        || (cdir == cfg.cfg_cdir.cdir))
+        return native_dir_index();
+
+    crc = native_dir_crc();
+    if (dir_index_load(cdir, crc, &nr)) {
+        name_index.valid = FALSE;
+        return nr;
+    }
+
+    nr = native_dir_index();
+    dir_index_save(cdir, crc, nr);
+    return nr;
+}
+
+/* Read the directory entry for slot @nr into fs->fp. */
+static bool_t native_dir_slot(unsigned int nr)
 {
+    unsigned int i = nr - (cfg.depth ? 1 : 0);
     bool_t ok;
+
+    if (!dir_index.valid)
+        native_dir_index();
+
+    F_opendir(&fs->dp, "");
+    if (i < dir_index.nr) {
+        F_seekdir(&fs->dp, dir_index.ent[i] * 32);
+        ok = native_dir_next();
+    } else {
+        /* Not indexed: scan from the last indexed entry. */
+        if (dir_index.nr) {
+            F_seekdir(&fs->dp, dir_index.ent[dir_index.nr-1] * 32);
+            i -= dir_index.nr - 1;
+        }
+        while ((ok = native_dir_next()) && i--)
+            continue;
+    }
+    F_closedir(&fs->dp);
+
+    return ok;
+}
+
+int set_slot_by_name(const char *name, void *scratch)
+{
     int nr = -1;
     int len = strnlen(name, 256);
 
@@ -587,12 +928,8 @@ int set_slot_by_name(const char *name, void *scratch)
 
     if (!cfg.hxc_mode) {
 
-        nr = cfg.depth ? 1 : 0;
-        F_opendir(&fs->dp, "");
-        while ((ok = native_dir_next()) && strncmp(fs->fp.fname, name, len))
-            nr++;
-        F_closedir(&fs->dp);
-        if (!ok || !set_slot_nr(nr))
+        nr = native_dir_find(name, TRUE);
+        if ((nr < 0) || !set_slot_nr(nr))
             nr = -1;
 
     } else if (ff_cfg.nav_mode != NAVMODE_indexed) {
@@ -684,7 +1021,7 @@ static void read_ff_cfg(void)
         .argmax = sizeof(fs->buf)-1
     };
 
-    fatfs.cdir = cfg.cfg_cdir;
+    cdir_restore(&cfg.cfg_cdir);
     fr = F_try_open(&fs->file, "FF.CFG", FA_READ);
     if (fr)
         return;
@@ -944,6 +1281,37 @@ static void read_ff_cfg(void)
             ff_cfg.extend_image = !strcmp(opts.arg, "yes");
             break;
 
+        case FFCFG_metadata_cache_pct:
+            ff_cfg.metadata_cache_pct = min_t(
+                int, max_t(int, strtol(opts.arg, NULL, 10), 0), 100);
+            break;
+
+        case FFCFG_data_cache_pct:
+            ff_cfg.data_cache_pct = min_t(
+                int, max_t(int, strtol(opts.arg, NULL, 10), 0), 100);
+            break;
+
+        case FFCFG_write_back_ms:
+            ff_cfg.write_back_ms = strtol(opts.arg, NULL, 10);
+            break;
+
+        case FFCFG_diagnostics:
+            ff_cfg.diagnostics = !strcmp(opts.arg, "yes");
+            break;
+
+        case FFCFG_nav_index_file:
+            ff_cfg.nav_index_file = !strcmp(opts.arg, "yes");
+            break;
+
+        case FFCFG_benchmark:
+            ff_cfg.benchmark = !strcmp(opts.arg, "yes");
+            break;
+
+        case FFCFG_read_ahead:
+            ff_cfg.read_ahead = min_t(
+                int, max_t(int, strtol(opts.arg, NULL, 10), 0), 16);
+            break;
+
         }
     }
 
@@ -960,6 +1328,9 @@ static void process_ff_cfg_opts(const struct ff_cfg *old)
         || (ff_cfg.pin34 != old->pin34))
         floppy_set_fintf_mode();
 
+    /* diagnostics: Time USB FIFO copies only if they are to be reported. */
+    usb_fifo_stats_enable(ff_cfg.diagnostics);
+
     /* ejected-on-startup: Set the ejected state appropriately. */
     if (ff_cfg.ejected_on_startup)
         cfg.ejected = TRUE;
@@ -984,10 +1355,14 @@ static void cfg_init(void)
     cfg.hxc_mode = FALSE;
     cfg.ima_ej_flag = FALSE;
     cfg.slot_nr = cfg.depth = 0;
-    cfg.cur_cdir = fatfs.cdir;
+    cdir_save(&cfg.cur_cdir);
+
+    /* Folder clusters may have been reused since the last mount. */
+    invalidate_slot_names();
 
     fr = f_chdir("FF");
-    cfg.cfg_cdir = fatfs.cdir;
+    cfg.has_ff_dir = (fr == FR_OK);
+    cdir_save(&cfg.cfg_cdir);
 
     read_ff_cfg();
     process_ff_cfg_opts(&old_ff_cfg);
@@ -1003,10 +1378,19 @@ static void cfg_init(void)
     }
 
     /* Probe for HxC compatibility mode. */
-    fatfs.cdir = cfg.cur_cdir;
+    cdir_restore(&cfg.cur_cdir);
     fr = F_try_open(&fs->file, "HXCSDFE.CFG", FA_READ|FA_WRITE);
     if (fr)
         goto native_mode;
+#if FF_FS_EXFAT
+    /* Slot records written by the HxC selector carry no exFAT chain status 
+     * (AM_CONTIG), so contiguous images would be read via a non-existent 
+     * FAT chain. */
+    if (fatfs.fs_type == FS_EXFAT) {
+        printk("HxC selector mode is not supported on exFAT\n");
+        F_die(FR_HXC_EXFAT);
+    }
+#endif
     fatfs_to_short_slot(&cfg.hxcsdfe, &fs->file, "HXCSDFE.CFG");
     F_read(&fs->file, &hxc_cfg, sizeof(hxc_cfg), NULL);
     if (hxc_cfg.startup_mode & HXCSTARTUP_slot0) {
@@ -1039,7 +1423,7 @@ static void cfg_init(void)
 
 native_mode:
     /* Native mode (direct navigation). */
-    fatfs.cdir = cfg.cfg_cdir;
+    cdir_restore(&cfg.cfg_cdir);
 
     memset(&cfg.imgcfg, 0, sizeof(cfg.imgcfg));
     fr = F_try_open(&fs->file, "IMG.CFG", FA_READ);
@@ -1060,10 +1444,9 @@ native_mode:
 
     /* Process IMAGE_A.CFG file. */
     sofar = 0; /* bytes consumed so far */
-    fatfs.cdir = cfg.cur_cdir;
+    cdir_restore(&cfg.cur_cdir);
     for (;;) {
-        unsigned int nr = cfg.depth ? 1 : 0;
-        bool_t ok;
+        int nr;
         /* Read next pathname section, search for its terminating slash. */
         F_read(&fs->file, fs->buf, sizeof(fs->buf), NULL);
         fs->buf[sizeof(fs->buf)-1] = '\0';
@@ -1078,14 +1461,10 @@ native_mode:
         if (cfg.depth == ARRAY_SIZE(cfg.stack))
             F_die(FR_PATH_TOO_DEEP);
         /* Find slot nr, and stack it */
-        F_opendir(&fs->dp, "");
-        while ((ok = native_dir_next()) && strcmp(fs->fp.fname, fs->buf))
-            nr++;
-        F_closedir(&fs->dp);
-        if (!ok)
+        if ((nr = native_dir_find(fs->buf, FALSE)) < 0)
             goto clear_image_a;
         cfg.stack[cfg.depth].slot = nr;
-        cfg.stack[cfg.depth++].cdir = fatfs.cdir;
+        cdir_save(&cfg.stack[cfg.depth++].cdir);
         fr = f_chdir(fs->buf);
         if (fr)
             goto clear_image_a;
@@ -1112,22 +1491,19 @@ native_mode:
     if (p != fs->buf) {
         /* If there was a non-empty non-terminated pathname section, it 
          * must be the name of the currently-selected image file. */
-        bool_t ok;
+        int nr;
         printk("%u:F: '%s' %s\n", cfg.depth, fs->buf,
                cfg.ima_ej_flag ? "(EJ)" : "");
-        F_opendir(&fs->dp, "");
-        while ((ok = native_dir_next()) && strcmp(fs->fp.fname, fs->buf))
-            cfg.slot_nr++;
-        F_closedir(&fs->dp);
-        if (!ok)
+        if ((nr = native_dir_find(fs->buf, FALSE)) < 0)
             goto clear_image_a;
+        cfg.slot_nr = nr;
     }
     F_close(&fs->file);
-    cfg.cur_cdir = fatfs.cdir;
+    cdir_save(&cfg.cur_cdir);
 
 out:
     printk("Mode: %s\n", cfg.hxc_mode ? "HxC" : "Native");
-    fatfs.cdir = cfg.cur_cdir;
+    cdir_restore(&cfg.cur_cdir);
     return;
 
 clear_image_a:
@@ -1149,20 +1525,14 @@ clear_image_a:
 
 static void native_update(uint8_t slot_mode)
 {
-    int i;
-
     if (slot_mode == CFG_READ_SLOT_NR) {
         /* Populate slot_map[]. */
         memset(&cfg.slot_map, 0xff, sizeof(cfg.slot_map));
-        cfg.max_slot_nr = cfg.depth ? 1 : 0;
-        F_opendir(&fs->dp, "");
-        while (native_dir_next())
-            cfg.max_slot_nr++;
+        cfg.max_slot_nr = (cfg.depth ? 1 : 0) + native_dir_index_cached();
         /* Adjust max_slot_nr. Must be at least one 'slot'. */
         if (!cfg.max_slot_nr)
             F_die(FR_NO_DIRENTS);
         cfg.max_slot_nr--;
-        F_closedir(&fs->dp);
         /* Select last disk_index if not greater than available slots. */
         cfg.slot_nr = (cfg.slot_nr <= cfg.max_slot_nr) ? cfg.slot_nr : 0;
     }
@@ -1170,7 +1540,7 @@ static void native_update(uint8_t slot_mode)
     if ((ff_cfg.image_on_startup == IMGS_last)
         && (slot_mode == CFG_WRITE_SLOT_NR)) {
         char *p, *q;
-        fatfs.cdir = cfg.cfg_cdir;
+        cdir_restore(&cfg.cfg_cdir);
         F_open(&fs->file, "IMAGE_A.CFG", FA_READ|FA_WRITE);
         printk("Before: "); dump_file();
         /* Read final section of the file. */
@@ -1211,23 +1581,17 @@ static void native_update(uint8_t slot_mode)
         F_truncate(&fs->file);
         printk("After: "); dump_file();
         F_close(&fs->file);
-        fatfs.cdir = cfg.cur_cdir;
+        cdir_restore(&cfg.cur_cdir);
         cfg.ima_ej_flag = FALSE;
     }
     
     /* Populate current slot. */
-    i = cfg.depth ? 1 : 0;
-    F_opendir(&fs->dp, "");
-    while (native_dir_next()) {
-        if (i >= cfg.slot_nr)
-            break;
-        i++;
-    }
-    F_closedir(&fs->dp);
-    if (i > cfg.slot_nr) {
+    if (cfg.depth && (cfg.slot_nr == 0)) {
         /* Must be the ".." folder. */
         snprintf(fs->fp.fname, sizeof(fs->fp.fname), "..");
         fs->fp.fattrib = AM_DIR;
+    } else {
+        (void)native_dir_slot(cfg.slot_nr);
     }
     if (fs->fp.fattrib & AM_DIR) {
         /* Leave the full pathname cached in fs->fp. */
@@ -1247,7 +1611,7 @@ static void ima_mark_ejected(bool_t ej)
         || (cfg.ima_ej_flag == ej))
         return;
 
-    fatfs.cdir = cfg.cfg_cdir;
+    cdir_restore(&cfg.cfg_cdir);
     F_open(&fs->file, "IMAGE_A.CFG", FA_READ|FA_WRITE);
     printk("Before: "); dump_file();
     if (ej) {
@@ -1259,14 +1623,173 @@ static void ima_mark_ejected(bool_t ej)
     }
     printk("After: "); dump_file();
     F_close(&fs->file);
-    fatfs.cdir = cfg.cur_cdir;
+    cdir_restore(&cfg.cur_cdir);
     cfg.ima_ej_flag = ej;
 }
 
+/* Entry number of the start of the item last returned by F_readdir() or 
+ * F_findnext() on @dp: its first LFN entry, else its SFN entry. */
+static uint16_t dir_item_ent(DIR *dp)
+{
+    if (dp->blk_ofs != 0xffffffff)
+        return dp->blk_ofs / 32;
+    /* The SFN entry is the one before the current one, unless the read hit 
+     * the end of the directory, which leaves dp at the SFN entry itself. */
+    return dp->dptr / 32 - (dp->sect ? 1 : 0);
+}
+
+/* NAVMODE_indexed: open the current slot's image via the directory index,
+ * which maps slot numbers to directory entries. The entry is checked still
+ * to carry the slot number: if not, the caller falls back to a search. */
+static bool_t indexed_slot_open(void)
+{
+    unsigned int len = strnlen(ff_cfg.indexed_prefix, 256);
+    char num[5];
+
+    if (!dir_index.valid || !slot_valid(cfg.slot_nr)
+        || (cfg.slot_nr >= dir_index.nr))
+        return FALSE;
+
+    F_opendir(&fs->dp, "");
+    F_seekdir(&fs->dp, dir_index.ent[cfg.slot_nr] * 32);
+    if (f_openent(&fs->file, &fs->dp, &fs->fp) != FR_OK)
+        fs->fp.fname[0] = '\0';
+    F_closedir(&fs->dp);
+
+    snprintf(num, sizeof(num), "%04u", cfg.slot_nr);
+    if ((strnlen(fs->fp.fname, sizeof(fs->fp.fname)) >= len + 4)
+        && !strncmp(&fs->fp.fname[len], num, 4))
+        return TRUE;
+
+    if (fs->fp.fname[0])
+        F_close(&fs->file);
+    dir_index.valid = FALSE;
+    return FALSE;
+}
+
+/* HxC selector mode: compact copy of the HXCSDFE.CFG header and slot table, 
+ * loaded when the config is first read after the navigation arena is set up.
+ * HxC modes have no use for the directory index, so the table shares its 
+ * memory. Names too long for the table are read from the file when needed. */
+struct hxc_slot_ent {
+    char type[3];
+    uint8_t attributes;
+    uint32_t firstCluster;
+    uint32_t size;
+    char name[20]; /* NUL-terminated unless truncated */
+};
+static struct {
+    struct hxcsdfe_cfg hdr;
+    struct hxc_slot_ent *ent; /* slots 1..nr */
+    uint16_t nr, max;
+    bool_t valid;
+} hxc_slots;
+
+/* Read slot @nr of the open HXCSDFE.CFG file, in v2 format. */
+static void hxc_read_slot(const struct hxcsdfe_cfg *hxc_cfg, unsigned int nr,
+                          struct v2_slot *v2_slot)
+{
+    struct v1_slot v1_slot;
+
+    switch (hxc_cfg->signature[9]-'0') {
+    case 1:
+        F_lseek(&fs->file, 1024 + nr*128);
+        F_read(&fs->file, &v1_slot, sizeof(v1_slot), NULL);
+        memcpy(&v2_slot->type, &v1_slot.name[8], 3);
+        memcpy(&v2_slot->attributes, &v1_slot.attributes, 1+4+4+17);
+        v2_slot->name[17] = '\0';
+        break;
+    case 2:
+        F_lseek(&fs->file, hxc_cfg->slots_position*512
+                + nr*64*hxc_cfg->number_of_drive_per_slot);
+        F_read(&fs->file, v2_slot, sizeof(*v2_slot), NULL);
+        break;
+    }
+}
+
+/* Load the slot table from the open HXCSDFE.CFG file. */
+static void hxc_slots_load(const struct hxcsdfe_cfg *hxc_cfg)
+{
+    struct hxc_slot_ent *ent;
+    struct v2_slot v2_slot;
+    unsigned int nr, len;
+
+    hxc_slots.hdr = *hxc_cfg;
+    hxc_slots.nr = min_t(unsigned int, cfg.max_slot_nr, hxc_slots.max);
+    for (nr = 1; nr <= hxc_slots.nr; nr++) {
+        if (!slot_valid(nr))
+            continue;
+        hxc_read_slot(hxc_cfg, nr, &v2_slot);
+        ent = &hxc_slots.ent[nr-1];
+        memcpy(ent->type, v2_slot.type, sizeof(ent->type));
+        ent->attributes = v2_slot.attributes;
+        ent->firstCluster = v2_slot.firstCluster;
+        ent->size = v2_slot.size;
+        len = strnlen(v2_slot.name, sizeof(v2_slot.name));
+        memset(ent->name, 0, sizeof(ent->name));
+        memcpy(ent->name, v2_slot.name, min_t(unsigned int, len,
+                                              sizeof(ent->name)));
+    }
+    hxc_slots.valid = TRUE;
+}
+
+/* Populate cfg.slot from the slot table, falling back to the file only for 
+ * names which the table truncates. */
+static void hxc_slots_populate(void)
+{
+    const struct hxc_slot_ent *ent;
+    struct v2_slot v2_slot;
+
+    if (cfg.slot_nr == 0) {
+        slot_from_short_slot(&cfg.slot, &cfg.autoboot);
+        return;
+    }
+
+    ent = &hxc_slots.ent[cfg.slot_nr-1];
+    if ((cfg.slot_nr <= hxc_slots.nr)
+        && (strnlen(ent->name, sizeof(ent->name)) < sizeof(ent->name))) {
+        memcpy(v2_slot.type, ent->type, sizeof(v2_slot.type));
+        v2_slot.attributes = ent->attributes;
+        v2_slot.firstCluster = ent->firstCluster;
+        v2_slot.size = ent->size;
+        memset(v2_slot.name, 0, sizeof(v2_slot.name));
+        memcpy(v2_slot.name, ent->name, sizeof(ent->name));
+    } else {
+        slot_from_short_slot(&cfg.slot, &cfg.hxcsdfe);
+        fatfs_from_slot(&fs->file, &cfg.slot, FA_READ);
+        hxc_read_slot(&hxc_slots.hdr, cfg.slot_nr, &v2_slot);
+        F_close(&fs->file);
+    }
+
+    slot_from_short_slot(&cfg.slot, &v2_slot);
+}
+
+/* Slot number update from the in-RAM config, written through to the file if 
+ * @slot_mode is CFG_WRITE_SLOT_NR. */
+static void hxc_slots_update(uint8_t slot_mode)
+{
+    struct hxcsdfe_cfg *hdr = &hxc_slots.hdr;
+    bool_t v1 = (hdr->signature[9] == '1');
+
+    if (v1)
+        hdr->slot_index = cfg.slot_nr;
+    else
+        hdr->cur_slot_number = cfg.slot_nr;
+
+    if (slot_mode == CFG_WRITE_SLOT_NR) {
+        slot_from_short_slot(&cfg.slot, &cfg.hxcsdfe);
+        fatfs_from_slot(&fs->file, &cfg.slot, FA_READ|FA_WRITE);
+        F_write(&fs->file, hdr, sizeof(*hdr), NULL);
+        F_close(&fs->file);
+    }
+
+    cfg.slot_nr = v1 ? hdr->slot_index : hdr->cur_slot_number;
+    hxc_slots_populate();
+}
+
 static void hxc_cfg_update(uint8_t slot_mode)
 {
     struct hxcsdfe_cfg hxc_cfg;
-    struct v1_slot v1_slot;
     struct v2_slot v2_slot;
     BYTE mode = FA_READ;
     int i;
@@ -1278,7 +1801,7 @@ static void hxc_cfg_update(uint8_t slot_mode)
         FRESULT fr;
         char slot[10];
         hxc_cfg.index_mode = TRUE;
-        fatfs.cdir = cfg.cfg_cdir;
+        cdir_restore(&cfg.cfg_cdir);
         switch (slot_mode) {
         case CFG_READ_SLOT_NR:
             cfg.slot_nr = 0;
@@ -1301,10 +1824,15 @@ static void hxc_cfg_update(uint8_t slot_mode)
             F_close(&fs->file);
             break;
         }
-        fatfs.cdir = cfg.cur_cdir;
+        cdir_restore(&cfg.cur_cdir);
         goto indexed_mode;
     }
 
+    if ((slot_mode != CFG_READ_SLOT_NR) && hxc_slots.valid) {
+        hxc_slots_update(slot_mode);
+        goto out;
+    }
+
     slot_from_short_slot(&cfg.slot, &cfg.hxcsdfe);
     fatfs_from_slot(&fs->file, &cfg.slot, mode);
     F_read(&fs->file, &hxc_cfg, sizeof(hxc_cfg), NULL);
@@ -1347,13 +1875,10 @@ static void hxc_cfg_update(uint8_t slot_mode)
         if (cfg.slot_nr == 0) {
             slot_from_short_slot(&cfg.slot, &cfg.autoboot);
         } else {
-            F_lseek(&fs->file, 1024 + cfg.slot_nr*128);
-            F_read(&fs->file, &v1_slot, sizeof(v1_slot), NULL);
-            memcpy(&v2_slot.type, &v1_slot.name[8], 3);
-            memcpy(&v2_slot.attributes, &v1_slot.attributes, 1+4+4+17);
-            v2_slot.name[17] = '\0';
+            hxc_read_slot(&hxc_cfg, cfg.slot_nr, &v2_slot);
             slot_from_short_slot(&cfg.slot, &v2_slot);
         }
+        hxc_slots_load(&hxc_cfg);
         break;
     }
 
@@ -1382,11 +1907,10 @@ static void hxc_cfg_update(uint8_t slot_mode)
         if (cfg.slot_nr == 0) {
             slot_from_short_slot(&cfg.slot, &cfg.autoboot);
         } else {
-            F_lseek(&fs->file, hxc_cfg.slots_position*512
-                    + cfg.slot_nr*64*hxc_cfg.number_of_drive_per_slot);
-            F_read(&fs->file, &v2_slot, sizeof(v2_slot), NULL);
+            hxc_read_slot(&hxc_cfg, cfg.slot_nr, &v2_slot);
             slot_from_short_slot(&cfg.slot, &v2_slot);
         }
+        hxc_slots_load(&hxc_cfg);
         break;
 
     default:
@@ -1435,21 +1959,27 @@ indexed_mode:
                 cfg.slot_map[idx/8] |= 0x80 >> (idx&7);
                 cfg.max_slot_nr = max_t(
                     uint16_t, cfg.max_slot_nr, idx);
+                dir_index.ent[idx] = dir_item_ent(&fs->dp);
             }
             F_closedir(&fs->dp);
             if (!slot_valid(cfg.max_slot_nr))
                 F_die(FR_NO_DIRENTS);
+            dir_index.nr = cfg.max_slot_nr + 1;
+            dir_index.valid = TRUE;
         }
 
         /* Index mode: populate current slot. */
-        snprintf(name, sizeof(name), "%s%04u*.*",
-                 ff_cfg.indexed_prefix, cfg.slot_nr);
-        printk("[%s]\n", name);
-        F_findfirst(&fs->dp, &fs->fp, "", name);
-        F_closedir(&fs->dp);
+        if (!indexed_slot_open()) {
+            snprintf(name, sizeof(name), "%s%04u*.*",
+                     ff_cfg.indexed_prefix, cfg.slot_nr);
+            printk("[%s]\n", name);
+            F_findfirst(&fs->dp, &fs->fp, "", name);
+            F_closedir(&fs->dp);
+            if (fs->fp.fname[0])
+                F_open(&fs->file, fs->fp.fname, FA_READ);
+        }
         if (fs->fp.fname[0]) {
             /* Found a valid image. */
-            F_open(&fs->file, fs->fp.fname, FA_READ);
             fs->file.obj.attr = fs->fp.fattrib;
             fatfs_to_slot(&cfg.slot, &fs->file, fs->fp.fname);
             F_close(&fs->file);
@@ -1458,6 +1988,7 @@ indexed_mode:
         }
     }
 
+out:
     for (i = 0; i < sizeof(cfg.slot.type); i++)
         cfg.slot.type[i] = tolower(cfg.slot.type[i]);
 }
@@ -1600,6 +2131,8 @@ static int run_floppy(void *_b)
         }
         canary_check();
         assert_volume_connected();
+        if (volume_poll() != RES_OK)
+            F_die(FR_DISK_ERR);
         t_prev = t_now;
     }
 
@@ -1618,17 +2151,416 @@ static void floppy_arena_setup(void)
 
     fs = arena_alloc(sizeof(*fs));
 
+    dir_index.max = DIR_INDEX_MAX;
+    dir_index.ent = arena_alloc(dir_index.max * sizeof(*dir_index.ent));
+    dir_index.valid = FALSE;
+    hxc_slots.ent = (struct hxc_slot_ent *)dir_index.ent;
+    hxc_slots.max = dir_index.max * sizeof(*dir_index.ent)
+        / sizeof(*hxc_slots.ent);
+    hxc_slots.valid = FALSE;
+
     cache_len = arena_avail();
     cache_start = arena_alloc(cache_len);
     volume_cache_init(cache_start, cache_start + cache_len);
+    volume_set_tag(VOL_TAG_cfg);
 }
 
 static void floppy_arena_teardown(void)
 {
     fs = NULL;
+    dir_index.max = dir_index.nr = 0;
+    dir_index.valid = FALSE;
+    hxc_slots.max = hxc_slots.nr = 0;
+    hxc_slots.valid = FALSE;
     volume_cache_destroy();
 }
 
+/* Cache hit rate as a two-digit percentage, or "--" if no lookups. */
+static void hit_pct(char *msg, const struct cache_stats *s)
+{
+    unsigned int pct;
+    if (s->lookups == 0) {
+        snprintf(msg, 3, "--");
+        return;
+    }
+    pct = (s->lookups > 0x1000000)
+        ? s->hits / (s->lookups / 100) : (s->hits * 100) / s->lookups;
+    snprintf(msg, 3, "%02u", min_t(unsigned int, pct, 99));
+}
+
+/* Average of @cycles per 64 of @bytes. */
+static uint32_t per_64b(uint32_t cycles, uint32_t bytes)
+{
+    return (bytes >= 64) ? cycles / (bytes / 64) : 0;
+}
+
+/* Write the USB drive's command latency histograms to MSCLAT.CSV, one row per
+ * command type and transfer size, tagged with the drive's identity. */
+static void msc_lat_report(void)
+{
+    static const char * const cmd_name[] = {
+        "READ10", "WRITE10", "TEST_UNIT_READY", "REQUEST_SENSE"
+    };
+    const struct msc_lat *lat = usbh_msc_lat();
+    uint32_t id = usbh_msc_id();
+    char *p, *end = fs->buf + sizeof(fs->buf);
+    unsigned int i, j, cmd, nr;
+
+    F_open(&fs->file, "MSCLAT.CSV", FA_WRITE | FA_CREATE_ALWAYS);
+
+    p = fs->buf;
+    p += snprintf(p, end-p, "vid_pid,serial,command,sectors");
+    for (j = 0; j < MSC_LAT_BUCKETS-1; j++)
+        p += snprintf(p, end-p, ",lt%uus", 128u << j);
+    p += snprintf(p, end-p, ",ge%uus\n", 128u << (j-1));
+    F_write(&fs->file, fs->buf, p - fs->buf, NULL);
+
+    for (i = 0; i < MSC_LAT_ROWS; i++) {
+        for (j = 0; (j < MSC_LAT_BUCKETS) && !lat->hist[i][j]; j++)
+            continue;
+        if (j == MSC_LAT_BUCKETS)
+            continue;
+        cmd = (i < MSC_LAT_SIZES) ? 0 : (i < 2*MSC_LAT_SIZES) ? 1
+            : (i == MSC_LAT_test_unit_ready) ? 2 : 3;
+        nr = (cmd < 2) ? 1u << (i % MSC_LAT_SIZES) : 0;
+        p = fs->buf;
+        p += snprintf(p, end-p, "%04X:%04X,%s,%s,%u",
+                      (uint16_t)(id >> 16), (uint16_t)id, lat->serial,
+                      cmd_name[cmd], nr);
+        for (j = 0; j < MSC_LAT_BUCKETS; j++)
+            p += snprintf(p, end-p, ",%u", lat->hist[i][j]);
+        p += snprintf(p, end-p, "\n");
+        F_write(&fs->file, fs->buf, p - fs->buf, NULL);
+    }
+
+    F_close(&fs->file);
+}
+
+/* Write volume cache statistics to STATS.TXT in the config folder, and show 
+ * a summary of hit rates on the display. USB drives' command latencies are 
+ * written to MSCLAT.CSV. */
+static void diagnostics_report(void)
+{
+    static const char * const tag_name[] = {
+        [VOL_TAG_fatfs] = "fatfs",
+        [VOL_TAG_image] = "image",
+        [VOL_TAG_da]    = "da",
+        [VOL_TAG_cfg]   = "cfg"
+    };
+    const struct cache_stats *s;
+    char msg[17], pct[VOL_TAG_nr][3];
+    unsigned int frags = floppy_image_frags();
+    char *p = fs->buf, *end = fs->buf + sizeof(fs->buf);
+    unsigned int i, max_chain = 0;
+
+    for (i = 0; i < VOL_TAG_nr; i++) {
+        s = volume_cache_stats(i);
+        hit_pct(pct[i], s);
+        max_chain = max_t(unsigned int, max_chain, s->max_chain);
+    }
+
+    if (!volume_readonly()) {
+        p += snprintf(p, end-p, "tag lookups hits misses evictions "
+                      "bytes_copied max_chain\n");
+        for (i = 0; i < VOL_TAG_nr; i++) {
+            s = volume_cache_stats(i);
+            p += snprintf(p, end-p, "%s %u %u %u %u %u %u\n",
+                          tag_name[i], s->lookups, s->hits, s->misses,
+                          s->evictions, s->bytes_copied, s->max_chain);
+        }
+        p += snprintf(p, end-p, "image_fragments %u\n", frags);
+        cdir_restore(&cfg.cfg_cdir);
+        F_open(&fs->file, "STATS.TXT", FA_WRITE | FA_CREATE_ALWAYS);
+        F_write(&fs->file, fs->buf, p - fs->buf, NULL);
+        if (usbh_msc_id()) {
+            const struct msc_bot_stats *bot = &usbh_msc_lat()->bot;
+            const struct usb_fifo_stats *f = usb_fifo_stats();
+            p = fs->buf;
+            p += snprintf(p, end-p, "msc_bot commands cbw_us data_us csw_us "
+                          "naks stalls xfer_errors phase_errors failures\n");
+            p += snprintf(p, end-p, "msc_bot %u %u %u %u %u %u %u %u %u\n",
+                          bot->cmds, bot->cbw_us, bot->data_us, bot->csw_us,
+                          bot->nak, bot->stall, bot->xfer_err,
+                          bot->phase_err, bot->fail);
+            p += snprintf(p, end-p, "usb_fifo rx_bytes rx_cycles tx_bytes "
+                          "tx_cycles rx_cycles_per_64b tx_cycles_per_64b\n");
+            p += snprintf(p, end-p, "usb_fifo %u %u %u %u %u %u\n",
+                          f->rx_bytes, f->rx_cycles, f->tx_bytes, f->tx_cycles,
+                          per_64b(f->rx_cycles, f->rx_bytes),
+                          per_64b(f->tx_cycles, f->tx_bytes));
+            F_write(&fs->file, fs->buf, p - fs->buf, NULL);
+        } else {
+            static const char * const op_name[] = {
+                [SD_OP_init]  = "init",
+                [SD_OP_read]  = "read",
+                [SD_OP_write] = "write",
+                [SD_OP_sync]  = "sync"
+            };
+            const struct sd_stats *sd = sd_stats();
+            const struct sd_op_stats *op;
+            p = fs->buf;
+            p += snprintf(p, end-p, "sd_op ops commands bytes_clocked "
+                          "wait_ready_us crc_errors\n");
+            for (i = 0; i < SD_OP_nr; i++) {
+                op = &sd->op[i];
+                p += snprintf(p, end-p, "%s %u %u %u %u %u\n",
+                              op_name[i], op->ops, op->cmds, op->bytes,
+                              op->wait_us, op->crc_errs);
+            }
+            p += snprintf(p, end-p, "sd_write blocks busy_us busy_max_us "
+                          "busy_us_per_block\n");
+            p += snprintf(p, end-p, "sd_write %u %u %u %u\n",
+                          sd->blocks_written, sd->busy_us, sd->busy_max_us,
+                          sd->blocks_written
+                          ? sd->busy_us / sd->blocks_written : 0);
+            F_write(&fs->file, fs->buf, p - fs->buf, NULL);
+        }
+        F_close(&fs->file);
+        if (usbh_msc_id())
+            msc_lat_report();
+        cdir_restore(&cfg.cur_cdir);
+    }
+
+    switch (display_mode) {
+    case DM_LED_7SEG:
+        snprintf(msg, sizeof(msg), "C%s", pct[VOL_TAG_image]);
+        led_7seg_write_string(msg);
+        break;
+    case DM_LCD_1602:
+        lcd_clear();
+        snprintf(msg, sizeof(msg), "F%s I%s D%s C%s",
+                 pct[VOL_TAG_fatfs], pct[VOL_TAG_image],
+                 pct[VOL_TAG_da], pct[VOL_TAG_cfg]);
+        lcd_write(0, 0, -1, msg);
+        snprintf(msg, sizeof(msg), "Ch%u Frags %u", max_chain, frags);
+        lcd_write(0, 1, -1, msg);
+        lcd_on();
+        break;
+    default:
+        return;
+    }
+
+    delay_ms(2000);
+    display_write_slot(FALSE);
+}
+
+/* Drive benchmark: Reads and writes of each size are timed at sequential, 
+ * and at random but repeatable, positions within a contiguous scratch file.
+ * The cache is torn down meanwhile so that every request reaches the drive. */
+#define BENCH_SAMPLES   100
+#define BENCH_FILE_SECS 4096 /* 2MB */
+#define BENCH_MAX_SECS  32
+static const uint8_t bench_secs[] = { 1, 2, 4, 8, 16, 32 };
+#define BENCH_NR (2 * 2 * ARRAY_SIZE(bench_secs))
+
+struct bench_result {
+    uint32_t min, avg, p99, max; /* microseconds */
+};
+
+/* Benchmark state lives in the arena: the thread stack is small. */
+struct bench {
+    uint8_t buf[BENCH_MAX_SECS * 512];
+    uint32_t us[BENCH_SAMPLES]; /* sorted latencies of the current run */
+    struct bench_result r[BENCH_NR];
+};
+
+/* A transfer passes if its 99th-percentile latency is within a fixed 
+ * overhead plus 1ms per sector. This is generous for reads (compare 
+ * attic/timings.txt) and allows for flash block management on writes. */
+static uint32_t bench_limit_us(bool_t write, unsigned int nr)
+{
+    return (write ? 5000 : 2000) + nr * 1000;
+}
+
+static void bench_run(struct bench *b, struct bench_result *r, uint32_t base,
+                      bool_t write, bool_t rnd, unsigned int nr)
+{
+    uint32_t *us = b->us, sum = 0, lba = 0, x = 0x2545f491;
+    unsigned int i, j;
+    time_t t;
+    DRESULT res;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        if (rnd) {
+            /* xorshift32 */
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            lba = (x % (BENCH_FILE_SECS / nr)) * nr;
+        }
+        t = time_now();
+        res = write ? disk_write(0, b->buf, base + lba, nr)
+            : disk_read(0, b->buf, base + lba, nr);
+        t = time_diff(t, time_now()) / time_us(1);
+        if (res != RES_OK)
+            F_die(FR_DISK_ERR);
+        for (j = i; (j > 0) && (us[j-1] > t); j--)
+            us[j] = us[j-1];
+        us[j] = t;
+        sum += t;
+        lba = (lba + nr) % BENCH_FILE_SECS;
+    }
+
+    r->min = us[0];
+    r->avg = sum / BENCH_SAMPLES;
+    r->p99 = us[(BENCH_SAMPLES * 99 + 99) / 100 - 1];
+    r->max = us[BENCH_SAMPLES-1];
+}
+
+/* Format @us as milliseconds, in at most three characters. */
+static void bench_ms(char *p, uint32_t us)
+{
+    unsigned int ms = us / 1000;
+    if (ms < 10)
+        snprintf(p, 4, "%u.%u", ms, (us / 100) % 10);
+    else
+        snprintf(p, 4, "%u", min_t(unsigned int, ms, 999));
+}
+
+static void bench_show(unsigned int i, const struct bench_result *r)
+{
+    char msg[17], ms[4][4];
+    unsigned int nr = bench_secs[i % ARRAY_SIZE(bench_secs)];
+    bool_t write = i >= BENCH_NR/2, rnd = (i / ARRAY_SIZE(bench_secs)) & 1;
+
+    if (display_mode != DM_LCD_1602)
+        return;
+
+    lcd_clear();
+    snprintf(msg, sizeof(msg), "%s %s x%u %s",
+             write ? "Wr" : "Rd", rnd ? "Rnd" : "Seq", nr,
+             (r->p99 <= bench_limit_us(write, nr)) ? "ok" : "FAIL");
+    lcd_write(0, 0, -1, msg);
+    bench_ms(ms[0], r->min);
+    bench_ms(ms[1], r->avg);
+    bench_ms(ms[2], r->p99);
+    bench_ms(ms[3], r->max);
+    snprintf(msg, sizeof(msg), "%s %s %s %s", ms[0], ms[1], ms[2], ms[3]);
+    lcd_write(0, 1, -1, msg);
+    lcd_on();
+}
+
+static void bench_wait_press(void)
+{
+    while (buttons)
+        continue;
+    while (!buttons)
+        assert_volume_connected();
+}
+
+static void benchmark(void)
+{
+    struct bench *b;
+    struct bench_result *r;
+    char msg[20];
+    uint32_t base, id;
+    unsigned int i, nr, fails = 0;
+    bool_t write, rnd;
+    FRESULT fr;
+
+    if (volume_readonly())
+        F_die(FR_WRITE_PROTECTED);
+
+    switch (display_mode) {
+    case DM_LED_7SEG:
+        led_7seg_write_string("BEN");
+        break;
+    case DM_LCD_1602:
+        lcd_clear();
+        lcd_write(0, 0, -1, "Benchmarking...");
+        lcd_on();
+        break;
+    }
+
+    /* Take the whole arena, and the volume without its cache. */
+    floppy_arena_teardown();
+    arena_init();
+    fs = arena_alloc(sizeof(*fs));
+    b = arena_alloc(sizeof(*b));
+    r = b->r;
+    memset(b->buf, 0xa5, sizeof(b->buf));
+
+    /* Allocate the scratch file contiguously: it is then a single run of 
+     * sectors, which we access directly. */
+    cdir_restore(&cfg.cfg_cdir);
+    F_open(&fs->file, "BENCH.TMP", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+    if ((fr = f_expand(&fs->file, BENCH_FILE_SECS * 512, 1)) != FR_OK)
+        F_die(fr);
+    base = fatfs.database + (fs->file.obj.sclust - 2) * fatfs.csize;
+    F_close(&fs->file);
+
+    for (i = 0; i < BENCH_NR; i++) {
+        nr = bench_secs[i % ARRAY_SIZE(bench_secs)];
+        write = i >= BENCH_NR/2;
+        rnd = (i / ARRAY_SIZE(bench_secs)) & 1;
+        if (display_mode == DM_LED_7SEG) {
+            snprintf(msg, sizeof(msg), "B%02u", i);
+            led_7seg_write_string(msg);
+        }
+        bench_run(b, &r[i], base, write, rnd, nr);
+        if (r[i].p99 > bench_limit_us(write, nr))
+            fails++;
+        bench_show(i, &r[i]);
+    }
+
+    f_unlink("BENCH.TMP");
+
+    /* Full results to a CSV file, named for the drive. */
+    id = usbh_msc_id();
+    if (id)
+        snprintf(msg, sizeof(msg), "BENCH_%04X_%04X.CSV",
+                 (uint16_t)(id >> 16), (uint16_t)id);
+    else
+        snprintf(msg, sizeof(msg), "BENCH_SD.CSV");
+    F_open(&fs->file, msg, FA_WRITE | FA_CREATE_ALWAYS);
+    nr = snprintf(fs->buf, sizeof(fs->buf), "op,pattern,sectors,samples,"
+                  "min_us,avg_us,p99_us,max_us,limit_us,result\n");
+    F_write(&fs->file, fs->buf, nr, NULL);
+    for (i = 0; i < BENCH_NR; i++) {
+        uint32_t limit;
+        write = i >= BENCH_NR/2;
+        rnd = (i / ARRAY_SIZE(bench_secs)) & 1;
+        limit = bench_limit_us(write, bench_secs[i % ARRAY_SIZE(bench_secs)]);
+        nr = snprintf(fs->buf, sizeof(fs->buf),
+                      "%s,%s,%u,%u,%u,%u,%u,%u,%u,%s\n",
+                      write ? "write" : "read", rnd ? "random" : "sequential",
+                      bench_secs[i % ARRAY_SIZE(bench_secs)], BENCH_SAMPLES,
+                      r[i].min, r[i].avg, r[i].p99, r[i].max, limit,
+                      (r[i].p99 <= limit) ? "pass" : "fail");
+        F_write(&fs->file, fs->buf, nr, NULL);
+    }
+    F_close(&fs->file);
+    cdir_restore(&cfg.cur_cdir);
+
+    printk("Benchmark: %u of %u failed\n", fails, BENCH_NR);
+
+    /* Show the verdict. On LCD, each button press then shows the next 
+     * result. */
+    switch (display_mode) {
+    case DM_LED_7SEG:
+        led_7seg_write_string(fails ? "BAD" : "PAS");
+        break;
+    case DM_LCD_1602:
+        lcd_clear();
+        lcd_write(0, 0, -1, fails ? "Benchmark: FAIL" : "Benchmark: PASS");
+        snprintf(msg, sizeof(msg), "%u of %u failed", fails, BENCH_NR);
+        lcd_write(0, 1, -1, msg);
+        lcd_on();
+        break;
+    }
+    bench_wait_press();
+    if (display_mode == DM_LCD_1602) {
+        for (i = 0; i < BENCH_NR; i++) {
+            bench_show(i, &r[i]);
+            bench_wait_press();
+        }
+    }
+    while (buttons)
+        continue;
+
+    floppy_arena_setup();
+}
+
 static int floppy_main(void *unused)
 {
     FRESULT fres;
@@ -1644,6 +2576,8 @@ static int floppy_main(void *unused)
     floppy_arena_setup();
     
     cfg_init();
+    if (ff_cfg.benchmark)
+        benchmark();
     cfg_update(CFG_READ_SLOT_NR);
 
     /* If we start on a folder, go directly into the image selector. */
@@ -1681,7 +2615,8 @@ static int floppy_main(void *unused)
             if (!strcmp(fs->fp.fname, "..")) {
                 if (cfg.depth == 0)
                     F_die(FR_BAD_IMAGECFG);
-                fatfs.cdir = cfg.cur_cdir = cfg.stack[--cfg.depth].cdir;
+                cfg.cur_cdir = cfg.stack[--cfg.depth].cdir;
+                cdir_restore(&cfg.cur_cdir);
                 cfg.slot_nr = cfg.stack[cfg.depth].slot;
             } else {
                 if (cfg.depth == ARRAY_SIZE(cfg.stack))
@@ -1689,7 +2624,7 @@ static int floppy_main(void *unused)
                 cfg.stack[cfg.depth].slot = cfg.slot_nr;
                 cfg.stack[cfg.depth++].cdir = cfg.cur_cdir;
                 F_chdir(fs->fp.fname);
-                cfg.cur_cdir = fatfs.cdir;
+                cdir_save(&cfg.cur_cdir);
                 cfg.slot_nr = 1;
             }
             cfg_update(CFG_READ_SLOT_NR);
@@ -1716,6 +2651,8 @@ static int floppy_main(void *unused)
             floppy_cancel();
             assert_volume_connected();
             floppy_arena_setup();
+            if (ff_cfg.diagnostics && (fres == FR_OK))
+                diagnostics_report();
         }
 
         if (cfg.dirty_slot_nr) {
@@ -2091,6 +3028,7 @@ int main(void)
             usbh_msc_process();
         }
         usbh_msc_buffer_set((void *)0xdeadbeef);
+        volume_set_metadata_window(fatfs.win);
 
         fres = F_call_cancellable(floppy_main, NULL);
         floppy_cancel();
@@ -52,6 +52,23 @@ static uint8_t cardtype;
 #define spi spi2
 #define PIN_CS 12
 
+static struct sd_stats stats;
+
+/* Statistics of the FatFS operation in progress. */
+static struct sd_op_stats *op = &stats.op[SD_OP_init];
+
+static void op_start(unsigned int type)
+{
+    op = &stats.op[type];
+    op->ops++;
+}
+
+/* Bus transfers, accounted to the current operation. */
+#define xmit8(x)  (op->bytes++, spi_xmit8(spi, x))
+#define recv8()   (op->bytes++, spi_recv8(spi))
+#define xmit16(x) (op->bytes += 2, spi_xmit16(spi, x))
+#define recv16()  (op->bytes += 2, spi_recv16(spi))
+
 static void spi_acquire(void)
 {
     gpio_write_pin(gpiob, PIN_CS, 0);
@@ -62,20 +79,34 @@ static void spi_release(void)
     spi_quiesce(spi);
     gpio_write_pin(gpiob, PIN_CS, 1);
     /* Need a dummy transfer as SD deselect is sync'ed to the clock. */
-    (void)spi_recv8(spi);
+    (void)recv8();
     spi_quiesce(spi);
 }
 
+/* Set when a written block may leave the card busy programming. The busy 
+ * time is accounted when we next wait for the card. */
+static bool_t busy;
+
 static uint8_t wait_ready(void)
 {
     stk_time_t start = stk_now();
+    uint32_t us;
     uint8_t res;
 
     /* Wait 500ms for card to be ready. */
     do {
-        res = spi_recv8(spi);
+        res = recv8();
     } while ((res != 0xff) && (stk_timesince(start) < stk_ms(500)));
 
+    us = stk_timesince(start) / STK_MHZ;
+    op->wait_us += us;
+
+    if (busy) {
+        stats.busy_us += us;
+        stats.busy_max_us = max(stats.busy_max_us, us);
+        busy = FALSE;
+    }
+
     return res;
 }
 
@@ -123,11 +154,56 @@ static uint8_t crc7(uint8_t *buf, uint8_t count)
     return crc;
 }
 
+/* A multi-block transfer is left open after each request, with the card 
+ * selected, so that a following request at the next address continues the 
+ * stream. Open reads keep clocking blocks. Open writes defer waiting for the
+ * card to program the last block until the bus is next needed. Any other 
+ * command must first stop the transfer, and a transfer which no request has
+ * continued for XFER_IDLE_MS is stopped from the main loop. */
+#define XFER_none  0
+#define XFER_read  1
+#define XFER_write 2
+#define XFER_IDLE_MS 5
+static struct {
+    uint8_t open;
+    DWORD rd_next, wr_next;
+    stk_time_t time; /* end of the last request on the open transfer */
+} xfer;
+
+static uint8_t send_cmd(uint8_t cmd, uint32_t arg);
+static bool_t datablock_xmit(const BYTE *buff, uint8_t token);
+static DRESULT handle_sd_result(DRESULT res);
+
+static void xfer_stop(void)
+{
+    uint8_t open = xfer.open;
+
+    xfer.open = XFER_none;
+
+    switch (open) {
+    case XFER_read:
+        /* STOP_TRANSMISSION */
+        send_cmd(CMD(12), 0);
+        break;
+    case XFER_write:
+        /* Stop Transmission token */
+        if (!datablock_xmit(NULL, 0xfd))
+            handle_sd_result(RES_ERROR);
+        break;
+    default:
+        return;
+    }
+
+    spi_release();
+}
+
 static uint8_t send_cmd(uint8_t cmd, uint32_t arg)
 {
     uint8_t i, res, retry = 0;
     uint8_t buf[6];
 
+    xfer_stop();
+
     for (;;) {
 
         /* ACMDx == CMD55 + CMDx */
@@ -149,14 +225,19 @@ static uint8_t send_cmd(uint8_t cmd, uint32_t arg)
         buf[5] = (crc7(buf, 5) << 1) | 1;
 
         for (i = 0; i < 6; i++)
-            spi_xmit8(spi, buf[i]);
+            xmit8(buf[i]);
+        op->cmds++;
 
         /* Resync with receive stream. (We ignored rx bytes, above). */
         spi_quiesce(spi);
 
+        /* STOP_TRANSMISSION: Skip the stuff byte, which may be read data. */
+        if (cmd == CMD(12))
+            (void)recv8();
+
         /* Wait up to 80 clocks for a valid response (MSB clear). */
         for (i = 0; i < 10; i++)
-            if (!((res = spi_recv8(spi)) & R1_MBZ))
+            if (!((res = recv8()) & R1_MBZ))
                 break;
 
         /* Retry if no response or CRC error. */
@@ -171,72 +252,240 @@ static uint8_t send_cmd(uint8_t cmd, uint32_t arg)
     return res;
 }
 
-static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
+/* SPI2 requests are hardwired to DMA1: RX on Ch4, TX on Ch5. Ch4 is shared
+ * with I2C2 TX, which continuously refreshes an attached LCD/OLED display.
+ * In that case block reads fall back to PIO; writes need only Ch5. */
+#define DMA_RX_CH 4
+#define DMA_TX_CH 5
+#define dma_rx (dma1->ch4)
+#define dma_tx (dma1->ch5)
+
+/* Cleared on any DMA error, after which all transfers fall back to PIO. */
+static bool_t dma_ok;
+
+/* Source of the dummy 0xff bytes clocked out while receiving by DMA. */
+static const uint8_t dma_dummy = 0xff;
+
+static bool_t dma_rx_ok(void)
 {
-    uint8_t token, _crc[2];
+    return dma_ok && (display_mode != DM_LCD_1602);
+}
+
+static void dma_start_recv(BYTE *buff, uint16_t bytes)
+{
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_RX_CH) | DMA_IFCR_CGIF(DMA_TX_CH);
+
+    dma_rx.cpar = dma_tx.cpar = (uint32_t)(unsigned long)&spi->dr;
+    dma_rx.cmar = (uint32_t)(unsigned long)buff;
+    dma_tx.cmar = (uint32_t)(unsigned long)&dma_dummy;
+    dma_rx.cndtr = dma_tx.cndtr = bytes;
+    op->bytes += bytes;
+
+    /* RX must be serviced ahead of TX to avoid overrun. */
+    dma_rx.ccr = (DMA_CCR_PL_HIGH |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_P2M |
+                  DMA_CCR_EN);
+    dma_tx.ccr = (DMA_CCR_PL_MEDIUM |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_EN);
+
+    spi->cr2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+}
+
+static void dma_start_xmit(const BYTE *buff, uint16_t bytes)
+{
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_TX_CH);
+
+    dma_tx.cpar = (uint32_t)(unsigned long)&spi->dr;
+    dma_tx.cmar = (uint32_t)(unsigned long)buff;
+    dma_tx.cndtr = bytes;
+    op->bytes += bytes;
+    dma_tx.ccr = (DMA_CCR_PL_MEDIUM |
+                  DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_16BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_EN);
+
+    spi->cr2 = SPI_CR2_TXDMAEN;
+}
+
+/* Wait for DMA channel @ch to complete, then stop all SD DMA activity. */
+static bool_t dma_wait(unsigned int ch)
+{
+    stk_time_t start = stk_now();
+    uint32_t isr;
+
+    /* A 512-byte block takes ~230us at 18MHz. */
+    while (!((isr = dma1->isr) & (DMA_ISR_TCIF(ch) | DMA_ISR_TEIF(ch)))
+           && (stk_timesince(start) < stk_ms(10)))
+        cpu_relax();
+
+    spi->cr2 = 0;
+    if (ch == DMA_RX_CH)
+        dma_rx.ccr = 0;
+    dma_tx.ccr = 0;
+    spi_quiesce(spi);
+
+    if ((isr & (DMA_ISR_TCIF(ch) | DMA_ISR_TEIF(ch))) != DMA_ISR_TCIF(ch)) {
+        printk("SD: DMA error (%08x): falling back to PIO\n", isr);
+        dma_ok = FALSE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Wait for the start-block token which precedes each data block. */
+static bool_t datablock_token(void)
+{
+    uint8_t token;
     uint32_t start = stk_now();
-    uint16_t todo, w, crc;
 
     /* Wait 100ms for data to be ready. */
     do {
-        token = spi_recv8(spi);
+        token = recv8();
     } while ((token == 0xff) && (stk_timesince(start) < stk_ms(100)));
-    if (token != 0xfe) /* valid data token? */
+
+    return token == 0xfe; /* valid data token? */
+}
+
+/* Check the CRC16 which followed a received data block. */
+static bool_t datablock_crc_ok(
+    const BYTE *buff, uint16_t bytes, const uint8_t *_crc)
+{
+    if (!crc16_ccitt(_crc, 2, crc16_ccitt(buff, bytes, 0)))
+        return TRUE;
+    op->crc_errs++;
+    return FALSE;
+}
+
+static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
+{
+    uint8_t _crc[2];
+    uint16_t todo, w;
+    bool_t ok;
+
+    if (!datablock_token())
         return FALSE;
 
     spi_16bit_frame(spi);
 
     /* Grab the data. */
     for (todo = bytes; todo != 0; todo -= 2) {
-        w = spi_recv16(spi);
+        w = recv16();
         *buff++ = w >> 8;
         *buff++ = w;
     }
 
     /* Retrieve and check the CRC. */
-    w = spi_recv16(spi);
+    w = recv16();
     _crc[0] = w >> 8;
     _crc[1] = w;
-    crc = crc16_ccitt(_crc, 2, crc16_ccitt(buff-bytes, bytes, 0));
+    ok = datablock_crc_ok(buff-bytes, bytes, _crc);
     spi_quiesce(spi);
 
     spi_8bit_frame(spi);
 
-    return !crc;
+    return ok;
+}
+
+/* Receive @count 512-byte blocks. When DMA is available, the CRC of each 
+ * block is checked while the following block is in flight. */
+static bool_t datablocks_recv(BYTE *buff, UINT count)
+{
+    const BYTE *prev = NULL;
+    uint8_t _crc[2];
+    bool_t ok = TRUE;
+
+    if (!dma_rx_ok()) {
+        while (datablock_recv(buff, 512) && --count)
+            buff += 512;
+        return !count;
+    }
+
+    while (count--) {
+        if (!datablock_token())
+            return FALSE;
+        dma_start_recv(buff, 512);
+        if (prev)
+            ok = datablock_crc_ok(prev, 512, _crc);
+        if (!dma_wait(DMA_RX_CH) || !ok)
+            return FALSE;
+        _crc[0] = recv8();
+        _crc[1] = recv8();
+        prev = buff;
+        buff += 512;
+    }
+
+    return datablock_crc_ok(prev, 512, _crc);
 }
 
 static bool_t datablock_xmit(const BYTE *buff, uint8_t token)
 {
     uint8_t res, wc = 0;
-    uint16_t crc = buff ? crc16_ccitt(buff, 512, 0) : 0;
+    uint16_t crc;
 
     if ((res = wait_ready()) != 0xff)
         return FALSE;
 
     /* Send the token. */
-    spi_xmit8(spi, token);
+    xmit8(token);
 
-    /* If token is Stop Transmission, we're done. */
-    if (token == 0xfd)
+    /* If token is Stop Transmission, we're done. The card signals busy 
+     * after one further byte. */
+    if (token == 0xfd) {
+        (void)recv8();
+        busy = TRUE;
         return TRUE;
+    }
 
-    spi_16bit_frame(spi);
+    if (dma_ok) {
 
-    /* Send the data. */
-    do {
-        uint16_t w = (uint16_t)*buff++ << 8;
-        w |= *buff++;
-        spi_xmit16(spi, w);
-    } while (--wc);
+        /* Compute the CRC while the data goes out by DMA. */
+        spi_quiesce(spi);
+        dma_start_xmit(buff, 512);
+        crc = crc16_ccitt(buff, 512, 0);
+        if (!dma_wait(DMA_TX_CH))
+            return FALSE;
+
+    } else {
+
+        crc = crc16_ccitt(buff, 512, 0);
+
+        spi_16bit_frame(spi);
+
+        /* Send the data. */
+        do {
+            uint16_t w = (uint16_t)*buff++ << 8;
+            w |= *buff++;
+            xmit16(w);
+        } while (--wc);
+
+        spi_8bit_frame(spi);
+
+    }
 
     /* Send the CRC. */
+    xmit8(crc >> 8);
+    xmit8(crc);
     spi_quiesce(spi);
-    spi_xmit16(spi, crc);
-
-    spi_8bit_frame(spi);
 
     /* Check Data Response token: Data accepted? */
-    return (spi_recv8(spi) & 0x1f) == 0x05;
+    if ((res = recv8() & 0x1f) != 0x05) {
+        if (res == 0x0b) /* rejected due to CRC error */
+            op->crc_errs++;
+        return FALSE;
+    }
+
+    stats.blocks_written++;
+    busy = TRUE;
+    return TRUE;
 }
 
 static void dump_cid_info(void)
@@ -281,7 +530,11 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
     if (pdrv)
         return RES_PARERR;
 
+    op_start(SD_OP_init);
+
     status |= STA_NOINIT;
+    xfer.open = XFER_none;
+    busy = FALSE;
     if (!sd_inserted())
         return status;
 
@@ -306,7 +559,7 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
 
     /* Wait 80 cycles for card to ready itself. */
     for (i = 0; i < 10; i++)
-        (void)spi_recv8(spi);
+        (void)recv8();
 
     /* Reset, enter idle state (SPI mode). */
     if (send_cmd(CMD(0), 0) != R1_IdleState)
@@ -323,7 +576,7 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
         /* Command was understood. We have a v2.00-compliant card.
          * Get the 4-byte response and validate.  */
         for (i = rcv = 0; i < 4; i++)
-            rcv = (rcv << 8) | spi_recv8(spi);
+            rcv = (rcv << 8) | recv8();
         if ((rcv & 0x1ff) != 0x1aa) {
             TRC("Bad CMD8 response 0x%04x\n", rcv);
             goto out;
@@ -339,9 +592,9 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
         /* Read OCR register, check for SDSD/SDHC/SDXC configuration. */
         if (send_cmd(CMD(58), 0) != 0)
             goto out;
-        rcv = spi_recv8(spi); /* Only care about first byte (bits 31:24) */
+        rcv = recv8(); /* Only care about first byte (bits 31:24) */
         for (i = 0; i < 3; i++)
-            (void)spi_recv8(spi);
+            (void)recv8();
         if (!(rcv & 0x80)) { /* Bit 31: fail if card is still busy */
             TRC("OCR unexpected MSB 0x%02x\n", (uint8_t)rcv);
             goto out;
@@ -375,6 +628,7 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
 
     /* We're done: All good. */
     status &= ~STA_NOINIT;
+    dma_ok = TRUE;
 
 out:
     spi_release();
@@ -416,31 +670,57 @@ static DRESULT handle_sd_result(DRESULT res)
 static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
 {
     uint8_t retry = 0;
+    bool_t multi;
+    DWORD next;
     UINT todo;
-    BYTE *p;
 
     if (pdrv || !count)
         return RES_PARERR;
     if (status & STA_NOINIT)
         return RES_NOTRDY;
 
-    if (!(cardtype & CT_BLOCK))
+    op_start(SD_OP_read);
+
+    next = sector + count;
+    if (!(cardtype & CT_BLOCK)) {
         sector <<= 9;
+        next <<= 9;
+    }
+
+    /* Continue an open stream if this request follows on from the last. */
+    if (xfer.open == XFER_read) {
+        if ((sector == xfer.rd_next) && datablocks_recv(buff, count)) {
+            xfer.rd_next = next;
+            xfer.time = stk_now();
+            return RES_OK;
+        }
+        xfer_stop();
+    }
+
+    /* Open a stream for multi-block and sequential requests. */
+    multi = (count > 1) || (sector == xfer.rd_next);
+    xfer.rd_next = next;
 
     do {
         todo = count;
-        p = buff;
 
         /* READ_{MULTIPLE,SINGLE}_BLOCK */
-        if (send_cmd(CMD((count > 1) ? 18 : 17), sector) != 0)
+        if (send_cmd(CMD(multi ? 18 : 17), sector) != 0)
             continue;
 
-        while (datablock_recv(p, 512) && --todo)
-            p += 512;
+        if (datablocks_recv(buff, count))
+            todo = 0;
 
-        /* STOP_TRANSMISSION */
-        if (count > 1)
+        if (multi) {
+            if (!todo) {
+                /* Leave the stream open for a following request. */
+                xfer.open = XFER_read;
+                xfer.time = stk_now();
+                break;
+            }
+            /* STOP_TRANSMISSION */
             send_cmd(CMD(12), 0);
+        }
 
         spi_release();
 
@@ -449,34 +729,63 @@ static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
     return handle_sd_result(todo ? RES_ERROR : RES_OK);
 }
 
+/* Send @count blocks into an open WRITE_MULTIPLE_BLOCK. */
+static bool_t datablocks_xmit(const BYTE *buff, UINT count)
+{
+    while (datablock_xmit(buff, 0xfc) && --count)
+        buff += 512;
+    return !count;
+}
+
 static DRESULT sd_disk_write(
     BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
 {
     uint8_t retry = 0;
+    bool_t multi;
+    DWORD next;
     UINT todo;
-    const BYTE *p;
 
     if (pdrv || !count)
         return RES_PARERR;
     if (status & STA_NOINIT)
         return RES_NOTRDY;
 
-    if (!(cardtype & CT_BLOCK))
+    op_start(SD_OP_write);
+
+    next = sector + count;
+    if (!(cardtype & CT_BLOCK)) {
         sector <<= 9;
+        next <<= 9;
+    }
+
+    /* Continue an open stream if this request follows on from the last. */
+    if (xfer.open == XFER_write) {
+        if ((sector == xfer.wr_next) && datablocks_xmit(buff, count)) {
+            xfer.wr_next = next;
+            xfer.time = stk_now();
+            return RES_OK;
+        }
+        xfer_stop();
+    }
+
+    /* Open a stream for multi-block and sequential requests. */
+    multi = (count > 1) || (sector == xfer.wr_next);
+    xfer.wr_next = next;
 
     do {
         todo = count;
-        p = buff;
 
-        if (count == 1) {
+        if (!multi) {
             /* WRITE_BLOCK */
             if (send_cmd(CMD(24), sector) != 0)
                 continue;
             /* Write 1 block */
-            if (datablock_xmit(p, 0xfe))
+            if (datablock_xmit(buff, 0xfe))
                 todo--;
         } else {
-            /* SET_WR_BLK_ERASE_COUNT */
+            /* SET_WR_BLK_ERASE_COUNT: Pre-erase the blocks of this request.
+             * Unwritten pre-erased blocks are left undefined, so we cannot 
+             * hint at blocks which a following request may continue into. */
             if ((cardtype & (CT_SD1|CT_SD2))
                 && (send_cmd(ACMD(23), count) != 0))
                 continue;
@@ -484,11 +793,15 @@ static DRESULT sd_disk_write(
             if (send_cmd(CMD(25), sector) != 0)
                 continue;
             /* Write <count> blocks */
-            while (datablock_xmit(p, 0xfc) && --todo)
-                p += 512;
+            if (datablocks_xmit(buff, count)) {
+                /* Leave the stream open for a following request. */
+                xfer.open = XFER_write;
+                xfer.time = stk_now();
+                todo = 0;
+                break;
+            }
             /* Stop Transmission token */
-            if (!datablock_xmit(NULL, 0xfd))
-                todo = 1; /* error */
+            (void)datablock_xmit(NULL, 0xfd);
         }
 
         spi_release();
@@ -509,6 +822,8 @@ static DRESULT sd_disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
 
     switch (ctrl) {
     case CTRL_SYNC:
+        op_start(SD_OP_sync);
+        xfer_stop();
         spi_acquire();
         if (wait_ready() == 0xff)
             res = RES_OK;
@@ -522,6 +837,15 @@ static DRESULT sd_disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
     return handle_sd_result(res);
 }
 
+/* Stop an idle transfer: the card should not be left selected, or part way
+ * through a write, beyond the FatFS operation which began it. */
+static void sd_disk_idle(void)
+{
+    if ((xfer.open != XFER_none)
+        && (stk_timesince(xfer.time) >= stk_ms(XFER_IDLE_MS)))
+        xfer_stop();
+}
+
 static bool_t sd_connected(void)
 {
     return !(status & STA_NOINIT) && sd_inserted();
@@ -532,12 +856,18 @@ static bool_t sd_readonly(void)
     return FALSE;
 }
 
+const struct sd_stats *sd_stats(void)
+{
+    return &stats;
+}
+
 struct volume_ops sd_ops = {
     .initialize = sd_disk_initialize,
     .status = sd_disk_status,
     .read = sd_disk_read,
     .write = sd_disk_write,
     .ioctl = sd_disk_ioctl,
+    .idle = sd_disk_idle,
     .connected = sd_connected,
     .readonly = sd_readonly
 };
@@ -129,8 +129,12 @@ typedef enum
     USB_OTG_FS_CORE_ID = 1
 } USB_OTG_CORE_ID_TypeDef;
 
+/* Host-side tests (tests/usb_msc.c) redirect register accesses to a model 
+ * of the OTG core. */
+#ifndef USB_OTG_READ_REG32
 #define USB_OTG_READ_REG32(reg)  (*(__IO uint32_t *)(reg))
 #define USB_OTG_WRITE_REG32(reg,value) (*(__IO uint32_t *)(reg) = (value))
+#endif
 #define USB_OTG_MODIFY_REG32(reg,clear_mask,set_mask) \
   USB_OTG_WRITE_REG32((reg), (((USB_OTG_READ_REG32(reg)) & ~(clear_mask)) | (set_mask)) )
 
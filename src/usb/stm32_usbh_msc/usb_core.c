@@ -100,6 +100,32 @@ static USB_OTG_STS USB_OTG_CoreReset(USB_OTG_CORE_HANDLE *pdev)
     return status;
 }
 
+/* FIFO copy statistics, for the cost of each 64-byte packet. Copies are 
+ * timed by the DWT cycle counter. */
+static struct usb_fifo_stats fifo_stats;
+static bool_t fifo_timed;
+
+void usb_fifo_stats_enable(bool_t enable)
+{
+    if (enable) {
+        dcb->demcr |= DCB_DEMCR_TRCENA;
+        dwt->ctrl |= DWT_CTRL_CYCCNTENA;
+    }
+    fifo_timed = enable;
+}
+
+const struct usb_fifo_stats *usb_fifo_stats(void)
+{
+    return &fifo_stats;
+}
+
+/* Any word address within a channel's 4kB FIFO window accesses the FIFO, so 
+ * aligned buffers are copied in bursts of four words by LDM/STM. Unaligned 
+ * buffers are copied a byte at a time via a bounce word, as is the partial 
+ * word at the end of a packet: we never access bytes beyond the buffer. 
+ * Host-side tests, which model the FIFO behind USB_OTG_READ_REG32() and 
+ * USB_OTG_WRITE_REG32(), copy aligned buffers a word at a time. */
+
 /**
  * @brief  USB_OTG_WritePacket : Writes a packet into the Tx FIFO associated
  *         with the EP
@@ -115,17 +141,49 @@ USB_OTG_STS USB_OTG_WritePacket(USB_OTG_CORE_HANDLE *pdev,
                                 uint16_t            len)
 {
     USB_OTG_STS status = USB_OTG_OK;
-    uint32_t count32b, i;
+    uint32_t n, w, t = 0;
     __IO uint32_t *fifo;
+    bool_t timed = fifo_timed;
 
     if (pdev->cfg.dma_enable)
         return status;
 
-    count32b = (len + 3) / 4;
+    if (timed)
+        t = dwt->cyccnt;
+
+    n = len / 4;
     fifo = pdev->regs.DFIFO[ch_ep_num];
-    for (i = 0; i < count32b; i++) {
-        USB_OTG_WRITE_REG32(fifo, *(uint32_t *)src);
-        src += 4;
+    if (!((uint32_t)src & 3)) {
+#ifdef __arm__
+        for (; n >= 4; n -= 4)
+            asm volatile (
+                "ldmia %[src]!, {r1-r4}\n"
+                "stmia %[fifo], {r1-r4}\n"
+                : [src] "+r" (src) : [fifo] "r" (fifo)
+                : "r1", "r2", "r3", "r4", "memory");
+#endif
+        for (; n != 0; n--) {
+            USB_OTG_WRITE_REG32(fifo, *(uint32_t *)src);
+            src += 4;
+        }
+    } else {
+        for (; n != 0; n--) {
+            w = src[0] | (src[1] << 8) | (src[2] << 16)
+                | ((uint32_t)src[3] << 24);
+            USB_OTG_WRITE_REG32(fifo, w);
+            src += 4;
+        }
+    }
+
+    if (len & 3) {
+        for (n = len & 3, w = 0; n != 0; n--)
+            w = (w << 8) | src[n-1];
+        USB_OTG_WRITE_REG32(fifo, w);
+    }
+
+    if (timed) {
+        fifo_stats.tx_bytes += len;
+        fifo_stats.tx_cycles += dwt->cyccnt - t;
     }
 
     return status;
@@ -143,13 +201,48 @@ void *USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev,
                          uint8_t *dest,
                          uint16_t len)
 {
-    uint32_t i;
-    uint32_t count32b = (len + 3) / 4;
+    uint32_t n = len / 4, w, t = 0;
     __IO uint32_t *fifo = pdev->regs.DFIFO[0];
+    bool_t timed = fifo_timed;
+
+    if (timed)
+        t = dwt->cyccnt;
+
+    if (!((uint32_t)dest & 3)) {
+#ifdef __arm__
+        for (; n >= 4; n -= 4)
+            asm volatile (
+                "ldmia %[fifo], {r1-r4}\n"
+                "stmia %[dest]!, {r1-r4}\n"
+                : [dest] "+r" (dest) : [fifo] "r" (fifo)
+                : "r1", "r2", "r3", "r4", "memory");
+#endif
+        for (; n != 0; n--) {
+            *(uint32_t *)dest = USB_OTG_READ_REG32(fifo);
+            dest += 4;
+        }
+    } else {
+        for (; n != 0; n--) {
+            w = USB_OTG_READ_REG32(fifo);
+            dest[0] = w;
+            dest[1] = w >> 8;
+            dest[2] = w >> 16;
+            dest[3] = w >> 24;
+            dest += 4;
+        }
+    }
+
+    if (len & 3) {
+        w = USB_OTG_READ_REG32(fifo);
+        for (n = len & 3; n != 0; n--) {
+            *dest++ = w;
+            w >>= 8;
+        }
+    }
 
-    for (i = 0; i < count32b; i++) {
-        *(uint32_t *)dest = USB_OTG_READ_REG32(fifo);
-        dest += 4;
+    if (timed) {
+        fifo_stats.rx_bytes += len;
+        fifo_stats.rx_cycles += dwt->cyccnt - t;
     }
 
     return ((void *)dest);
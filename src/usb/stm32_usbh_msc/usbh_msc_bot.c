@@ -85,6 +85,8 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
         switch (USBH_MSC_BOTXferParam.BOTState)
         {
         case USBH_MSC_SEND_CBW:
+            usbh_msc_lat_start(USBH_MSC_CBWData.field.CBWCB,
+                               USBH_MSC_CBWData.field.CBWTransferLength);
             /* send CBW */
             USBH_BulkSendData (pdev,
                                &USBH_MSC_CBWData.CBWArray[0],
@@ -268,6 +270,8 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
                                        datapointer,
                                        remainingDataLength ,
                                        MSC_Machine.hc_num_out);
+                    datapointer_prev = datapointer;
+                    datapointer = datapointer + remainingDataLength;
 
                     remainingDataLength = 0; /* Reset this value and keep in same state */
                 }
@@ -275,20 +279,11 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
 
             else if(URB_Status == URB_NOTREADY)
             {
-                if(datapointer != datapointer_prev)
-                {
-                    USBH_BulkSendData (pdev,
-                                       (datapointer - MSC_Machine.MSBulkOutEpSize),
-                                       MSC_Machine.MSBulkOutEpSize ,
-                                       MSC_Machine.hc_num_out);
-                }
-                else
-                {
-                    USBH_BulkSendData (pdev,
-                                       datapointer,
-                                       MSC_Machine.MSBulkOutEpSize ,
-                                       MSC_Machine.hc_num_out);
-                }
+                /* Resend the NAKed packet: the last one sent. */
+                USBH_BulkSendData (pdev,
+                                   datapointer_prev,
+                                   datapointer - datapointer_prev,
+                                   MSC_Machine.hc_num_out);
             }
 
             else if(URB_Status == URB_STALL)
@@ -434,6 +429,9 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
         default:
             break;
         }
+
+        usbh_msc_lat_step(USBH_MSC_BOTXferParam.BOTState, URB_Status,
+                          USBH_MSC_BOTXferParam.BOTXferStatus);
     }
 }
 
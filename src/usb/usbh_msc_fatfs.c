@@ -13,6 +13,143 @@
 
 static DSTATUS dstatus = STA_NOINIT;
 static bool_t msc_device_connected;
+static uint32_t msc_device_id; /* VID:PID */
+
+#if !defined(BOOTLOADER) && !defined(RELOADER)
+
+static struct msc_lat lat;
+
+/* The command being timed. Its BOT phases begin at t[]: CBW, data, CSW. */
+static struct {
+    time_t t[3];
+    uint8_t phase;
+    uint8_t row;
+    bool_t busy;
+} lat_cmd;
+
+static void lat_reset(void)
+{
+    memset(&lat, 0, sizeof(lat));
+    lat_cmd.busy = FALSE;
+}
+
+/* The serial number is recorded in CSV files: keep it to one plain field. */
+static void lat_set_serial(const char *serial)
+{
+    unsigned int i;
+    char c;
+    for (i = 0; (i < sizeof(lat.serial)-1) && ((c = serial[i]) != '\0'); i++)
+        lat.serial[i] = ((c > ' ') && (c <= '~') && (c != ',')) ? c : '_';
+    lat.serial[i] = '\0';
+}
+
+const struct msc_lat *usbh_msc_lat(void)
+{
+    return &lat;
+}
+
+/* Bit length of non-zero @x: fls(1) == 1. */
+#define fls(x) (32 - __builtin_clz(x))
+
+void usbh_msc_lat_start(const uint8_t *cb, uint32_t len)
+{
+    unsigned int sz = 0;
+
+    /* A CBW resent after a transfer error is part of the same command. */
+    if (lat_cmd.busy)
+        return;
+
+    if (len >= 512)
+        sz = min(fls(len / 512) - 1, MSC_LAT_SIZES - 1);
+
+    switch (cb[0]) {
+    case 0x00: /* TEST UNIT READY */
+        lat_cmd.row = MSC_LAT_test_unit_ready;
+        break;
+    case 0x03: /* REQUEST SENSE */
+        lat_cmd.row = MSC_LAT_request_sense;
+        break;
+    case 0x28: /* READ (10) */
+        lat_cmd.row = MSC_LAT_read10(sz);
+        break;
+    case 0x2a: /* WRITE (10) */
+        lat_cmd.row = MSC_LAT_write10(sz);
+        break;
+    default:
+        return;
+    }
+
+    lat_cmd.t[0] = time_now();
+    lat_cmd.phase = 0;
+    lat_cmd.busy = TRUE;
+}
+
+#define sat_inc(x) do { if ((x) != 0xffff) (x)++; } while (0)
+
+void usbh_msc_lat_step(uint8_t bot_state, uint8_t urb_state, uint8_t status)
+{
+    struct msc_bot_stats *bot = &lat.bot;
+    time_t now;
+    uint32_t us;
+    unsigned int b;
+
+    if (!lat_cmd.busy)
+        return;
+
+    switch (urb_state) {
+    case URB_NOTREADY:
+        sat_inc(bot->nak);
+        break;
+    case URB_STALL:
+        sat_inc(bot->stall);
+        break;
+    case URB_ERROR:
+        sat_inc(bot->xfer_err);
+        break;
+    }
+
+    /* Note the start of the data and CSW phases. Phases which are skipped 
+     * (no data, or a failed command) take no time. */
+    now = time_now();
+    switch (bot_state) {
+    case USBH_MSC_BOT_DATAIN_STATE:
+    case USBH_MSC_BOT_DATAOUT_STATE:
+        if (lat_cmd.phase == 0)
+            lat_cmd.t[++lat_cmd.phase] = now;
+        break;
+    case USBH_MSC_RECEIVE_CSW_STATE:
+    case USBH_MSC_DECODE_CSW:
+        while (lat_cmd.phase < 2)
+            lat_cmd.t[++lat_cmd.phase] = now;
+        break;
+    }
+
+    if (status == USBH_MSC_BUSY)
+        return;
+    lat_cmd.busy = FALSE;
+
+    while (lat_cmd.phase < 2)
+        lat_cmd.t[++lat_cmd.phase] = now;
+    bot->cmds++;
+    bot->cbw_us += time_diff(lat_cmd.t[0], lat_cmd.t[1]) / time_us(1);
+    bot->data_us += time_diff(lat_cmd.t[1], lat_cmd.t[2]) / time_us(1);
+    bot->csw_us += time_diff(lat_cmd.t[2], now) / time_us(1);
+    if (status == USBH_MSC_PHASE_ERROR)
+        sat_inc(bot->phase_err);
+    else if (status != USBH_MSC_OK)
+        sat_inc(bot->fail);
+
+    us = time_diff(lat_cmd.t[0], now) / time_us(1);
+    b = (us < 128) ? 0 : min(fls(us) - 7, MSC_LAT_BUCKETS - 1);
+    sat_inc(lat.hist[lat_cmd.row][b]);
+}
+
+#else
+
+#define lat_reset() ((void)0)
+#define lat_set_serial(s) ((void)0)
+
+#endif
 
 extern USB_OTG_CORE_HANDLE USB_OTG_Core;
 USBH_HOST USB_Host;
@@ -26,6 +163,7 @@ static void USBH_USR_DeInit(void)
 {
     printk("> %s\n", __FUNCTION__);
     msc_device_connected = FALSE;
+    msc_device_id = 0;
 }
 
 static void USBH_USR_DeviceAttached(void)
@@ -42,6 +180,7 @@ static void USBH_USR_DeviceDisconnected (void)
 {
     printk("> %s\n", __FUNCTION__);
     msc_device_connected = FALSE;
+    msc_device_id = 0;
 }
 
 static void USBH_USR_OverCurrentDetected (void)
@@ -64,6 +203,8 @@ static void USBH_USR_DeviceDescAvailable(void *DeviceDesc)
     printk("> %s\n", __FUNCTION__);
     printk(" VID : %04X\n", hs->idVendor);
     printk(" PID : %04X\n", hs->idProduct);
+    msc_device_id = ((uint32_t)hs->idVendor << 16) | hs->idProduct;
+    lat_reset();
 }
 
 static void USBH_USR_DeviceAddressAssigned(void)
@@ -98,6 +239,7 @@ static void USBH_USR_ProductString(void *ProductString)
 static void USBH_USR_SerialNumString(void *SerialNumString)
 {
     printk(" Serial Number : %s\n", (char *)SerialNumString);
+    lat_set_serial(SerialNumString);
 }
 
 static void USBH_USR_EnumerationDone(void)
@@ -175,6 +317,11 @@ bool_t usbh_msc_inserted(void)
         || (USB_Host.gState != HOST_IDLE);
 }
 
+uint32_t usbh_msc_id(void)
+{
+    return msc_device_id;
+}
+
 static bool_t usbh_msc_connected(void)
 {
     return msc_device_connected && HCD_IsDeviceConnected(&USB_OTG_Core);
@@ -194,6 +341,13 @@ static DSTATUS usb_disk_initialize(BYTE pdrv)
     if (pdrv)
         return RES_PARERR;
 
+    /* FatFS is configured for 512-byte sectors only. */
+    if (usbh_msc_connected() && (USBH_MSC_Param.MSPageLength != 512)) {
+        printk("MSC: Unsupported block size %u\n",
+               USBH_MSC_Param.MSPageLength);
+        return dstatus = STA_NOINIT;
+    }
+
     dstatus = (!usbh_msc_connected() ? STA_NOINIT
                : USBH_MSC_Param.MSWriteProtect ? STA_PROTECT
                : 0);
@@ -220,46 +374,94 @@ static DRESULT handle_usb_status(BYTE status)
     return RES_OK;
 }
 
-static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+/* Largest transfer issued as a single command. Larger requests are split 
+ * into back-to-back commands, each CBW sent as soon as the previous command's
+ * CSW is received. Many devices misbehave on very large transfers: Linux 
+ * limits USB storage to 240 sectors per command by default. */
+#define MSC_MAX_XFER 128
+
+/* The request in progress. The BOT state machine is stepped by each call to 
+ * usb_disk_poll() until the request completes. */
+static struct {
+    BYTE *buff;
+    DWORD sector;
+    UINT count; /* sectors remaining, including the command in progress */
+    UINT nr;    /* sectors in the command in progress */
+    bool_t write;
+} req;
+
+static DRESULT usb_disk_submit(bool_t write, BYTE *buff, DWORD sector,
+                               UINT count)
 {
-    BYTE status;
-
-    if (pdrv || !count)
+    if (!count)
         return RES_PARERR;
     if (dstatus & STA_NOINIT)
         return RES_NOTRDY;
+    if (write && (dstatus & STA_PROTECT))
+        return RES_WRPRT;
+
+    req.buff = buff;
+    req.sector = sector;
+    req.count = count;
+    req.nr = min_t(UINT, count, MSC_MAX_XFER);
+    req.write = write;
+    return RES_OK;
+}
+
+static bool_t usb_disk_poll(DRESULT *res)
+{
+    BYTE status;
 
-    do {
-        if (!HCD_IsDeviceConnected(&USB_OTG_Core))
-            return handle_usb_status(USBH_MSC_FAIL);
-        status = USBH_MSC_Read10(&USB_OTG_Core, buff, sector, 512 * count);
+    for (;;) {
+        if (!HCD_IsDeviceConnected(&USB_OTG_Core)) {
+            status = USBH_MSC_FAIL;
+            break;
+        }
+        status = req.write
+            ? USBH_MSC_Write10(&USB_OTG_Core, req.buff, req.sector,
+                               512 * req.nr)
+            : USBH_MSC_Read10(&USB_OTG_Core, req.buff, req.sector,
+                              512 * req.nr);
         USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-    } while (status == USBH_MSC_BUSY);
+        if (status == USBH_MSC_BUSY)
+            return FALSE;
+        if ((status != USBH_MSC_OK) || ((req.count -= req.nr) == 0))
+            break;
+        /* Chain the next command immediately. */
+        req.buff += 512 * req.nr;
+        req.sector += req.nr;
+        req.nr = min_t(UINT, req.count, MSC_MAX_XFER);
+    }
 
-    return handle_usb_status(status);
+    *res = handle_usb_status(status);
+    return TRUE;
 }
 
-static DRESULT usb_disk_write(
-    BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+static DRESULT usb_disk_rw(bool_t write, BYTE pdrv, BYTE *buff,
+                           DWORD sector, UINT count)
 {
-    BYTE status;
+    DRESULT res;
 
-    if (pdrv || !count)
+    if (pdrv)
         return RES_PARERR;
-    if (dstatus & STA_NOINIT)
-        return RES_NOTRDY;
-    if (dstatus & STA_PROTECT)
-        return RES_WRPRT;
 
-    do {
-        if (!HCD_IsDeviceConnected(&USB_OTG_Core))
-            return handle_usb_status(USBH_MSC_FAIL);
-        status = USBH_MSC_Write10(
-            &USB_OTG_Core, (BYTE *)buff, sector, 512 * count);
-        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-    } while (status == USBH_MSC_BUSY);
+    if ((res = usb_disk_submit(write, buff, sector, count)) != RES_OK)
+        return res;
+    while (!usb_disk_poll(&res))
+        cpu_relax();
 
-    return handle_usb_status(status);
+    return res;
+}
+
+static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    return usb_disk_rw(FALSE, pdrv, buff, sector, count);
+}
+
+static DRESULT usb_disk_write(
+    BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+    return usb_disk_rw(TRUE, pdrv, (BYTE *)buff, sector, count);
 }
 
 static DRESULT usb_disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
@@ -289,6 +491,8 @@ struct volume_ops usb_ops = {
     .read = usb_disk_read,
     .write = usb_disk_write,
     .ioctl = usb_disk_ioctl,
+    .submit = usb_disk_submit,
+    .poll = usb_disk_poll,
     .connected = usbh_msc_connected,
     .readonly = usbh_msc_readonly
 };
@@ -19,31 +19,525 @@ extern struct volume_ops usb_ops;
 static struct volume_ops *vol_ops = &usb_ops;
 
 static struct cache *cache;
-static void *metadata_addr;
+static bool_t metadata_only;
 #define SECSZ 512
 
+/* The cache is partitioned into separate pools for filesystem metadata and 
+ * for file data. All metadata is accessed via the FatFS "sector window". */
+#define POOL_metadata 0
+#define POOL_data     1
+static void *metadata_addr;
+#define cache_pool(buff) \
+    (((void *)(buff) == metadata_addr) ? POOL_metadata : POOL_data)
+
+/* Cache statistics, per subsystem, since the volume was initialised. */
+static struct cache_stats stats[VOL_TAG_nr];
+static uint8_t cur_tag;
+#define stats_tag(buff) \
+    (((void *)(buff) == metadata_addr) ? VOL_TAG_fatfs : cur_tag)
+
+/* Staging buffer for merged write-back, carved from the start of the cache 
+ * region. */
+static uint8_t *stage;
+
+/* Request queue: USB mass storage (BOT) permits a single command in flight, 
+ * so asynchronous requests (write-back, read-ahead, and those submitted by 
+ * image handlers) are queued and issued to the driver in order. The queue is 
+ * advanced by volume_poll() from the main loop, and by any wait for a request
+ * to complete. Drivers without asynchronous support complete each request as
+ * it is submitted. */
+#define Q_MAX 8
+static struct {
+    struct volume_req *req[Q_MAX];
+    uint8_t cons, prod;
+    bool_t started; /* head request has been issued to the driver */
+} q;
+
+#define q_empty() (q.cons == q.prod)
+#define q_full() ((uint8_t)(q.prod - q.cons) == Q_MAX)
+
+static void req_finish(struct volume_req *req, DRESULT res)
+{
+    req->res = res;
+    req->busy = FALSE;
+    if (req->done)
+        req->done(req);
+}
+
+static void q_advance(void)
+{
+    struct volume_req *req;
+    DRESULT res;
+
+    while (!q_empty()) {
+        req = q.req[q.cons % Q_MAX];
+        if (!q.started) {
+            res = vol_ops->submit(req->write, req->buff, req->lba, req->count);
+            if (res != RES_OK)
+                goto done;
+            q.started = TRUE;
+        }
+        if (!vol_ops->poll(&res))
+            return;
+    done:
+        q.started = FALSE;
+        q.cons++;
+        req_finish(req, res);
+    }
+}
+
+static void q_submit(struct volume_req *req)
+{
+    ASSERT(!q_full());
+    req->busy = TRUE;
+    if (!vol_ops->submit) {
+        req_finish(req, req->write
+                   ? vol_ops->write(0, req->buff, req->lba, req->count)
+                   : vol_ops->read(0, req->buff, req->lba, req->count));
+        return;
+    }
+    q.req[q.prod % Q_MAX] = req;
+    q.prod++;
+    q_advance();
+}
+
+static void q_drain(void)
+{
+    while (!q_empty()) {
+        q_advance();
+        cpu_relax();
+    }
+}
+
+static bool_t q_overlaps(uint32_t lba, unsigned int count)
+{
+    struct volume_req *req;
+    uint8_t i;
+    for (i = q.cons; i != q.prod; i++) {
+        req = q.req[i % Q_MAX];
+        if (((req->lba - lba) < count) || ((lba - req->lba) < req->count))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Write-back: Single-sector writes are held dirty in the cache, and their 
+ * LBAs are remembered in a small list. The list is written back to the 
+ * volume, with runs of adjacent sectors merged into multi-sector writes, when
+ * it fills, on CTRL_SYNC, or when the oldest dirty sector is write_back_ms 
+ * old. Write-back is disabled if write_back_ms is zero. */
+#define WB_MAX 8
+static struct {
+    uint32_t lba[WB_MAX];
+    uint8_t nr;
+    bool_t enabled;
+    time_t time; /* when the oldest dirty sector was written */
+    DRESULT err; /* first error from asynchronous write-back */
+    struct volume_req req[WB_MAX];
+} wb;
+
+static void wb_done(struct volume_req *req)
+{
+    if ((req->res != RES_OK) && (wb.err == RES_OK))
+        wb.err = req->res;
+}
+
+/* Queue the dirty list for write-back, from the staging buffer. The caller 
+ * ensures that the queue is empty, and so that the staging buffer is free. */
+static void wb_submit(void)
+{
+    struct volume_req *req = wb.req;
+    unsigned int i, j, k;
+    uint32_t lba;
+    const void *p;
+
+    /* Sort the dirty list into ascending LBA order. */
+    for (i = 1; i < wb.nr; i++) {
+        lba = wb.lba[i];
+        for (j = i; (j > 0) && (wb.lba[j-1] > lba); j--)
+            wb.lba[j] = wb.lba[j-1];
+        wb.lba[j] = lba;
+    }
+
+    /* Gather each run of consecutive LBAs into a single write. */
+    for (i = 0; i < wb.nr; i = j) {
+        for (j = i, k = 0; (j < wb.nr) && (wb.lba[j] == wb.lba[i] + k); j++) {
+            p = cache_clean(cache, wb.lba[j]);
+            ASSERT(p != NULL);
+            memcpy(stage + (i + k++) * SECSZ, p, SECSZ);
+            stats[cur_tag].bytes_copied += SECSZ;
+        }
+        req->buff = stage + i * SECSZ;
+        req->lba = wb.lba[i];
+        req->count = k;
+        req->write = TRUE;
+        req->done = wb_done;
+        q_submit(req++);
+    }
+
+    wb.nr = 0;
+}
+
+static DRESULT wb_flush(void)
+{
+    DRESULT res;
+
+    q_drain();
+    wb_submit();
+    q_drain();
+
+    res = wb.err;
+    wb.err = RES_OK;
+    return res;
+}
+
+/* Discard dirty sectors in range @lba..@lba+@count-1 from the dirty list. 
+ * Their cached copies are invalidated: a dirty item which is not on the list
+ * could never be written back or evicted. */
+static void wb_discard(uint32_t lba, unsigned int count)
+{
+    unsigned int i, j;
+    for (i = j = 0; i < wb.nr; i++) {
+        if ((wb.lba[i] - lba) >= count)
+            wb.lba[j++] = wb.lba[i];
+        else
+            cache_invalidate_N(cache, wb.lba[i], 1);
+    }
+    wb.nr = j;
+}
+
+static bool_t wb_overlaps(uint32_t lba, unsigned int count)
+{
+    unsigned int i;
+    for (i = 0; i < wb.nr; i++)
+        if ((wb.lba[i] - lba) < count)
+            return TRUE;
+    return FALSE;
+}
+
+static DRESULT wb_write(const BYTE *buff, uint32_t lba, unsigned int pool)
+{
+    DRESULT res = RES_OK;
+    unsigned int i;
+
+    /* Already dirty? Then simply update the cached data. */
+    for (i = 0; i < wb.nr; i++) {
+        if (wb.lba[i] == lba) {
+            (void)cache_write(cache, lba, buff, pool);
+            return RES_OK;
+        }
+    }
+
+    /* Make room in the dirty list, and for a new dirty sector in the cache. 
+     * If the cache still has no room, fall back to write-through. */
+    if ((wb.nr == WB_MAX) || !cache_write(cache, lba, buff, pool)) {
+        res = wb_flush();
+        if (!cache_write(cache, lba, buff, pool))
+            return vol_ops->write(0, buff, lba, 1);
+    }
+
+    if (wb.nr == 0)
+        wb.time = time_now();
+    wb.lba[wb.nr++] = lba;
+
+    return res;
+}
+
+/* Read-ahead: Recent read streams are tracked by the LBA each is expected to 
+ * read next. If the volume supports asynchronous requests, the next window of
+ * a stream is read into reserved cache items in the background, whenever 
+ * less than a window remains read ahead of the stream. Otherwise, a cache 
+ * miss which continues a stream is enlarged to the read-ahead window. */
+#define RA_STREAMS 4
+static struct {
+    uint32_t next[RA_STREAMS];
+    uint32_t ahead[RA_STREAMS]; /* end of data read ahead of each stream */
+    uint8_t victim; /* stream to replace when a new stream is seen */
+    uint8_t nr; /* read-ahead window, in sectors (0 = disabled) */
+    struct volume_req req;
+} ra;
+
+/* Record a read of @count sectors at @lba. Returns the stream index if the 
+ * read is sequential, else -1. */
+static int ra_detect(uint32_t lba, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < RA_STREAMS; i++) {
+        if (ra.next[i] == lba) {
+            ra.next[i] = lba + count;
+            return i;
+        }
+    }
+
+    ra.next[ra.victim] = ra.ahead[ra.victim] = lba + count;
+    ra.victim = (ra.victim + 1) % RA_STREAMS;
+    return -1;
+}
+
+static void ra_done(struct volume_req *req)
+{
+    /* The reserved items must not be left holding garbage. */
+    if ((req->res != RES_OK) && cache)
+        cache_invalidate_N(cache, req->lba, req->count);
+}
+
+static void ra_submit(int i, unsigned int pool)
+{
+    uint32_t next = ra.next[i];
+    uint8_t *d;
+
+    if ((int32_t)(ra.ahead[i] - next) < 0)
+        ra.ahead[i] = next;
+    if (!vol_ops->submit || ra.req.busy || q_full()
+        || ((ra.ahead[i] - next) >= ra.nr)
+        || ((d = cache_reserve(cache, ra.ahead[i], ra.nr, pool)) == NULL))
+        return;
+
+    ra.req.buff = d;
+    ra.req.lba = ra.ahead[i];
+    ra.req.count = ra.nr;
+    ra.req.write = FALSE;
+    ra.req.done = ra_done;
+    q_submit(&ra.req);
+    ra.ahead[i] += ra.nr;
+}
+
+#if !defined(BOOTLOADER) && !defined(RELOADER)
+
+/* Persistent metadata: A few hot FAT and directory sectors are retained 
+ * outside the cache region, and so survive cache teardown (ie. image 
+ * switches) until the volume changes. Sectors are retained when read while 
+ * no cache exists (eg. while an image is being opened), and the hottest 
+ * metadata items are retained when the cache is torn down. Retained sectors 
+ * are kept in sync with all writes to the volume. */
+#define PERSIST_NR 4
+static struct {
+    uint32_t lba[PERSIST_NR];
+    uint32_t stamp[PERSIST_NR]; /* last use; zero if slot is invalid */
+    uint32_t clock;
+    uint8_t dat[PERSIST_NR][SECSZ];
+} persist;
+
+static int persist_find(uint32_t lba)
+{
+    int i;
+    for (i = 0; i < PERSIST_NR; i++)
+        if (persist.stamp[i] && (persist.lba[i] == lba))
+            return i;
+    return -1;
+}
+
+static bool_t persist_read(void *buff, uint32_t lba)
+{
+    int i = persist_find(lba);
+    if (i < 0)
+        return FALSE;
+    persist.stamp[i] = ++persist.clock;
+    memcpy(buff, persist.dat[i], SECSZ);
+    return TRUE;
+}
+
+static void persist_retain(const void *buff, uint32_t lba)
+{
+    int i, j;
+
+    /* Already retained? Then it is up to date: just mark it used. */
+    if ((i = persist_find(lba)) >= 0)
+        goto out;
+
+    /* Replace the least-recently-used (or an invalid) slot. */
+    for (i = 0, j = 1; j < PERSIST_NR; j++)
+        if (persist.stamp[j] < persist.stamp[i])
+            i = j;
+    persist.lba[i] = lba;
+    memcpy(persist.dat[i], buff, SECSZ);
+
+out:
+    persist.stamp[i] = ++persist.clock;
+}
+
+/* Retain the most-recently-used clean metadata items of the cache, the most 
+ * recent last, so that it is the last to be replaced. */
+static void persist_retain_cache(void)
+{
+    const void *p;
+    uint32_t lba;
+    int i;
+    for (i = PERSIST_NR-1; i >= 0; i--)
+        if ((p = cache_mru(cache, POOL_metadata, i, &lba)) != NULL)
+            persist_retain(p, lba);
+}
+
+static void persist_write(const void *buff, uint32_t lba, unsigned int count)
+{
+    const uint8_t *p = buff;
+    int i;
+    for (i = 0; i < PERSIST_NR; i++)
+        if (persist.stamp[i] && ((persist.lba[i] - lba) < count))
+            memcpy(persist.dat[i], p + (persist.lba[i] - lba) * SECSZ, SECSZ);
+}
+
+static void persist_invalidate(void)
+{
+    memset(persist.stamp, 0, sizeof(persist.stamp));
+}
+
+#else
+
+#define persist_read(b, l) FALSE
+#define persist_retain(b, l) ((void)0)
+#define persist_retain_cache() ((void)0)
+#define persist_write(b, l, c) ((void)0)
+#define persist_invalidate() ((void)0)
+
+#endif
+
 #if !defined(BOOTLOADER) && !defined(RELOADER)
+DRESULT volume_poll(void)
+{
+    DRESULT res;
+
+    q_advance();
+
+    if (q_empty() && vol_ops->idle)
+        vol_ops->idle();
+
+    if ((res = wb.err) != RES_OK) {
+        wb.err = RES_OK;
+        return res;
+    }
+
+    /* Write back in the background, once the staging buffer is free. */
+    if ((wb.nr != 0) && q_empty()
+        && (time_diff(wb.time, time_now()) >= time_ms(ff_cfg.write_back_ms)))
+        wb_submit();
+
+    return RES_OK;
+}
+
+DRESULT volume_submit(struct volume_req *req)
+{
+    DRESULT res;
+
+    if (q_full())
+        return RES_NOTRDY;
+
+    if (req->write) {
+        /* Supersede cached copies. Items are invalidated rather than updated,
+         * as an insertion could recycle items being read ahead. */
+        persist_write(req->buff, req->lba, req->count);
+        if (cache) {
+            wb_discard(req->lba, req->count);
+            cache_invalidate_N(cache, req->lba, req->count);
+        }
+    } else if (wb_overlaps(req->lba, req->count)
+               && ((res = wb_flush()) != RES_OK)) {
+        return res;
+    }
+
+    q_submit(req);
+    return RES_OK;
+}
+
+bool_t volume_req_done(struct volume_req *req)
+{
+    q_advance();
+    return !req->busy;
+}
+
+DRESULT volume_complete(struct volume_req *req)
+{
+    while (req->busy) {
+        q_advance();
+        cpu_relax();
+    }
+    return req->res;
+}
+
 void volume_cache_init(void *start, void *end)
 {
     volume_cache_destroy();
+
+    /* Carve the staging buffer from the cache region, if the region is large
+     * enough to leave a useful cache. */
+    if (ff_cfg.write_back_ms
+        && (((uint8_t *)end - (uint8_t *)start) >= 4*WB_MAX*SECSZ)) {
+        stage = start;
+        start = (uint8_t *)start + WB_MAX*SECSZ;
+    }
+
     cache = cache_init(start, end, SECSZ);
+    if (!cache) {
+        stage = NULL;
+        return;
+    }
+    wb.enabled = (stage != NULL);
+    ra.nr = ff_cfg.read_ahead;
+    cache_set_pool_quota(cache, POOL_metadata, ff_cfg.metadata_cache_pct);
+    cache_set_pool_quota(cache, POOL_data, ff_cfg.data_cache_pct);
 }
 
 void volume_cache_destroy(void)
 {
+    /* Nothing to be done about write-back errors here: FatFS has already 
+     * sync'ed, or the volume is gone. In-flight reads ahead are into the 
+     * cache region, and must complete before it is released. The volume is
+     * left quiescent (eg. with no SD transfer open) for the next user. */
+    q_drain();
+    if (volume_connected()) {
+        if (wb.nr)
+            (void)wb_flush();
+        (void)vol_ops->ioctl(0, CTRL_SYNC, NULL);
+    }
+    if (cache)
+        persist_retain_cache();
+    wb.nr = 0;
+    wb.err = RES_OK;
+    wb.enabled = FALSE;
+    ra.nr = 0;
+    stage = NULL;
     cache = NULL;
-    metadata_addr = NULL;
+    metadata_only = FALSE;
+}
+
+void volume_cache_metadata_only(void)
+{
+    if (wb.nr)
+        (void)wb_flush();
+    metadata_only = TRUE;
+    if (cache)
+        cache_set_pool_quota(cache, POOL_metadata, 100);
 }
 
-void volume_cache_metadata_only(FIL *fp)
+void volume_set_metadata_window(void *win)
 {
-    /* All metadata is accessed via the per-filesystem "sector window". */
-    metadata_addr = fp->obj.fs->win;
+    metadata_addr = win;
+}
+
+void volume_set_tag(unsigned int tag)
+{
+    cur_tag = tag;
+}
+
+const struct cache_stats *volume_cache_stats(unsigned int tag)
+{
+    return &stats[tag];
 }
 #endif
 
 DSTATUS disk_initialize(BYTE pdrv)
 {
+    /* Any queued requests, dirty sectors and statistics belong to a 
+     * previous volume. Queued requests fail. */
+    while (!q_empty())
+        req_finish(q.req[q.cons++ % Q_MAX], RES_NOTRDY);
+    q.started = FALSE;
+    wb.nr = 0;
+    wb.err = RES_OK;
+    memset(stats, 0, sizeof(stats));
+    persist_invalidate();
+
     /* Default to USB if inserted. */
     vol_ops = &usb_ops;
     if (!(usb_ops.initialize(pdrv) & STA_NOINIT))
@@ -73,40 +567,131 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
     DRESULT res;
     const void *p;
     struct cache *c;
+    struct cache_stats *s;
+    unsigned int nr;
+    int seq;
+    uint8_t *d;
+
+    unsigned int pool = cache_pool(buff);
+
+    /* Wait for in-flight requests which overlap this read. */
+    if (q_overlaps(sector, count))
+        q_drain();
 
     if (((c = cache) == NULL)
-        || (metadata_addr && (buff != metadata_addr)))
-        return vol_ops->read(pdrv, buff, sector, count);
+        || (metadata_only && (pool != POOL_metadata))) {
+        if ((pool == POOL_metadata) && (count == 1)
+            && persist_read(buff, sector))
+            return RES_OK;
+        /* The volume is needed, and it handles one request at a time: reads
+         * ahead of cached metadata may be in flight. */
+        q_drain();
+        if ((pool != POOL_metadata) || (count != 1))
+            return vol_ops->read(pdrv, buff, sector, count);
+        res = vol_ops->read(pdrv, buff, sector, count);
+        if (res == RES_OK)
+            persist_retain(buff, sector);
+        return res;
+    }
+
+    s = &stats[stats_tag(buff)];
+    cache_set_stats(c, s);
+
+    seq = ra.nr ? ra_detect(sector, count) : -1;
 
     while (count) {
         if ((p = cache_lookup(c, sector)) == NULL)
             goto read_tail;
         memcpy(buff, p, SECSZ);
+        s->bytes_copied += SECSZ;
         sector++;
         count--;
         buff += SECSZ;
     }
-    return RES_OK;
+    res = RES_OK;
+    goto out;
 
 read_tail:
+    if ((pool == POOL_metadata) && (count == 1)
+        && persist_read(buff, sector)) {
+        /* The insertion may recycle items being read ahead. */
+        if (ra.req.busy)
+            q_drain();
+        cache_update(c, sector, buff, pool);
+        return RES_OK;
+    }
+
+    /* The volume is needed, and it handles one request at a time. */
+    q_drain();
+
+    nr = ((seq >= 0) && (count < ra.nr) && !vol_ops->submit) ? ra.nr : count;
+
+    /* Do not clobber dirty cached sectors with stale volume data. */
+    if (wb_overlaps(sector, nr) && ((res = wb_flush()) != RES_OK))
+        return res;
+
+    if ((nr != count) && ((d = cache_reserve(c, sector, nr, pool)) != NULL)) {
+        /* Read ahead straight into the cache. On failure (perhaps the window 
+         * extends beyond the end of the volume) read just what was asked. */
+        res = vol_ops->read(pdrv, d, sector, nr);
+        if (res == RES_OK) {
+            memcpy(buff, d, count * SECSZ);
+            s->bytes_copied += count * SECSZ;
+            return RES_OK;
+        }
+        cache_invalidate_N(c, sector, nr);
+    }
+
     res = vol_ops->read(pdrv, buff, sector, count);
     if (res == RES_OK)
-        cache_update_N(c, sector, buff, count);
+        cache_update_N(c, sector, buff, count, pool);
+
+out:
+    if ((seq >= 0) && (res == RES_OK))
+        ra_submit(seq, pool);
     return res;
 }
 
 DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
 {
-    DRESULT res = vol_ops->write(pdrv, buff, sector, count);
+    DRESULT res;
+    unsigned int pool = cache_pool(buff);
     struct cache *c;
-    if ((res == RES_OK) && ((c = cache) != NULL)
-        && (!metadata_addr || (buff == metadata_addr)))
-        cache_update_N(c, sector, buff, count);
+
+    /* Wait for overlapping requests, and for reads ahead into the cache 
+     * (whose reserved items may otherwise be recycled below). */
+    if (ra.req.busy || q_overlaps(sector, count))
+        q_drain();
+
+    persist_write(buff, sector, count);
+
+    if (((c = cache) == NULL)
+        || (metadata_only && (pool != POOL_metadata))) {
+        q_drain();
+        return vol_ops->write(pdrv, buff, sector, count);
+    }
+
+    cache_set_stats(c, &stats[stats_tag(buff)]);
+
+    if ((count == 1) && wb.enabled)
+        return wb_write(buff, sector, pool);
+
+    /* Multi-sector writes are written through, superseding any dirty 
+     * sectors that they overlap. */
+    wb_discard(sector, count);
+    q_drain();
+    res = vol_ops->write(pdrv, buff, sector, count);
+    if (res == RES_OK)
+        cache_update_N(c, sector, buff, count, pool);
     return res;
 }
 
 DRESULT disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
 {
+    DRESULT res;
+    if ((ctrl == CTRL_SYNC) && (wb.nr || !q_empty() || wb.err)
+        && ((res = wb_flush()) != RES_OK))
+        return res;
     return vol_ops->ioctl(pdrv, ctrl, buff);
 }
 
@@ -0,0 +1,586 @@
+/*
+ * exfat.c
+ *
+ * Host test: mount an exFAT volume with the firmware's FatFS configuration,
+ * and exercise the paths which FlashFloppy relies on: contiguous (NoFatChain)
+ * and FAT-chained files, the fast-seek cluster map, mapping file offsets to
+ * volume sectors, growing a contiguous file in place with f_expand() or else
+ * as a FAT chain with f_lseek(), and reads and writes via a FIL rebuilt from
+ * a slot.
+ *
+ * The volume is built in memory: FatFS itself needs only the boot sector,
+ * the FAT, the allocation bitmap and the root directory.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+/* Volume geometry: 512-byte sectors, one sector per cluster. */
+#define SECSZ     512
+#define NR_SECS   8192
+#define FAT_OFF   32
+#define FAT_LEN   64
+#define HEAP_OFF  128
+#define NR_CLUS   (NR_SECS - HEAP_OFF)
+#define BITMAP_CL 2  /* clusters 2-3 */
+#define ROOT_CL   4
+
+static uint8_t img[NR_SECS * SECSZ];
+
+/* Test files. Each is a list of fragments (start cluster, length). */
+struct frag { uint32_t cl, nr; };
+static const struct file {
+    const char *name;
+    int contig; /* NoFatChain? */
+    struct frag frag[5]; /* terminated by a zero-length fragment */
+} files[] = {
+    /* Clusters 80-99 are left free, so that CONTIG.IMG may grow. */
+    { "CONTIG.IMG", 1, { { 16, 64 } } },
+    /* BLOCK.IMG is immediately followed by FRAG.IMG, so may not grow. */
+    { "BLOCK.IMG", 1, { { 100, 8 } } },
+    { "FRAG.IMG", 0, { { 108, 4 }, { 200, 4 }, { 150, 4 }, { 300, 4 } } },
+};
+#define NR_FILES (sizeof(files)/sizeof(files[0]))
+
+static unsigned int failures;
+
+#define CHECK(cond, fmt, ...) do {                              \
+    if (!(cond)) {                                              \
+        printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,     \
+               ## __VA_ARGS__);                                 \
+        failures++;                                             \
+    }                                                           \
+} while (0)
+
+static uint8_t *clus(uint32_t cl)
+{
+    return &img[(HEAP_OFF + cl - 2) * SECSZ];
+}
+
+static void put16(uint8_t *p, uint16_t x)
+{
+    p[0] = x; p[1] = x >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+    put16(p, x); put16(p+2, x >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t x)
+{
+    put32(p, x); put32(p+4, x >> 32);
+}
+
+static uint32_t fat_get(uint32_t cl)
+{
+    uint8_t *p = &img[FAT_OFF * SECSZ + cl * 4];
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void fat_set(uint32_t cl, uint32_t x)
+{
+    put32(&img[FAT_OFF * SECSZ + cl * 4], x);
+}
+
+static int bitmap_get(uint32_t cl)
+{
+    return (clus(BITMAP_CL)[(cl-2)/8] >> ((cl-2)&7)) & 1;
+}
+
+static void bitmap_set(uint32_t cl)
+{
+    clus(BITMAP_CL)[(cl-2)/8] |= 1u << ((cl-2)&7);
+}
+
+/* Byte @ofs of test file @f. Varies per sector to catch misplaced sectors. */
+static uint8_t pattern(unsigned int f, uint32_t ofs)
+{
+    return (uint8_t)(ofs + (ofs >> 9) * 13 + f * 0x55);
+}
+
+/* Entry-set checksum: all bytes except the checksum field itself. */
+static uint16_t set_sum(const uint8_t *p, unsigned int n)
+{
+    uint16_t sum = 0;
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        if ((i == 2) || (i == 3))
+            continue;
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + p[i];
+    }
+    return sum;
+}
+
+static uint16_t name_hash(const char *name)
+{
+    uint16_t hash = 0;
+    for (; *name; name++) {
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (uint8_t)*name;
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1);
+    }
+    return hash;
+}
+
+static void mk_file(uint8_t *ent, unsigned int f)
+{
+    const struct file *file = &files[f];
+    const struct frag *fr;
+    uint32_t size = 0, cl, ofs, i, prev = 0;
+    unsigned int len = strlen(file->name);
+
+    for (fr = file->frag; fr->nr; fr++) {
+        for (i = 0; i < fr->nr; i++) {
+            cl = fr->cl + i;
+            bitmap_set(cl);
+            for (ofs = 0; ofs < SECSZ; ofs++)
+                clus(cl)[ofs] = pattern(f, size + ofs);
+            size += SECSZ;
+            if (file->contig) {
+                /* No FAT chain: fill the FAT with garbage, which must not
+                 * be followed. */
+                fat_set(cl, 0x0badf00d);
+            } else {
+                if (prev)
+                    fat_set(prev, cl);
+                fat_set(cl, 0xffffffff);
+                prev = cl;
+            }
+        }
+    }
+
+    /* File, Stream Extension, and File Name entries. */
+    memset(ent, 0, 96);
+    ent[0] = 0x85;
+    ent[1] = 2;
+    put16(ent + 4, AM_ARC);
+    ent[32] = 0xc0;
+    ent[33] = 0x01 | (file->contig ? 0x02 : 0);
+    ent[35] = len;
+    put16(ent + 36, name_hash(file->name));
+    put64(ent + 40, size);
+    put32(ent + 52, file->frag[0].cl);
+    put64(ent + 56, size);
+    ent[64] = 0xc1;
+    for (i = 0; i < len; i++)
+        put16(ent + 66 + i*2, file->name[i]);
+    put16(ent + 2, set_sum(ent, 96));
+}
+
+static void mk_volume(void)
+{
+    uint8_t *bs = img, *ent;
+    unsigned int f;
+
+    memset(img, 0, sizeof(img));
+
+    memcpy(bs, "\xeb\x76\x90" "EXFAT   ", 11);
+    put64(bs + 72, NR_SECS);
+    put32(bs + 80, FAT_OFF);
+    put32(bs + 84, FAT_LEN);
+    put32(bs + 88, HEAP_OFF);
+    put32(bs + 92, NR_CLUS);
+    put32(bs + 96, ROOT_CL);
+    put32(bs + 100, 0x12345678);
+    put16(bs + 104, 0x100);
+    bs[108] = 9; /* 512-byte sectors */
+    bs[109] = 0; /* 1 sector per cluster */
+    bs[110] = 1; /* 1 FAT */
+    bs[111] = 0x80;
+    put16(bs + 510, 0xaa55);
+
+    fat_set(0, 0xfffffff8);
+    fat_set(1, 0xffffffff);
+    fat_set(BITMAP_CL, BITMAP_CL+1);
+    fat_set(BITMAP_CL+1, 0xffffffff);
+    fat_set(ROOT_CL, 0xffffffff);
+    bitmap_set(BITMAP_CL);
+    bitmap_set(BITMAP_CL+1);
+    bitmap_set(ROOT_CL);
+
+    /* Root directory: Allocation Bitmap, then the files. */
+    ent = clus(ROOT_CL);
+    ent[0] = 0x81;
+    put32(ent + 20, BITMAP_CL);
+    put64(ent + 24, (NR_CLUS + 7) / 8);
+    for (f = 0; f < NR_FILES; f++)
+        mk_file(ent + 32 + f*96, f);
+}
+
+/* Disk interface, onto the in-memory volume. */
+
+static unsigned int nr_writes;
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    return 0;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    return 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    if ((sector + count) > NR_SECS)
+        return RES_PARERR;
+    memcpy(buff, &img[sector * SECSZ], count * SECSZ);
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+    if ((sector + count) > NR_SECS)
+        return RES_PARERR;
+    memcpy(&img[sector * SECSZ], buff, count * SECSZ);
+    nr_writes++;
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    return RES_OK;
+}
+
+static FATFS fatfs;
+static FIL file;
+static DWORD cltbl[64];
+
+static uint32_t file_size(unsigned int f)
+{
+    const struct frag *fr;
+    uint32_t nr = 0;
+    for (fr = files[f].frag; fr->nr; fr++)
+        nr += fr->nr;
+    return nr * SECSZ;
+}
+
+static void test_mount(void)
+{
+    FRESULT fr;
+    DIR dp;
+    FILINFO fp;
+    unsigned int nr = 0;
+
+    fr = f_mount(&fatfs, "", 1);
+    CHECK(fr == FR_OK, "mount: %d", fr);
+    CHECK(fatfs.fs_type == FS_EXFAT, "fs_type %d", fatfs.fs_type);
+
+    fr = f_opendir(&dp, "");
+    CHECK(fr == FR_OK, "opendir: %d", fr);
+    for (;;) {
+        fr = f_readdir(&dp, &fp);
+        if ((fr != FR_OK) || (fp.fname[0] == '\0'))
+            break;
+        CHECK((nr < NR_FILES) && !strcmp(fp.fname, files[nr].name),
+              "dirent %u: '%s'", nr, fp.fname);
+        CHECK(fp.fsize == file_size(nr), "%s: size %llu",
+              fp.fname, (unsigned long long)fp.fsize);
+        nr++;
+    }
+    f_closedir(&dp);
+    CHECK(nr == NR_FILES, "%u directory entries", nr);
+}
+
+/* Read each file sequentially, in chunks which straddle sectors. */
+static void test_read(void)
+{
+    static uint8_t buf[1000];
+    unsigned int f, i, br;
+    uint32_t ofs, size;
+    FRESULT fr;
+
+    for (f = 0; f < NR_FILES; f++) {
+        fr = f_open(&file, files[f].name, FA_READ);
+        CHECK(fr == FR_OK, "%s: open %d", files[f].name, fr);
+        if (fr)
+            continue;
+        CHECK(file.obj.stat == (files[f].contig ? 2 : 0),
+              "%s: stat %d", files[f].name, file.obj.stat);
+        size = file_size(f);
+        for (ofs = 0; ofs < size; ofs += br) {
+            fr = f_read(&file, buf, sizeof(buf), &br);
+            if ((fr != FR_OK) || (br == 0))
+                break;
+            for (i = 0; (i < br) && (buf[i] == pattern(f, ofs+i)); i++)
+                continue;
+            if (i != br)
+                break;
+        }
+        CHECK(ofs == size, "%s: read %u/%u (fr=%d)",
+              files[f].name, ofs, size, fr);
+        f_close(&file);
+    }
+}
+
+/* Build each file's cluster map, then read at pseudo-random offsets. */
+static void test_fastseek(void)
+{
+    uint8_t buf[37];
+    unsigned int f, i, j, br, nfrag;
+    uint32_t ofs, seed = 1;
+    FRESULT fr;
+
+    for (f = 0; f < NR_FILES; f++) {
+        for (nfrag = 0; files[f].frag[nfrag].nr; nfrag++)
+            continue;
+        fr = f_open(&file, files[f].name, FA_READ);
+        CHECK(fr == FR_OK, "%s: open %d", files[f].name, fr);
+        if (fr)
+            continue;
+        cltbl[0] = sizeof(cltbl) / sizeof(cltbl[0]);
+        file.cltbl = cltbl;
+        fr = f_lseek(&file, CREATE_LINKMAP);
+        CHECK(fr == FR_OK, "%s: linkmap %d", files[f].name, fr);
+        CHECK(cltbl[1] == nfrag, "%s: %u frags, expected %u",
+              files[f].name, cltbl[1], nfrag);
+        for (i = 0; i < 200; i++) {
+            seed = seed * 1103515245 + 12345;
+            ofs = (seed >> 8) % (file_size(f) - sizeof(buf));
+            fr = f_lseek(&file, ofs);
+            if (fr == FR_OK)
+                fr = f_read(&file, buf, sizeof(buf), &br);
+            if ((fr != FR_OK) || (br != sizeof(buf)))
+                break;
+            for (j = 0; (j < br) && (buf[j] == pattern(f, ofs+j)); j++)
+                continue;
+            if (j != br)
+                break;
+        }
+        CHECK(i == 200, "%s: fast seek to %u (fr=%d)",
+              files[f].name, ofs, fr);
+        f_close(&file);
+    }
+}
+
+/* Map every sector of each file to the volume with f_sector(), walking 
+ * backwards so that each lookup rewinds the cluster map. A chained file 
+ * cannot be mapped without a cluster map. */
+static void test_sector(void)
+{
+    const struct frag *frag;
+    unsigned int f, nr, nr_exp;
+    uint32_t sec, i;
+    DWORD sect;
+    FRESULT fr;
+
+    for (f = 0; f < NR_FILES; f++) {
+        fr = f_open(&file, files[f].name, FA_READ);
+        CHECK(fr == FR_OK, "%s: open %d", files[f].name, fr);
+        if (fr)
+            continue;
+        fr = f_sector(&file, 0, &sect, &nr);
+        CHECK(files[f].contig ? (fr == FR_OK) : (fr == FR_DENIED),
+              "%s: unmapped f_sector %d", files[f].name, fr);
+        fr = f_sector(&file, SECSZ / 2, &sect, &nr);
+        CHECK(fr == FR_INVALID_PARAMETER, "%s: unaligned f_sector %d",
+              files[f].name, fr);
+        cltbl[0] = sizeof(cltbl) / sizeof(cltbl[0]);
+        file.cltbl = cltbl;
+        fr = f_lseek(&file, CREATE_LINKMAP);
+        CHECK(fr == FR_OK, "%s: linkmap %d", files[f].name, fr);
+        for (sec = file_size(f) / SECSZ; sec-- != 0; ) {
+            for (frag = files[f].frag, i = sec; i >= frag->nr; frag++)
+                i -= frag->nr;
+            nr_exp = frag->nr - i;
+            fr = f_sector(&file, sec * SECSZ, &sect, &nr);
+            if ((fr != FR_OK) || (sect != HEAP_OFF + frag->cl - 2 + i)
+                || (nr != nr_exp))
+                break;
+        }
+        CHECK(sec == ~0u, "%s: sector %u -> %u+%u (fr=%d)",
+              files[f].name, sec, sect, nr, fr);
+        fr = f_sector(&file, file_size(f), &sect, &nr);
+        CHECK(fr == FR_INVALID_PARAMETER, "%s: f_sector at EOF %d",
+              files[f].name, fr);
+        f_close(&file);
+    }
+}
+
+static FRESULT expand(const char *name, uint32_t nr_clus)
+{
+    FRESULT fr;
+
+    fr = f_open(&file, name, FA_READ|FA_WRITE);
+    CHECK(fr == FR_OK, "%s: open %d", name, fr);
+    if (fr)
+        return fr;
+    fr = f_expand(&file, f_size(&file) + nr_clus * SECSZ, 1);
+    f_close(&file);
+    return fr;
+}
+
+static void test_expand(void)
+{
+    FRESULT fr;
+    uint32_t cl;
+
+    /* CONTIG.IMG grows into the ten clusters that follow it... */
+    fr = expand("CONTIG.IMG", 10);
+    CHECK(fr == FR_OK, "CONTIG.IMG: expand %d", fr);
+    for (cl = 80; cl < 90; cl++)
+        CHECK(bitmap_get(cl), "cluster %u not allocated", cl);
+    CHECK(!bitmap_get(90), "cluster 90 allocated");
+    CHECK(fat_get(80) == 0, "FAT entry written for NoFatChain file");
+    fr = f_open(&file, "CONTIG.IMG", FA_READ);
+    CHECK((fr == FR_OK) && (f_size(&file) == (64+10) * SECSZ)
+          && (file.obj.stat == 2),
+          "CONTIG.IMG: reopened size %llu stat %d",
+          (unsigned long long)f_size(&file), file.obj.stat);
+    f_close(&file);
+
+    /* ...but no further than the next file, and never elsewhere. */
+    fr = expand("CONTIG.IMG", 11);
+    CHECK(fr == FR_DENIED, "CONTIG.IMG: overgrown expand %d", fr);
+    CHECK(!bitmap_get(90), "cluster 90 allocated");
+
+    fr = expand("BLOCK.IMG", 1);
+    CHECK(fr == FR_DENIED, "BLOCK.IMG: expand %d", fr);
+
+    /* FAT-chained files are extended via f_lseek() by the firmware. */
+    fr = expand("FRAG.IMG", 1);
+    CHECK(fr == FR_DENIED, "FRAG.IMG: expand %d", fr);
+}
+
+/* As image_extend(): BLOCK.IMG cannot grow in place, so it is extended by
+ * f_lseek() into free space elsewhere, and gains a FAT chain. It is then
+ * re-opened as fatfs_from_slot(), from a slot refreshed after the extend. */
+static void test_extend_chain(void)
+{
+    static uint8_t buf[4 * SECSZ];
+    struct { DWORD sclust; FSIZE_t size; BYTE stat; } slot;
+    uint32_t ofs, size = file_size(1);
+    unsigned int i, br, bw;
+    FRESULT fr;
+
+    fr = f_open(&file, "BLOCK.IMG", FA_READ|FA_WRITE);
+    CHECK(fr == FR_OK, "BLOCK.IMG: open %d", fr);
+    if (fr)
+        return;
+    fr = f_expand(&file, size + sizeof(buf), 1);
+    CHECK(fr == FR_DENIED, "BLOCK.IMG: expand %d", fr);
+    fr = f_lseek(&file, size + sizeof(buf));
+    CHECK((fr == FR_OK) && (f_size(&file) == size + sizeof(buf)),
+          "BLOCK.IMG: extend %d, size %llu", fr,
+          (unsigned long long)f_size(&file));
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = pattern(1, size + i);
+    fr = f_lseek(&file, size);
+    if (fr == FR_OK)
+        fr = f_write(&file, buf, sizeof(buf), &bw);
+    if (fr == FR_OK)
+        fr = f_sync(&file);
+    CHECK(fr == FR_OK, "BLOCK.IMG: write extension %d", fr);
+    CHECK(file.obj.stat == 0, "BLOCK.IMG: stat %d after extend",
+          file.obj.stat);
+    CHECK(fat_get(100) == 101, "BLOCK.IMG: no FAT chain");
+    slot.sclust = file.obj.sclust;
+    slot.size = file.obj.objsize;
+    slot.stat = file.obj.stat;
+    f_close(&file);
+
+    memset(&file, 0, sizeof(file));
+    file.obj.fs = &fatfs;
+    file.obj.id = fatfs.id;
+    file.obj.attr = AM_ARC;
+    file.obj.sclust = slot.sclust;
+    file.obj.objsize = slot.size;
+    file.obj.stat = slot.stat;
+    file.flag = FA_READ;
+
+    cltbl[0] = sizeof(cltbl) / sizeof(cltbl[0]);
+    file.cltbl = cltbl;
+    fr = f_lseek(&file, CREATE_LINKMAP);
+    CHECK((fr == FR_OK) && (cltbl[1] == 2),
+          "BLOCK.IMG: linkmap %d, %u frags", fr, cltbl[1]);
+    for (ofs = 0; ofs < slot.size; ofs += br) {
+        fr = f_lseek(&file, ofs);
+        if (fr == FR_OK)
+            fr = f_read(&file, buf, SECSZ, &br);
+        if ((fr != FR_OK) || (br != SECSZ))
+            break;
+        for (i = 0; (i < br) && (buf[i] == pattern(1, ofs+i)); i++)
+            continue;
+        if (i != br)
+            break;
+    }
+    CHECK(ofs == slot.size, "BLOCK.IMG: read back %u/%u (fr=%d)",
+          ofs, (uint32_t)slot.size, fr);
+}
+
+/* As fatfs_from_slot(): a FIL rebuilt without its directory entry. */
+static void test_slot_write(void)
+{
+    static uint8_t root[SECSZ], buf[SECSZ];
+    struct { DWORD sclust; FSIZE_t size; BYTE stat; } slot;
+    unsigned int bw, i;
+    FRESULT fr;
+
+    fr = f_open(&file, "BLOCK.IMG", FA_READ|FA_WRITE);
+    CHECK(fr == FR_OK, "BLOCK.IMG: open %d", fr);
+    if (fr)
+        return;
+    slot.sclust = file.obj.sclust;
+    slot.size = file.obj.objsize;
+    slot.stat = file.obj.stat;
+    f_close(&file);
+
+    memset(&file, 0, sizeof(file));
+    file.obj.fs = &fatfs;
+    file.obj.id = fatfs.id;
+    file.obj.attr = AM_ARC;
+    file.obj.sclust = slot.sclust;
+    file.obj.objsize = slot.size;
+    file.obj.stat = slot.stat;
+    file.flag = FA_READ|FA_WRITE;
+
+    memcpy(root, clus(ROOT_CL), SECSZ);
+    memset(buf, 0xa5, sizeof(buf));
+    fr = f_lseek(&file, 3 * SECSZ);
+    if (fr == FR_OK)
+        fr = f_write(&file, buf, sizeof(buf), &bw);
+    if (fr == FR_OK)
+        fr = f_sync(&file);
+    CHECK(fr == FR_OK, "slot write: %d", fr);
+    for (i = 0; (i < SECSZ) && (clus(103)[i] == 0xa5); i++)
+        continue;
+    CHECK(i == SECSZ, "slot write: data not at cluster 103");
+    CHECK(!memcmp(root, clus(ROOT_CL), SECSZ),
+          "slot write: directory was modified");
+}
+
+int main(int argc, char **argv)
+{
+    mk_volume();
+    test_mount();
+    test_read();
+    test_fastseek();
+    test_sector();
+    test_expand();
+    test_extend_chain();
+    test_slot_write();
+    printf("exfat: %s (%u disk writes)\n",
+           failures ? "FAILED" : "passed", nr_writes);
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
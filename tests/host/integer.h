@@ -0,0 +1,37 @@
+/*
+ * integer.h
+ *
+ * FatFS integer types for host builds. FatFS assumes the target's 32-bit
+ * long, which an LP64 host does not have. Force-included ahead of FatFS's
+ * own integer.h, which is then skipped.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef FF_INTEGER
+#define FF_INTEGER
+
+typedef int                INT;
+typedef unsigned int       UINT;
+typedef unsigned char      BYTE;
+typedef short              SHORT;
+typedef unsigned short     WORD;
+typedef unsigned short     WCHAR;
+typedef int                LONG;
+typedef unsigned int       DWORD;
+typedef unsigned long long QWORD;
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
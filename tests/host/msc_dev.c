@@ -0,0 +1,489 @@
+/*
+ * msc_dev.c
+ *
+ * Scripted USB mass-storage device: descriptors and standard requests on
+ * the control pipe, and the Bulk-Only Transport on bulk endpoints 0x81 (IN)
+ * and 0x02 (OUT). Commands may be given an access latency, during which the
+ * device NAKs, and may be scripted to NAK, STALL, or fail with a phase error.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "msc_dev.h"
+
+#define EP_IN   1
+#define EP_OUT  2
+#define MPS     64
+
+#define CBW_SIG 0x43425355
+#define CSW_SIG 0x53425355
+
+#define CSW_OK    0
+#define CSW_FAIL  1
+#define CSW_PHASE 2
+
+struct msc_dev_stats msc_dev_stats;
+
+static uint32_t lat_us[256];
+static uint16_t seen[256];
+
+#define NR_FAULTS 8
+static struct fault {
+    uint8_t op;
+    uint16_t nth;
+    uint8_t fault;
+    uint16_t arg;
+} faults[NR_FAULTS];
+
+static const uint8_t dev_desc[] = {
+    18, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, MPS,
+    MSC_DEV_VID & 0xff, MSC_DEV_VID >> 8,
+    MSC_DEV_PID & 0xff, MSC_DEV_PID >> 8,
+    0x00, 0x01, 1, 2, 3, 1
+};
+
+static const uint8_t cfg_desc[] = {
+    9, 0x02, 32, 0, 1, 1, 0, 0x80, 50,
+    9, 0x04, 0, 0, 2, 0x08, 0x06, 0x50, 0,
+    7, 0x05, 0x80 | EP_IN, 0x02, MPS, 0, 0,
+    7, 0x05, EP_OUT, 0x02, MPS, 0, 0
+};
+
+static const char *const strings[] = {
+    NULL, "FlashFloppy", "MSC Model", MSC_DEV_SERIAL
+};
+
+static struct {
+    uint8_t *img;
+    uint32_t nr_blocks;
+    uint8_t addr, new_addr;
+
+    /* Control pipe: the IN data of the current request. */
+    uint8_t ctl[64];
+    unsigned int ctl_len, ctl_pos;
+    bool_t ctl_stall;
+
+    /* Bulk pipes. */
+    bool_t halt_in, halt_out;
+    uint8_t toggle_in, toggle_out;
+    enum { BOT_CBW, BOT_DATA_IN, BOT_DATA_OUT, BOT_CSW } bot;
+    uint32_t tag, len, pos; /* data phase: expected and transferred bytes */
+    uint8_t *data;          /* data phase: buffer, or image for READ/WRITE */
+    uint8_t buf[36];
+    uint32_t data_len;
+    uint8_t op, status, sense;
+    uint64_t ready;         /* NAK data (reads) or CSW (others) until */
+    const struct fault *fault;
+    unsigned int naks;      /* scripted NAKs remaining for this packet */
+} d;
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t x)
+{
+    p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+void msc_dev_init(uint8_t *img, uint32_t nr_blocks)
+{
+    memset(&d, 0, sizeof(d));
+    d.img = img;
+    d.nr_blocks = nr_blocks;
+}
+
+void msc_dev_latency(uint8_t op, uint32_t us)
+{
+    lat_us[op] = us;
+}
+
+void msc_dev_fault(uint8_t op, unsigned int nth, unsigned int fault,
+                   unsigned int arg)
+{
+    unsigned int i;
+    for (i = 0; i < NR_FAULTS; i++) {
+        if (faults[i].fault == 0) {
+            faults[i].op = op;
+            faults[i].nth = seen[op] + nth;
+            faults[i].fault = fault;
+            faults[i].arg = arg;
+            return;
+        }
+    }
+}
+
+static const struct fault *fault_find(uint8_t op)
+{
+    unsigned int i;
+    for (i = 0; i < NR_FAULTS; i++)
+        if (faults[i].fault && (faults[i].op == op)
+            && (faults[i].nth == seen[op]))
+            return &faults[i];
+    return NULL;
+}
+
+static bool_t fault_is(unsigned int fault)
+{
+    return d.fault && (d.fault->fault == fault);
+}
+
+/* A scripted NAK of the next data or CSW packet? */
+static bool_t nak(void)
+{
+    if (d.naks == 0)
+        return FALSE;
+    d.naks--;
+    return TRUE;
+}
+
+static void packet_done(void)
+{
+    d.naks = fault_is(MSC_FAULT_NAK) ? d.fault->arg : 0;
+}
+
+static void bot_reset(void)
+{
+    d.bot = BOT_CBW;
+    d.halt_in = d.halt_out = FALSE;
+    d.toggle_in = d.toggle_out = 0;
+}
+
+static void dev_reset(void)
+{
+    d.addr = d.new_addr = 0;
+    d.ctl_len = d.ctl_pos = 0;
+    d.ctl_stall = FALSE;
+    bot_reset();
+}
+
+/*
+ * Control pipe.
+ */
+
+static void ctl_reply(const void *p, unsigned int len, unsigned int wlen)
+{
+    d.ctl_len = min(len, min_t(unsigned int, wlen, sizeof(d.ctl)));
+    memcpy(d.ctl, p, d.ctl_len);
+}
+
+static void get_descriptor(uint8_t type, uint8_t idx, unsigned int wlen)
+{
+    uint8_t s[64];
+    unsigned int i;
+
+    switch (type) {
+    case 0x01:
+        ctl_reply(dev_desc, sizeof(dev_desc), wlen);
+        break;
+    case 0x02:
+        ctl_reply(cfg_desc, sizeof(cfg_desc), wlen);
+        break;
+    case 0x03:
+        if (idx >= ARRAY_SIZE(strings)) {
+            d.ctl_stall = TRUE;
+        } else if (idx == 0) {
+            s[0] = 4; s[1] = 0x03; s[2] = 0x09; s[3] = 0x04;
+            ctl_reply(s, 4, wlen);
+        } else {
+            for (i = 0; strings[idx][i]; i++) {
+                s[2+i*2] = strings[idx][i];
+                s[3+i*2] = 0;
+            }
+            s[0] = 2 + i*2;
+            s[1] = 0x03;
+            ctl_reply(s, s[0], wlen);
+        }
+        break;
+    default:
+        d.ctl_stall = TRUE;
+        break;
+    }
+}
+
+static int dev_setup(uint8_t addr, const uint8_t *pkt)
+{
+    uint8_t type = pkt[0], req = pkt[1];
+    uint16_t wval = pkt[2] | (pkt[3] << 8);
+    uint16_t widx = pkt[4] | (pkt[5] << 8);
+    uint16_t wlen = pkt[6] | (pkt[7] << 8);
+    uint8_t zero = 0;
+
+    if (addr != d.addr)
+        return OTG_NONE;
+
+    d.ctl_len = d.ctl_pos = 0;
+    d.ctl_stall = FALSE;
+
+    switch ((type << 8) | req) {
+    case 0x8006: /* GET_DESCRIPTOR */
+        get_descriptor(wval >> 8, wval, wlen);
+        break;
+    case 0x0005: /* SET_ADDRESS: takes effect after the status stage */
+        d.new_addr = wval & 0x7f;
+        break;
+    case 0x0009: /* SET_CONFIGURATION */
+        bot_reset();
+        break;
+    case 0x0201: /* CLEAR_FEATURE(ENDPOINT_HALT) */
+        if ((widx & 0x7f) == EP_IN) {
+            d.halt_in = FALSE;
+            d.toggle_in = 0;
+        } else if ((widx & 0x7f) == EP_OUT) {
+            d.halt_out = FALSE;
+            d.toggle_out = 0;
+        }
+        break;
+    case 0xa1fe: /* GET_MAX_LUN */
+        ctl_reply(&zero, 1, wlen);
+        break;
+    case 0x21ff: /* Bulk-Only Mass Storage Reset */
+        d.bot = BOT_CBW;
+        break;
+    default:
+        d.ctl_stall = TRUE;
+        break;
+    }
+
+    return OTG_ACK;
+}
+
+static int ctl_in(uint8_t *buf, unsigned int mps, unsigned int *len)
+{
+    if (d.ctl_stall)
+        return OTG_STALL;
+    /* Data stage, or a zero-length status stage. */
+    *len = min(mps, d.ctl_len - d.ctl_pos);
+    memcpy(buf, &d.ctl[d.ctl_pos], *len);
+    d.ctl_pos += *len;
+    if (d.new_addr) {
+        d.addr = d.new_addr;
+        d.new_addr = 0;
+    }
+    return OTG_ACK;
+}
+
+/*
+ * Bulk-Only Transport.
+ */
+
+static void cmd_fail(uint8_t sense)
+{
+    d.status = CSW_FAIL;
+    d.sense = sense;
+}
+
+static void cmd_start(const uint8_t *cbw)
+{
+    const uint8_t *cb = &cbw[15];
+    uint32_t lba, nr;
+
+    d.tag = get_le32(&cbw[4]);
+    d.len = get_le32(&cbw[8]);
+    d.pos = 0;
+    d.op = cb[0];
+    d.status = CSW_OK;
+    d.data = d.buf;
+    d.data_len = 0;
+    memset(d.buf, 0, sizeof(d.buf));
+
+    seen[d.op]++;
+    d.fault = fault_find(d.op);
+    packet_done();
+    msc_dev_stats.cmds++;
+    msc_dev_stats.lat_ns += lat_us[d.op] * 1000ull;
+
+    switch (d.op) {
+    case 0x00: /* TEST UNIT READY */
+        break;
+    case 0x03: /* REQUEST SENSE */
+        d.buf[0] = 0x70;
+        d.buf[2] = d.sense;
+        d.buf[7] = 10;
+        d.data_len = 18;
+        d.sense = 0;
+        break;
+    case 0x12: /* INQUIRY */
+        d.buf[1] = 0x80; /* removable */
+        d.buf[2] = 0x02;
+        d.buf[3] = 0x02;
+        d.buf[4] = 31;
+        memcpy(&d.buf[8], "SIM     MSC Model       1.00", 28);
+        d.data_len = 36;
+        break;
+    case 0x1a: /* MODE SENSE (6) */
+        d.buf[0] = 3;
+        d.data_len = 4;
+        break;
+    case 0x25: /* READ CAPACITY (10) */
+        put_be32(&d.buf[0], d.nr_blocks - 1);
+        put_be32(&d.buf[4], 512);
+        d.data_len = 8;
+        break;
+    case 0x28: /* READ (10) */
+    case 0x2a: /* WRITE (10) */
+        lba = get_be32(&cb[2]);
+        nr = (cb[7] << 8) | cb[8];
+        if ((lba + nr > d.nr_blocks) || (nr * 512 != d.len)) {
+            cmd_fail(0x05); /* ILLEGAL REQUEST */
+            break;
+        }
+        d.data = d.img + lba * 512;
+        d.data_len = d.len;
+        break;
+    default:
+        cmd_fail(0x05);
+        break;
+    }
+
+    if (fault_is(MSC_FAULT_STALL) || ((d.status != CSW_OK) && d.len)) {
+        /* Refuse the data phase: the host clears the halt and reads CSW. */
+        if (cbw[12] & 0x80)
+            d.halt_in = TRUE;
+        else
+            d.halt_out = TRUE;
+        d.status = CSW_FAIL;
+        d.bot = BOT_CSW;
+    } else if (d.len == 0) {
+        d.bot = BOT_CSW;
+    } else {
+        d.bot = (cbw[12] & 0x80) ? BOT_DATA_IN : BOT_DATA_OUT;
+    }
+    if (fault_is(MSC_FAULT_PHASE))
+        d.status = CSW_PHASE;
+
+    /* Reads wait for their data. Others wait (for status) after data out. */
+    if (d.bot != BOT_DATA_OUT)
+        d.ready = otg_sim_ns + lat_us[d.op] * 1000ull;
+}
+
+static int bulk_out(uint8_t pid, const uint8_t *buf, unsigned int len)
+{
+    if (d.halt_out)
+        return OTG_STALL;
+
+    if ((d.bot == BOT_DATA_OUT) && nak())
+        return OTG_NAK;
+
+    /* A retransmission of a packet we already acknowledged. */
+    if (pid != d.toggle_out) {
+        msc_dev_stats.dup_out++;
+        return OTG_ACK;
+    }
+
+    switch (d.bot) {
+    case BOT_CBW:
+        if ((len != 31) || (get_le32(buf) != CBW_SIG)) {
+            msc_dev_stats.bad_cbw++;
+            d.halt_in = d.halt_out = TRUE;
+            return OTG_STALL;
+        }
+        cmd_start(buf);
+        break;
+    case BOT_DATA_OUT:
+        len = min(len, d.len - d.pos);
+        memcpy(d.data + d.pos, buf, len);
+        d.pos += len;
+        packet_done();
+        if (d.pos == d.len) {
+            d.bot = BOT_CSW;
+            d.ready = otg_sim_ns + lat_us[d.op] * 1000ull;
+        }
+        break;
+    default:
+        d.halt_out = TRUE;
+        return OTG_STALL;
+    }
+
+    d.toggle_out ^= 1;
+    return OTG_ACK;
+}
+
+static int bulk_in(uint8_t *buf, unsigned int mps, unsigned int *len,
+                   uint8_t *pid)
+{
+    if (d.halt_in)
+        return OTG_STALL;
+
+    switch (d.bot) {
+    case BOT_DATA_IN:
+        if ((otg_sim_ns < d.ready) || nak())
+            return OTG_NAK;
+        *len = min(mps, d.len - d.pos);
+        memset(buf, 0, *len);
+        if (d.pos < d.data_len)
+            memcpy(buf, d.data + d.pos, min(*len, d.data_len - d.pos));
+        d.pos += *len;
+        packet_done();
+        if (d.pos == d.len)
+            d.bot = BOT_CSW;
+        break;
+    case BOT_CSW:
+        if ((otg_sim_ns < d.ready) || nak())
+            return OTG_NAK;
+        put_le32(&buf[0], CSW_SIG);
+        put_le32(&buf[4], d.tag);
+        put_le32(&buf[8], d.len - d.pos);
+        buf[12] = d.status;
+        *len = 13;
+        d.bot = BOT_CBW;
+        break;
+    default:
+        return OTG_NAK;
+    }
+
+    *pid = d.toggle_in;
+    d.toggle_in ^= 1;
+    return OTG_ACK;
+}
+
+static int dev_out(uint8_t addr, uint8_t ep, uint8_t pid,
+                   const uint8_t *buf, unsigned int len)
+{
+    if (addr != d.addr)
+        return OTG_NONE;
+    if (ep == 0)
+        return d.ctl_stall ? OTG_STALL : OTG_ACK; /* status stage */
+    return (ep == EP_OUT) ? bulk_out(pid, buf, len) : OTG_STALL;
+}
+
+static int dev_in(uint8_t addr, uint8_t ep, uint8_t *buf, unsigned int mps,
+                  unsigned int *len, uint8_t *pid)
+{
+    if (addr != d.addr)
+        return OTG_NONE;
+    if (ep == 0)
+        return ctl_in(buf, mps, len);
+    return (ep == EP_IN) ? bulk_in(buf, mps, len, pid) : OTG_STALL;
+}
+
+const struct otg_sim_dev msc_dev = {
+    .reset = dev_reset,
+    .setup = dev_setup,
+    .out = dev_out,
+    .in = dev_in
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,53 @@
+/*
+ * msc_dev.h
+ *
+ * Scripted USB mass-storage device (Bulk-Only Transport, SCSI transparent
+ * command set), backed by an in-memory image of 512-byte blocks. Plugs into
+ * the OTG_FS core model as a full-speed device.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef MSC_DEV_H
+#define MSC_DEV_H
+
+#define MSC_DEV_VID 0x1234
+#define MSC_DEV_PID 0x5678
+#define MSC_DEV_SERIAL "SIM0001"
+
+/* Faults which may be scripted against a SCSI command. */
+#define MSC_FAULT_NAK   1 /* NAK each data and CSW packet @arg times */
+#define MSC_FAULT_STALL 2 /* STALL the data phase: the CSW reports failure */
+#define MSC_FAULT_PHASE 3 /* the CSW reports a phase error */
+
+struct msc_dev_stats {
+    uint32_t cmds;     /* CBWs accepted */
+    uint32_t dup_out;  /* bulk OUT packets resent with a stale DATAx */
+    uint32_t bad_cbw;  /* invalid CBWs */
+    uint64_t lat_ns;   /* scripted latency of the commands received */
+};
+
+extern const struct otg_sim_dev msc_dev;
+extern struct msc_dev_stats msc_dev_stats;
+
+void msc_dev_init(uint8_t *img, uint32_t nr_blocks);
+/* Delay before the command's data (reads) or status (others) is ready. */
+void msc_dev_latency(uint8_t op, uint32_t us);
+/* Apply @fault to the @nth command with opcode @op, counting from now. */
+void msc_dev_fault(uint8_t op, unsigned int nth, unsigned int fault,
+                   unsigned int arg);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
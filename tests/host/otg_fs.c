@@ -0,0 +1,640 @@
+/*
+ * otg_fs.c
+ *
+ * Host model of the STM32 OTG_FS core: registers, FIFOs and channel
+ * interrupts, as driven by the firmware's USB host stack in slave mode.
+ * Also provides the board callbacks of src/usb/usb_bsp.c, and time_now(),
+ * against the simulated clock.
+ *
+ * Bus timing is that of a full-speed link: each transaction costs a fixed
+ * overhead for token, handshake and turnaround, plus 8 bit times per byte of
+ * data. Transactions are serialised on the bus.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+
+/* Not <stdlib.h>: its time_t would clash with the firmware's. */
+void exit(int status) __attribute__((noreturn));
+
+#include "usb_bsp.h"
+#include "usb_hcd_int.h"
+
+#define XACT_NS 3000 /* token, handshake and inter-packet gaps */
+#define BYTE_NS  667 /* 8 bits at 12Mbit/s */
+
+#define NR_CH   8
+#define NR_RXQ  16
+#define NPTXF_WORDS TXH_NP_FS_FIFOSIZ
+
+/* Register offsets from the core's base address. */
+#define R_GRSTCTL   0x010
+#define R_GINTSTS   0x014
+#define R_GINTMSK   0x018
+#define R_GRXSTSR   0x01c
+#define R_GRXSTSP   0x020
+#define R_HNPTXSTS  0x02c
+#define R_HFNUM     0x408
+#define R_HPTXSTS   0x410
+#define R_HAINT     0x414
+#define R_HAINTMSK  0x418
+#define R_HPRT      0x440
+#define R_HC        0x500 /* 0x20 bytes per channel */
+#define R_FIFO      0x1000 /* 0x1000 bytes per channel */
+#define R_END       (R_FIFO + NR_CH * 0x1000)
+
+#define HC_HCCHAR   0x00
+#define HC_HCINT    0x08
+#define HC_HCINTMSK 0x0c
+#define HC_HCTSIZ   0x10
+
+/* Interrupt status bits which are latched, and cleared by writing 1: SOF,
+ * incomplete periodic transfer, and disconnect. The others reflect the
+ * state of the port, the channels and the FIFOs. */
+#define GINTSTS_LATCHED 0x20200008u
+/* HPRT bits which are cleared by writing 1. */
+#define HPRT_W1C    0x0000002au
+#define HPRT_RO     0x00060c01u
+
+uint64_t otg_sim_ns;
+struct otg_sim_cfg otg_sim_cfg = { .poll_ns = 2000, .isr_ns = 2000 };
+struct otg_sim_stats otg_sim_stats;
+
+USB_OTG_CORE_HANDLE USB_OTG_Core;
+
+static const struct otg_sim_dev *dev;
+
+static uint32_t regs[R_FIFO / 4];
+static bool_t irq_enabled, in_isr;
+static uint64_t bus_free;
+
+static struct chan {
+    enum { CH_IDLE, CH_START, CH_XFER, CH_WAIT } state;
+    bool_t retry;  /* CH_WAIT: re-enable retries the NAKed IN token */
+    uint64_t due;  /* CH_START: token; CH_XFER: end of transaction */
+    int hs;        /* CH_XFER: handshake */
+    unsigned int len;
+    uint8_t pid, exp_pid; /* received and expected DATAx of an IN packet */
+    uint8_t buf[64];
+    uint8_t tx[4 * NPTXF_WORDS];
+    unsigned int tx_len;
+} chan[NR_CH];
+
+static struct rx_entry {
+    uint32_t sts;
+    uint8_t data[64];
+} rxq[NR_RXQ];
+static unsigned int rxq_prod, rxq_cons;
+static const uint8_t *rx_data;
+static unsigned int rx_len;
+
+#define reg(off) regs[(off)/4]
+#define hc_reg(n, off) reg(R_HC + (n)*0x20 + (off))
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "otg_sim: %s\n", msg);
+    exit(1);
+}
+
+static uint32_t haint(void)
+{
+    uint32_t x = 0;
+    unsigned int n;
+    for (n = 0; n < NR_CH; n++)
+        if (hc_reg(n, HC_HCINT) & hc_reg(n, HC_HCINTMSK))
+            x |= 1u << n;
+    return x;
+}
+
+static unsigned int tx_words(void)
+{
+    unsigned int n, words = 0;
+    for (n = 0; n < NR_CH; n++)
+        words += chan[n].tx_len / 4;
+    return words;
+}
+
+static uint32_t gintsts(void)
+{
+    USB_OTG_GINTSTS_TypeDef s;
+    USB_OTG_GUSBCFG_TypeDef usbcfg;
+    s.d32 = reg(R_GINTSTS) & GINTSTS_LATCHED;
+    usbcfg.d32 = reg(0x00c);
+    s.b.curmode = usbcfg.b.force_host;
+    s.b.rxstsqlvl = (rxq_prod != rxq_cons);
+    s.b.nptxfempty = (tx_words() == 0);
+    s.b.ptxfempty = 1;
+    s.b.portintr = !!(reg(R_HPRT) & HPRT_W1C);
+    s.b.hcintr = !!(haint() & reg(R_HAINTMSK));
+    return s.d32;
+}
+
+static bool_t irq_pending(void)
+{
+    return irq_enabled && (reg(0x008) & 1) && (gintsts() & reg(R_GINTMSK));
+}
+
+/* Deliver the core interrupt for as long as it is pending. */
+static void otg_irq(void)
+{
+    unsigned int n = 0;
+    if (in_isr)
+        return;
+    while (irq_pending()) {
+        if (++n > 1000)
+            fatal("interrupt storm");
+        in_isr = TRUE;
+        USBH_OTG_ISR_Handler(&USB_OTG_Core);
+        in_isr = FALSE;
+        otg_sim_stats.isrs++;
+        otg_sim_ns += otg_sim_cfg.isr_ns;
+    }
+}
+
+static void rxq_push(unsigned int ch, unsigned int pktsts,
+                     const uint8_t *data, unsigned int len, uint8_t pid)
+{
+    USB_OTG_GRXFSTS_TypeDef sts;
+    struct rx_entry *e;
+    if ((rxq_prod - rxq_cons) == NR_RXQ)
+        fatal("RX FIFO overflow");
+    e = &rxq[rxq_prod++ % NR_RXQ];
+    sts.d32 = 0;
+    sts.b.chnum = ch;
+    sts.b.bcnt = len;
+    sts.b.dpid = pid ? HC_PID_DATA1 : HC_PID_DATA0;
+    sts.b.pktsts = pktsts;
+    e->sts = sts.d32;
+    if (len)
+        memcpy(e->data, data, len);
+}
+
+static uint32_t rxq_pop(bool_t pop)
+{
+    USB_OTG_GRXFSTS_TypeDef sts;
+    struct rx_entry *e;
+    if (rxq_prod == rxq_cons)
+        return 0;
+    e = &rxq[rxq_cons % NR_RXQ];
+    sts.d32 = e->sts;
+    if (pop) {
+        rxq_cons++;
+        rx_data = e->data;
+        rx_len = sts.b.bcnt;
+        /* The core raises the channel's interrupt as it pops the entry. */
+        if (sts.b.pktsts == GRXSTS_PKTSTS_IN_XFER_COMP)
+            hc_reg(sts.b.chnum, HC_HCINT) |= 1u << 0; /* xfercompl */
+    }
+    return sts.d32;
+}
+
+static void rx_flush(void)
+{
+    rxq_cons = rxq_prod;
+    rx_len = 0;
+}
+
+static void chan_halt(unsigned int n)
+{
+    struct chan *c = &chan[n];
+    if (c->state == CH_IDLE)
+        return;
+    c->state = CH_IDLE;
+    c->tx_len = 0;
+    hc_reg(n, HC_HCINT) |= 1u << 1; /* chhltd */
+}
+
+static void chan_start(unsigned int n, uint64_t t)
+{
+    struct chan *c = &chan[n];
+    c->state = CH_START;
+    c->retry = FALSE;
+    c->due = t;
+}
+
+/* Issue the channel's next token and exchange data with the device. The
+ * host sees the outcome when the transaction completes (chan_complete). */
+static void chan_token(unsigned int n)
+{
+    struct chan *c = &chan[n];
+    USB_OTG_HCCHAR_TypeDef hcchar;
+    USB_OTG_HCTSIZn_TypeDef hctsiz;
+    uint64_t t = otg_sim_ns;
+    unsigned int mps;
+
+    /* Transactions are serialised on the bus. */
+    if (c->due < bus_free) {
+        c->due = bus_free;
+        return;
+    }
+
+    hcchar.d32 = hc_reg(n, HC_HCCHAR);
+    hctsiz.d32 = hc_reg(n, HC_HCTSIZ);
+    mps = hcchar.b.mps;
+    c->pid = c->exp_pid = (hctsiz.b.pid == HC_PID_DATA1);
+
+    if (!dev) {
+        c->hs = OTG_NONE;
+        c->len = 0;
+    } else if (hcchar.b.epdir) {
+        c->hs = dev->in(hcchar.b.devaddr, hcchar.b.epnum, c->buf,
+                        min_t(unsigned int, mps, sizeof(c->buf)),
+                        &c->len, &c->pid);
+        if (c->hs != OTG_ACK)
+            c->len = 0;
+    } else {
+        c->len = min_t(unsigned int, mps, hctsiz.b.xfersize);
+        if (c->len > c->tx_len)
+            fatal("OUT packet not in the TX FIFO");
+        /* The device handshakes an OUT packet once it has received it. */
+        otg_sim_ns = t + XACT_NS + c->len * BYTE_NS;
+        c->hs = (hctsiz.b.pid == HC_PID_SETUP)
+            ? dev->setup(hcchar.b.devaddr, c->tx)
+            : dev->out(hcchar.b.devaddr, hcchar.b.epnum, c->pid,
+                       c->tx, c->len);
+    }
+
+    otg_sim_stats.xacts++;
+    if (c->hs == OTG_NAK)
+        otg_sim_stats.naks++;
+    c->due = t + XACT_NS + c->len * BYTE_NS;
+    if (c->hs == OTG_ACK)
+        otg_sim_stats.bus_ns += c->due - t;
+    bus_free = c->due;
+    c->state = CH_XFER;
+}
+
+static void chan_complete(unsigned int n)
+{
+    struct chan *c = &chan[n];
+    USB_OTG_HCCHAR_TypeDef hcchar;
+    USB_OTG_HCTSIZn_TypeDef hctsiz;
+    uint32_t *hcint = &hc_reg(n, HC_HCINT);
+    bool_t done;
+
+    hcchar.d32 = hc_reg(n, HC_HCCHAR);
+    hctsiz.d32 = hc_reg(n, HC_HCTSIZ);
+    c->state = CH_WAIT;
+
+    switch (c->hs) {
+    case OTG_ACK:
+        hctsiz.b.xfersize -= min_t(unsigned int, c->len, hctsiz.b.xfersize);
+        hctsiz.b.pktcnt--;
+        hctsiz.b.pid = (hctsiz.b.pid == HC_PID_DATA1)
+            ? HC_PID_DATA0 : HC_PID_DATA1;
+        hc_reg(n, HC_HCTSIZ) = hctsiz.d32;
+        done = (hctsiz.b.pktcnt == 0);
+        if (hcchar.b.epdir) {
+            if ((hcchar.b.eptype == EP_TYPE_BULK) && (c->pid != c->exp_pid))
+                otg_sim_stats.toggle_err++;
+            rxq_push(n, GRXSTS_PKTSTS_IN, c->buf, c->len, c->pid);
+            if (c->len < hcchar.b.mps)
+                done = TRUE;
+            if (done)
+                rxq_push(n, GRXSTS_PKTSTS_IN_XFER_COMP, NULL, 0, 0);
+        } else {
+            c->tx_len -= c->len;
+            memmove(c->tx, c->tx + c->len, c->tx_len);
+            if (done)
+                *hcint |= (1u << 0) | (1u << 5); /* xfercompl | ack */
+        }
+        if (!done)
+            chan_start(n, otg_sim_ns);
+        break;
+    case OTG_NAK:
+        *hcint |= 1u << 4;
+        c->retry = hcchar.b.epdir;
+        break;
+    case OTG_STALL:
+        *hcint |= 1u << 3;
+        break;
+    default:
+        *hcint |= 1u << 7; /* xacterr */
+        break;
+    }
+}
+
+static void hcchar_write(unsigned int n, uint32_t val)
+{
+    struct chan *c = &chan[n];
+    USB_OTG_HCCHAR_TypeDef hcchar;
+
+    hcchar.d32 = val;
+    if (hcchar.b.chdis) {
+        if (hcchar.b.chen)
+            chan_halt(n);
+        hcchar.b.chen = hcchar.b.chdis = 0;
+        hc_reg(n, HC_HCCHAR) = hcchar.d32;
+        return;
+    }
+
+    hc_reg(n, HC_HCCHAR) = val;
+    if (!hcchar.b.chen)
+        return;
+
+    /* Enabling an enabled channel is a no-op, except to retry a NAKed IN. */
+    if ((c->state == CH_IDLE) || ((c->state == CH_WAIT) && c->retry))
+        chan_start(n, otg_sim_ns);
+}
+
+static void soft_reset(void)
+{
+    unsigned int n;
+    reg(R_GINTSTS) = reg(R_GINTMSK) = 0;
+    for (n = 0; n < NR_CH; n++) {
+        chan[n].state = CH_IDLE;
+        chan[n].tx_len = 0;
+        hc_reg(n, HC_HCINT) = 0;
+    }
+    rx_flush();
+}
+
+static void port_connect(void)
+{
+    USB_OTG_HPRT0_TypeDef hprt;
+    hprt.d32 = reg(R_HPRT);
+    if (!dev || !hprt.b.prtpwr || hprt.b.prtconnsts)
+        return;
+    hprt.b.prtconnsts = hprt.b.prtconndet = 1;
+    reg(R_HPRT) = hprt.d32;
+}
+
+static void hprt_write(uint32_t val)
+{
+    USB_OTG_HPRT0_TypeDef old, hprt;
+
+    old.d32 = reg(R_HPRT);
+    hprt.d32 = (old.d32 & (HPRT_RO | HPRT_W1C | (1u << 2)))
+        | (val & ~(HPRT_RO | HPRT_W1C | (1u << 2)));
+    hprt.d32 &= ~(val & HPRT_W1C);
+
+    /* Writing 1 to the enable bit disables the port. */
+    if ((val & (1u << 2)) && old.b.prtena) {
+        hprt.b.prtena = 0;
+        hprt.b.prtenchng = 1;
+    }
+
+    /* The port is enabled, at full speed, as reset is released. */
+    if (old.b.prtrst && !hprt.b.prtrst && hprt.b.prtconnsts) {
+        if (dev)
+            dev->reset();
+        hprt.b.prtena = 1;
+        hprt.b.prtenchng = 1;
+        hprt.b.prtspd = HPRT0_PRTSPD_FULL_SPEED;
+    }
+
+    reg(R_HPRT) = hprt.d32;
+    port_connect();
+}
+
+static unsigned int reg_offset(volatile void *reg)
+{
+    uintptr_t off = (uintptr_t)reg - USB_OTG_FS_BASE_ADDR;
+    if ((off >= R_END) || (off & 3))
+        fatal("bad register address");
+    return off;
+}
+
+uint32_t otg_sim_read(volatile void *reg)
+{
+    unsigned int off = reg_offset(reg);
+    uint32_t x;
+
+    if (off >= R_FIFO) {
+        /* Any address in a channel's window pops the RX FIFO. */
+        x = 0;
+        if (rx_len != 0) {
+            unsigned int i, nr = min_t(unsigned int, rx_len, 4);
+            for (i = 0; i < nr; i++)
+                x |= (uint32_t)rx_data[i] << (i * 8);
+            rx_data += nr;
+            rx_len -= nr;
+        }
+        return x;
+    }
+
+    switch (off) {
+    case R_GRSTCTL:
+        return 1u << 31; /* AHB idle; resets and flushes are immediate */
+    case R_GINTSTS:
+        return gintsts();
+    case R_GRXSTSR:
+        return rxq_pop(FALSE);
+    case R_GRXSTSP:
+        return rxq_pop(TRUE);
+    case R_HNPTXSTS: {
+        USB_OTG_HNPTXSTS_TypeDef sts;
+        sts.d32 = 0;
+        sts.b.nptxfspcavail = NPTXF_WORDS - tx_words();
+        sts.b.nptxqspcavail = 8;
+        return sts.d32;
+    }
+    case R_HPTXSTS: {
+        USB_OTG_HPTXSTS_TypeDef sts;
+        sts.d32 = 0;
+        sts.b.ptxfspcavail = TXH_P_FS_FIFOSIZ;
+        sts.b.ptxqspcavail = 8;
+        return sts.d32;
+    }
+    case R_HFNUM:
+        return (otg_sim_ns / 1000000) & 0x3fff;
+    case R_HAINT:
+        return haint();
+    }
+
+    return reg(off);
+}
+
+void otg_sim_write(volatile void *reg, uint32_t val)
+{
+    unsigned int off = reg_offset(reg);
+
+    if (off >= R_FIFO) {
+        struct chan *c = &chan[(off - R_FIFO) / 0x1000];
+        if ((tx_words() == NPTXF_WORDS) || (c->tx_len == sizeof(c->tx)))
+            fatal("TX FIFO overflow");
+        memcpy(&c->tx[c->tx_len], &val, 4);
+        c->tx_len += 4;
+        return;
+    }
+
+    switch (off) {
+    case R_GRSTCTL: {
+        USB_OTG_GRSTCTL_TypeDef rst;
+        unsigned int n;
+        rst.d32 = val;
+        if (rst.b.csftrst)
+            soft_reset();
+        if (rst.b.rxfflsh)
+            rx_flush();
+        if (rst.b.txfflsh)
+            for (n = 0; n < NR_CH; n++)
+                chan[n].tx_len = 0;
+        break;
+    }
+    case R_GINTSTS:
+        reg(R_GINTSTS) &= ~val;
+        break;
+    case R_GRXSTSR: case R_GRXSTSP: case R_HNPTXSTS:
+    case R_HFNUM: case R_HPTXSTS: case R_HAINT:
+        break;
+    case R_HPRT:
+        hprt_write(val);
+        break;
+    default:
+        if ((off >= R_HC) && (off < R_HC + NR_CH*0x20)) {
+            unsigned int n = (off - R_HC) / 0x20;
+            switch (off & 0x1f) {
+            case HC_HCCHAR:
+                hcchar_write(n, val);
+                break;
+            case HC_HCINT:
+                reg(off) &= ~val;
+                break;
+            default:
+                reg(off) = val;
+                break;
+            }
+        } else {
+            reg(off) = val;
+        }
+        break;
+    }
+
+    otg_irq();
+}
+
+/* The channel with the earliest pending event, if any. */
+static int next_event(void)
+{
+    int n, best = -1;
+    for (n = 0; n < NR_CH; n++) {
+        if ((chan[n].state != CH_START) && (chan[n].state != CH_XFER))
+            continue;
+        if ((best < 0) || (chan[n].due < chan[best].due))
+            best = n;
+    }
+    return best;
+}
+
+void otg_sim_advance(uint64_t ns)
+{
+    uint64_t end = otg_sim_ns + ns;
+    int n;
+
+    while (((n = next_event()) >= 0) && (chan[n].due <= end)) {
+        if (chan[n].due > otg_sim_ns)
+            otg_sim_ns = chan[n].due;
+        if (chan[n].state == CH_START)
+            chan_token(n);
+        else
+            chan_complete(n);
+        otg_irq();
+    }
+
+    if (otg_sim_ns < end)
+        otg_sim_ns = end;
+}
+
+void otg_sim_poll(void)
+{
+    otg_sim_advance(otg_sim_cfg.poll_ns);
+}
+
+void otg_sim_attach(const struct otg_sim_dev *_dev)
+{
+    dev = _dev;
+    port_connect();
+    otg_irq();
+}
+
+void otg_sim_detach(void)
+{
+    USB_OTG_HPRT0_TypeDef hprt;
+    unsigned int n;
+
+    dev = NULL;
+    hprt.d32 = reg(R_HPRT);
+    if (hprt.b.prtconnsts) {
+        if (hprt.b.prtena)
+            hprt.b.prtenchng = 1;
+        hprt.b.prtconnsts = hprt.b.prtena = 0;
+        reg(R_HPRT) = hprt.d32;
+        reg(R_GINTSTS) |= 1u << 29; /* disconnect */
+    }
+    for (n = 0; n < NR_CH; n++)
+        if (chan[n].state != CH_IDLE)
+            chan[n].state = CH_WAIT;
+    otg_irq();
+}
+
+/*
+ * Board callbacks (src/usb/usb_bsp.c).
+ */
+
+void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev)
+{
+}
+
+void USB_OTG_BSP_EnableInterrupt(USB_OTG_CORE_HANDLE *pdev)
+{
+    irq_enabled = TRUE;
+    otg_irq();
+}
+
+void USB_OTG_BSP_DriveVBUS(USB_OTG_CORE_HANDLE *pdev, uint8_t state)
+{
+}
+
+void USB_OTG_BSP_ConfigVBUS(USB_OTG_CORE_HANDLE *pdev)
+{
+}
+
+void USB_OTG_BSP_uDelay(const uint32_t usec)
+{
+    otg_sim_advance(usec * 1000ull);
+}
+
+void USB_OTG_BSP_mDelay(const uint32_t msec)
+{
+    otg_sim_advance(msec * 1000000ull);
+}
+
+void USB_OTG_BSP_InitTimer(struct USB_OTG_BSP_Timer *t, uint32_t timeout_ms)
+{
+    t->prev_stk = otg_sim_ns / 1000;
+    t->ticks = timeout_ms * 1000;
+}
+
+bool_t USB_OTG_BSP_TimerFired(struct USB_OTG_BSP_Timer *t)
+{
+    uint32_t now = otg_sim_ns / 1000;
+    uint32_t diff = now - t->prev_stk;
+    if (t->ticks <= diff) {
+        t->ticks = 0;
+        return TRUE;
+    }
+    t->ticks -= diff;
+    t->prev_stk = now;
+    return FALSE;
+}
+
+time_t time_now(void)
+{
+    return (time_t)(otg_sim_ns * TIME_MHZ / 1000);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
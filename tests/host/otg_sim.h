@@ -0,0 +1,87 @@
+/*
+ * otg_sim.h
+ *
+ * Host model of the STM32 OTG_FS core, in host mode and without DMA. The
+ * firmware's USB stack is built unmodified, except that its register
+ * accesses are redirected here: force-included ahead of usb_defines.h.
+ *
+ * The model keeps a simulated clock. The firmware's delays advance it, as
+ * does each pass of the test's main loop (otg_sim_poll()) and each spin of
+ * a firmware wait loop (cpu_relax()). Channel transactions are scheduled on
+ * the clock and performed against a device model (struct otg_sim_dev), and
+ * the core interrupt is delivered whenever it is pending and enabled: the
+ * handler runs to completion within the register write, or the clock
+ * advance, which raised it.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef OTG_SIM_H
+#define OTG_SIM_H
+
+uint32_t otg_sim_read(volatile void *reg);
+void otg_sim_write(volatile void *reg, uint32_t val);
+
+#define USB_OTG_READ_REG32(reg) otg_sim_read(reg)
+#define USB_OTG_WRITE_REG32(reg,value) otg_sim_write((reg), (value))
+
+/* Handshakes, as returned by the device for each transaction. */
+#define OTG_ACK   0
+#define OTG_NAK   1
+#define OTG_STALL 2
+#define OTG_NONE  3 /* no response: transaction error */
+
+/* The device on the root port. Bulk data PIDs are DATA0 (0) and DATA1 (1).
+ * Control transfers are not toggle-checked. */
+struct otg_sim_dev {
+    void (*reset)(void);
+    int (*setup)(uint8_t addr, const uint8_t *pkt);
+    int (*out)(uint8_t addr, uint8_t ep, uint8_t pid,
+               const uint8_t *buf, unsigned int len);
+    /* Returns the packet's length and PID via *len and *pid. */
+    int (*in)(uint8_t addr, uint8_t ep, uint8_t *buf, unsigned int mps,
+              unsigned int *len, uint8_t *pid);
+};
+
+/* Costs of host activity which the model cannot observe directly, in ns. */
+struct otg_sim_cfg {
+    uint32_t poll_ns; /* one pass of the main loop */
+    uint32_t isr_ns;  /* one invocation of the interrupt handler */
+};
+
+struct otg_sim_stats {
+    uint32_t isrs;     /* interrupt handler invocations */
+    uint32_t xacts;    /* transactions on the bus, of any outcome */
+    uint32_t naks;     /* ...of which NAKed */
+    uint64_t bus_ns;   /* bus time of transactions which moved data */
+    uint32_t toggle_err; /* bulk IN packets with an unexpected DATAx */
+};
+
+extern uint64_t otg_sim_ns; /* simulated time */
+extern struct otg_sim_cfg otg_sim_cfg;
+extern struct otg_sim_stats otg_sim_stats;
+
+void otg_sim_attach(const struct otg_sim_dev *dev);
+void otg_sim_detach(void);
+void otg_sim_advance(uint64_t ns);
+void otg_sim_poll(void);
+
+/* The firmware's synchronous waits spin on cpu_relax(): each spin is a pass
+ * of the main loop. */
+#undef cpu_relax
+#define cpu_relax() otg_sim_poll()
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
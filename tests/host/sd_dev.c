@@ -0,0 +1,444 @@
+/*
+ * sd_dev.c
+ *
+ * SD memory card in SPI mode: commands and R1/R3/R7 responses, single and
+ * multiple block reads and writes, and the busy signal. Each byte clocked by
+ * the host is processed as it arrives; the card drives MISO, in order of
+ * priority, with a pending response, busy (0x00), read data, or idle (0xff).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "sd_dev.h"
+
+#define R1_ParamErr    (1u<<6)
+#define R1_AddressErr  (1u<<5)
+#define R1_CRCErr      (1u<<3)
+#define R1_IllegalCmd  (1u<<2)
+#define R1_IdleState   (1u<<0)
+
+struct sd_dev_cfg sd_dev_cfg = {
+    .access_us = 500,
+    .gap_us = 20,
+    .prog_us = 800,
+    .stop_us = 50,
+    .init_polls = 5
+};
+struct sd_dev_stats sd_dev_stats;
+
+static const uint8_t cid[15] = {
+    0x03, 'S', 'D', 'S', 'I', 'M', '0', '1', 0x10, 0x12, 0x34, 0x56, 0x78,
+    0x01, 0x64
+};
+
+static unsigned int faults[4];
+
+static struct {
+    uint8_t *img;
+    uint32_t nr_blocks;
+    bool_t sel, idle, app, crc_on;
+    uint16_t polls;
+
+    /* Command being received. */
+    uint8_t cmd[6];
+    unsigned int cmd_len;
+
+    /* Response bytes, driven ahead of all else. */
+    uint8_t resp[8];
+    unsigned int resp_len, resp_pos;
+
+    uint64_t busy_until;
+
+    /* Data transfer: a block with its CRC16, from or to buf[]. */
+    enum { D_NONE, D_READ, D_WRITE } data;
+    enum { RD_WAIT, RD_DATA } rd;
+    enum { WR_TOKEN, WR_DATA } wr;
+    bool_t multi;
+    uint32_t blk;
+    uint64_t ready;  /* next read block available */
+    uint8_t buf[514];
+    unsigned int len, pos;
+} c;
+
+#define now spi_sim_bus_ns
+
+/* CRC7 (x^7 + x^3 + 1) and CRC16-CCITT, computed bitwise. */
+static uint8_t crc7(const uint8_t *p, unsigned int n)
+{
+    uint8_t crc = 0, b;
+    unsigned int i;
+    while (n--) {
+        for (b = *p++, i = 0; i < 8; i++, b <<= 1) {
+            bool_t fb = ((b >> 7) ^ (crc >> 6)) & 1;
+            crc = (crc << 1) & 0x7f;
+            if (fb)
+                crc ^= 0x09;
+        }
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *p, unsigned int n)
+{
+    uint16_t crc = 0;
+    unsigned int i;
+    while (n--) {
+        crc ^= *p++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+void sd_dev_init(uint8_t *img, uint32_t nr_blocks)
+{
+    memset(&c, 0, sizeof(c));
+    c.img = img;
+    c.nr_blocks = nr_blocks;
+    c.idle = TRUE;
+}
+
+void sd_dev_fault(unsigned int fault, unsigned int nth)
+{
+    faults[fault] = nth;
+}
+
+static bool_t fault(unsigned int fault)
+{
+    return faults[fault] && !--faults[fault];
+}
+
+bool_t sd_dev_busy(void)
+{
+    return spi_sim_ns < c.busy_until;
+}
+
+static void protocol_err(void)
+{
+    sd_dev_stats.protocol_errs++;
+}
+
+static void resp(const uint8_t *p, unsigned int n)
+{
+    memcpy(c.resp, p, n);
+    c.resp_len = n;
+    c.resp_pos = 0;
+}
+
+/* R1, and any further response bytes, after one byte of Ncr. */
+static void resp_r1(uint8_t r1, const uint8_t *p, unsigned int n)
+{
+    uint8_t r[8] = { 0xff, r1 };
+    if (n)
+        memcpy(&r[2], p, n);
+    resp(r, n + 2);
+}
+
+static void put_crc16(uint8_t *p, unsigned int n, bool_t bad)
+{
+    uint16_t crc = crc16(p, n) ^ (bad ? 1 : 0);
+    p[n] = crc >> 8;
+    p[n+1] = crc;
+}
+
+static bool_t rd_block(void)
+{
+    if (c.blk >= c.nr_blocks)
+        return FALSE;
+    memcpy(c.buf, c.img + c.blk * 512, 512);
+    c.len = 512;
+    put_crc16(c.buf, 512, fault(SD_FAULT_READ_CRC));
+    c.rd = RD_WAIT;
+    return TRUE;
+}
+
+static uint8_t rd_out(void)
+{
+    uint8_t out;
+
+    if (c.rd == RD_WAIT) {
+        if (now < c.ready)
+            return 0xff;
+        c.rd = RD_DATA;
+        c.pos = 0;
+        return 0xfe; /* start block */
+    }
+
+    out = c.buf[c.pos++];
+    if (c.pos == c.len + 2) {
+        if (c.len == 512)
+            sd_dev_stats.blocks_read++;
+        c.data = D_NONE;
+        if (c.multi) {
+            c.blk++;
+            if (rd_block()) {
+                c.data = D_READ;
+                c.ready = now + sd_dev_cfg.gap_us * 1000ull;
+            }
+        }
+    }
+
+    return out;
+}
+
+static void wr_block(void)
+{
+    bool_t ok = !c.crc_on || (crc16(c.buf, 514) == 0);
+    uint8_t r;
+
+    if (fault(SD_FAULT_WRITE_CRC))
+        ok = FALSE;
+
+    if (!ok) {
+        sd_dev_stats.crc_errs++;
+        r = 0x0b; /* rejected: CRC error */
+    } else if (c.blk >= c.nr_blocks) {
+        protocol_err();
+        r = 0x0d; /* rejected: write error */
+    } else {
+        memcpy(c.img + c.blk * 512, c.buf, 512);
+        sd_dev_stats.blocks_written++;
+        c.blk++;
+        c.busy_until = now + sd_dev_cfg.prog_us * 1000ull;
+        r = 0x05; /* accepted */
+    }
+    resp(&r, 1);
+
+    /* A multi-block write awaits its next token, or Stop Tran. */
+    c.wr = WR_TOKEN;
+    if (!c.multi)
+        c.data = D_NONE;
+}
+
+static void wr_in(uint8_t in)
+{
+    uint8_t r;
+
+    if (c.wr == WR_DATA) {
+        c.buf[c.pos++] = in;
+        if (c.pos == 514)
+            wr_block();
+        return;
+    }
+
+    if (in == 0xff)
+        return;
+    if (now < c.busy_until)
+        protocol_err();
+    if (in == (c.multi ? 0xfc : 0xfe)) {
+        c.wr = WR_DATA;
+        c.pos = 0;
+    } else if (c.multi && (in == 0xfd)) {
+        /* Stop Tran: busy follows after one byte. */
+        sd_dev_stats.stop_tran++;
+        c.data = D_NONE;
+        r = 0xff;
+        resp(&r, 1);
+        c.busy_until = max(c.busy_until, now) + sd_dev_cfg.stop_us * 1000ull;
+    } else {
+        protocol_err();
+    }
+}
+
+static bool_t block_addr(uint32_t arg, uint8_t *r1)
+{
+    if (sd_dev_cfg.sdsc) {
+        if (arg & 511) {
+            *r1 |= R1_AddressErr;
+            return FALSE;
+        }
+        arg >>= 9;
+    }
+    if (arg >= c.nr_blocks) {
+        *r1 |= R1_ParamErr;
+        return FALSE;
+    }
+    c.blk = arg;
+    return TRUE;
+}
+
+static void cmd_exec(void)
+{
+    uint8_t idx = c.cmd[0] & 0x3f, r1, r[4];
+    uint32_t arg = ((uint32_t)c.cmd[1] << 24) | (c.cmd[2] << 16)
+        | (c.cmd[3] << 8) | c.cmd[4];
+    bool_t app = c.app;
+
+    c.app = FALSE;
+    if (app)
+        sd_dev_stats.acmd[idx]++;
+    else
+        sd_dev_stats.cmd[idx]++;
+
+    /* CMD0 and CMD8 are CRC checked even before CMD59. */
+    if (((c.crc_on || (idx == 0) || (idx == 8))
+         && (((crc7(c.cmd, 5) << 1) | 1) != c.cmd[5]))
+        || fault(SD_FAULT_CMD_CRC)) {
+        sd_dev_stats.crc_errs++;
+        resp_r1(R1_CRCErr | (c.idle ? R1_IdleState : 0), NULL, 0);
+        return;
+    }
+
+    /* Only STOP_TRANSMISSION may interrupt a read. */
+    if ((c.data == D_READ) && (idx != 12)) {
+        protocol_err();
+        resp_r1(R1_IllegalCmd, NULL, 0);
+        return;
+    }
+
+    r1 = c.idle ? R1_IdleState : 0;
+
+    if (c.idle && !app && (idx != 0) && (idx != 8) && (idx != 55)
+        && (idx != 58) && (idx != 59)) {
+        resp_r1(r1 | R1_IllegalCmd, NULL, 0);
+        return;
+    }
+
+    switch (app ? 0x40 | idx : idx) {
+    case 0: /* GO_IDLE_STATE */
+        sd_dev_init(c.img, c.nr_blocks);
+        c.sel = TRUE;
+        r1 = R1_IdleState;
+        break;
+    case 8: /* SEND_IF_COND */
+        r[0] = r[1] = 0;
+        r[2] = (arg >> 8) & 0xf;
+        r[3] = arg;
+        resp_r1(r1, r, 4);
+        return;
+    case 10: /* SEND_CID */
+        memcpy(c.buf, cid, 15);
+        c.buf[15] = (crc7(cid, 15) << 1) | 1;
+        c.len = 16;
+        put_crc16(c.buf, 16, FALSE);
+        c.data = D_READ;
+        c.rd = RD_WAIT;
+        c.multi = FALSE;
+        c.ready = now;
+        break;
+    case 12: /* STOP_TRANSMISSION */
+        if (c.data != D_READ) {
+            r1 |= R1_IllegalCmd;
+            break;
+        }
+        /* A stuff byte, then R1. The card is briefly busy. */
+        r[0] = rd_out();
+        r[1] = r1;
+        resp(r, 2);
+        c.data = D_NONE;
+        c.busy_until = now + sd_dev_cfg.stop_us * 1000ull;
+        return;
+    case 16: /* SET_BLOCKLEN */
+        if (arg != 512)
+            r1 |= R1_ParamErr;
+        break;
+    case 17: /* READ_SINGLE_BLOCK */
+    case 18: /* READ_MULTIPLE_BLOCK */
+        if (!block_addr(arg, &r1))
+            break;
+        c.multi = (idx == 18);
+        c.data = D_READ;
+        rd_block();
+        c.ready = now + sd_dev_cfg.access_us * 1000ull;
+        break;
+    case 24: /* WRITE_BLOCK */
+    case 25: /* WRITE_MULTIPLE_BLOCK */
+        if (!block_addr(arg, &r1))
+            break;
+        c.multi = (idx == 25);
+        c.data = D_WRITE;
+        c.wr = WR_TOKEN;
+        break;
+    case 55: /* APP_CMD */
+        c.app = TRUE;
+        break;
+    case 58: /* READ_OCR */
+        r[0] = (c.idle ? 0 : 0x80) | (sd_dev_cfg.sdsc ? 0 : 0x40);
+        r[1] = 0xff;
+        r[2] = 0x80;
+        r[3] = 0x00;
+        resp_r1(r1, r, 4);
+        return;
+    case 59: /* CRC_ON_OFF */
+        c.crc_on = arg & 1;
+        break;
+    case 0x40|23: /* SET_WR_BLK_ERASE_COUNT */
+        sd_dev_stats.pre_erase = arg & 0x7fffff;
+        break;
+    case 0x40|41: /* SD_SEND_OP_COND */
+        if (++c.polls >= sd_dev_cfg.init_polls)
+            c.idle = FALSE;
+        r1 = c.idle ? R1_IdleState : 0;
+        break;
+    default:
+        r1 |= R1_IllegalCmd;
+        break;
+    }
+
+    resp_r1(r1, NULL, 0);
+}
+
+static void cmd_in(uint8_t in)
+{
+    if (c.cmd_len == 0) {
+        if ((in & 0xc0) != 0x40)
+            return;
+        /* Commands must wait for the card to be ready. */
+        if (now < c.busy_until)
+            protocol_err();
+    }
+    c.cmd[c.cmd_len++] = in;
+    if (c.cmd_len == 6) {
+        c.cmd_len = 0;
+        cmd_exec();
+    }
+}
+
+static void dev_select(bool_t sel)
+{
+    c.sel = sel;
+    c.cmd_len = 0;
+    c.resp_len = 0;
+}
+
+static uint8_t dev_xchg(uint8_t in)
+{
+    uint8_t out;
+
+    if (!c.sel)
+        return 0xff;
+
+    if (c.resp_pos < c.resp_len)
+        out = c.resp[c.resp_pos++];
+    else if (now < c.busy_until)
+        out = 0x00;
+    else if (c.data == D_READ)
+        out = rd_out();
+    else
+        out = 0xff;
+
+    if (c.data == D_WRITE)
+        wr_in(in);
+    else
+        cmd_in(in);
+
+    return out;
+}
+
+const struct spi_sim_dev sd_dev = {
+    .select = dev_select,
+    .xchg = dev_xchg
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
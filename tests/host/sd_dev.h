@@ -0,0 +1,60 @@
+/*
+ * sd_dev.h
+ *
+ * SD memory card in SPI mode, backed by an in-memory image of 512-byte
+ * blocks. Plugs into the SPI2 model. Commands and data blocks are CRC
+ * checked once the host enables CRCs (CMD59).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef SD_DEV_H
+#define SD_DEV_H
+
+struct sd_dev_cfg {
+    uint32_t access_us; /* READ_*_BLOCK to the first data token */
+    uint32_t gap_us;    /* between the blocks of READ_MULTIPLE_BLOCK */
+    uint32_t prog_us;   /* busy programming each written block */
+    uint32_t stop_us;   /* busy after STOP_TRANSMISSION, or Stop Tran */
+    uint16_t init_polls; /* ACMD41s before the card leaves the idle state */
+    bool_t sdsc;        /* byte-addressed (SDSC), rather than SDHC */
+};
+
+struct sd_dev_stats {
+    uint32_t cmd[64];      /* commands received, by index (ACMDs apart) */
+    uint32_t acmd[64];
+    uint32_t blocks_read, blocks_written;
+    uint32_t pre_erase;    /* block count of the last ACMD23 */
+    uint32_t stop_tran;    /* Stop Tran tokens ending multi-block writes */
+    uint32_t crc_errs;     /* commands and written blocks failing CRC */
+    uint32_t protocol_errs; /* bus activity the card did not expect */
+};
+
+/* Faults which may be scripted, against the nth occurrence from now. */
+#define SD_FAULT_CMD_CRC   1 /* a command is received with a bad CRC7 */
+#define SD_FAULT_READ_CRC  2 /* a block is sent with a bad CRC16 */
+#define SD_FAULT_WRITE_CRC 3 /* a written block is received corrupted */
+
+extern const struct spi_sim_dev sd_dev;
+extern struct sd_dev_cfg sd_dev_cfg;
+extern struct sd_dev_stats sd_dev_stats;
+
+void sd_dev_init(uint8_t *img, uint32_t nr_blocks);
+void sd_dev_fault(unsigned int fault, unsigned int nth);
+/* Is the card busy programming? */
+bool_t sd_dev_busy(void);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,342 @@
+/*
+ * spi_dma.c
+ *
+ * Host model of SPI2 (master, full duplex) and DMA1 channels 4 and 5, with
+ * the GPIOs and SysTick which sd_spi.c relies on. See spi_sim.h.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+
+/* Not <stdlib.h>: its time_t would clash with the firmware's. */
+void exit(int status) __attribute__((noreturn));
+
+#define PCLK1_MHZ 36
+#define PIN_CS    12 /* PB12 */
+#define PIN_CD    9  /* PC9 */
+
+#define DMA_RX_CH 4
+#define DMA_TX_CH 5
+
+volatile struct spi spi_sim_spi2;
+volatile struct dma spi_sim_dma1;
+/* Chip select is pulled up at reset. */
+volatile struct gpio spi_sim_gpiob = { .odr = 1u << PIN_CS };
+volatile struct gpio spi_sim_gpioc;
+spi_sim_rcc_t spi_sim_rcc;
+
+uint64_t spi_sim_ns, spi_sim_bus_ns;
+struct spi_sim_cfg spi_sim_cfg = {
+    .pio_ns = 150,
+    .relax_ns = 50,
+    .crc_ns = 110
+};
+struct spi_sim_stats spi_sim_stats;
+
+static const struct spi_sim_dev *dev;
+static bool_t selected;
+
+/* SPI: the last byte clocks out at bus_free. A received frame waits in the
+ * data register until read: later frames are lost (overrun). */
+static uint64_t bus_free;
+static uint16_t rx_dr;
+static bool_t rx_full;
+
+/* DMA transfer in progress, or complete until SPI DMA is disabled. */
+static struct {
+    enum { DMA_IDLE, DMA_RUN, DMA_DONE } state;
+    uint64_t done;
+    uint32_t flags;
+    unsigned int fault; /* fail the fault'th transfer from now */
+} dma;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "spi_sim: %s\n", msg);
+    exit(1);
+}
+
+static uint32_t byte_ns(void)
+{
+    uint32_t cr1 = spi_sim_spi2.cr1;
+    unsigned int div = 2u << ((cr1 & SPI_CR1_BR_MASK) >> 3);
+    if (!(cr1 & SPI_CR1_SPE))
+        fatal("SPI is disabled");
+    return (8 * 1000 * div) / PCLK1_MHZ;
+}
+
+/* Apply writes to GPIOB's set/reset register: chip select. */
+static void gpio_sync(void)
+{
+    uint32_t bsrr = spi_sim_gpiob.bsrr;
+    bool_t sel;
+
+    if (!bsrr)
+        return;
+    spi_sim_gpiob.odr = (spi_sim_gpiob.odr | (bsrr & 0xffff)) & ~(bsrr >> 16);
+    spi_sim_gpiob.bsrr = 0;
+
+    sel = !((spi_sim_gpiob.odr >> PIN_CS) & 1);
+    if (sel != selected) {
+        if (bus_free > spi_sim_ns)
+            fatal("chip select changed during a transfer");
+        selected = sel;
+        if (dev)
+            dev->select(sel);
+    }
+}
+
+/* Clock one byte through the device, completing at time @t. */
+static uint8_t xchg(uint8_t out, uint64_t t)
+{
+    spi_sim_bus_ns = t;
+    spi_sim_stats.bytes++;
+    return dev ? dev->xchg(out) : 0xff;
+}
+
+/* Start a frame when the transmit buffer is free. */
+static uint16_t frame(uint16_t out)
+{
+    uint32_t ns = byte_ns();
+    unsigned int i, nr = (spi_sim_spi2.cr1 & SPI_CR1_DFF) ? 2 : 1;
+    uint64_t t;
+    uint16_t in = 0;
+
+    if (bus_free > spi_sim_ns + nr * ns)
+        spi_sim_ns = bus_free - nr * ns;
+    t = max(bus_free, spi_sim_ns);
+    for (i = 0; i < nr; i++)
+        in = (in << 8) | xchg(out >> ((nr - 1 - i) * 8), t += ns);
+    bus_free = t;
+
+    if (!rx_full) {
+        rx_dr = in;
+        rx_full = TRUE;
+    }
+
+    return in;
+}
+
+static void dma_start(uint32_t cr2)
+{
+    volatile struct dma_chn *rx = &spi_sim_dma1.ch4, *tx = &spi_sim_dma1.ch5;
+    uint32_t dr = (uint32_t)(unsigned long)&spi_sim_spi2.dr;
+    const uint8_t *src;
+    uint8_t *dst = NULL, in;
+    unsigned int i, n;
+    uint32_t ns = byte_ns();
+    uint64_t t;
+
+    if (!(cr2 & SPI_CR2_TXDMAEN))
+        fatal("DMA receive without DMA transmit");
+    if (!(tx->ccr & DMA_CCR_EN) || !(tx->ccr & DMA_CCR_DIR_M2P)
+        || (tx->cpar != dr) || !tx->cndtr)
+        fatal("bad DMA transmit channel");
+    if (spi_sim_spi2.cr1 & SPI_CR1_DFF)
+        fatal("DMA with 16-bit SPI frames");
+    n = tx->cndtr;
+    src = (const uint8_t *)(unsigned long)tx->cmar;
+
+    if (cr2 & SPI_CR2_RXDMAEN) {
+        if (!(rx->ccr & DMA_CCR_EN) || (rx->ccr & DMA_CCR_DIR_M2P)
+            || !(rx->ccr & DMA_CCR_MINC) || (rx->cpar != dr)
+            || (rx->cndtr != n))
+            fatal("bad DMA receive channel");
+        if (rx_full)
+            fatal("DMA receive with a stale byte in the data register");
+        dst = (uint8_t *)(unsigned long)rx->cmar;
+    }
+
+    spi_sim_stats.dma_xfers++;
+    dma.state = DMA_RUN;
+    dma.done = max(bus_free, spi_sim_ns) + (uint64_t)n * ns;
+    dma.flags = DMA_ISR_TCIF(DMA_TX_CH);
+    if (dst)
+        dma.flags |= DMA_ISR_TCIF(DMA_RX_CH);
+
+    if (dma.fault && !--dma.fault) {
+        /* Stop half way, with a transfer error. */
+        spi_sim_stats.dma_errs++;
+        n /= 2;
+        dma.flags = DMA_ISR_TEIF(dst ? DMA_RX_CH : DMA_TX_CH);
+    }
+
+    t = max(bus_free, spi_sim_ns);
+    for (i = 0; i < n; i++) {
+        in = xchg(src[(tx->ccr & DMA_CCR_MINC) ? i : 0], t += ns);
+        if (dst)
+            dst[i] = in;
+    }
+    spi_sim_stats.dma_bytes += n;
+    bus_free = dma.done;
+    tx->cndtr -= n;
+    if (dst)
+        rx->cndtr -= n;
+}
+
+/* Bring the DMA engine up to date with the register state and the time. */
+static void dma_sync(void)
+{
+    uint32_t cr2 = spi_sim_spi2.cr2, ifcr = spi_sim_dma1.ifcr;
+    unsigned int ch;
+
+    gpio_sync();
+
+    if (ifcr) {
+        for (ch = 1; ch <= 7; ch++)
+            if (ifcr & DMA_IFCR_CGIF(ch))
+                ifcr |= 0xfu << ((ch - 1) * 4);
+        spi_sim_dma1.isr &= ~ifcr;
+        spi_sim_dma1.ifcr = 0;
+    }
+
+    if (!(cr2 & (SPI_CR2_TXDMAEN|SPI_CR2_RXDMAEN))) {
+        dma.state = DMA_IDLE;
+        return;
+    }
+
+    if (dma.state == DMA_IDLE)
+        dma_start(cr2);
+
+    if ((dma.state == DMA_RUN) && (spi_sim_ns >= dma.done)) {
+        dma.state = DMA_DONE;
+        spi_sim_dma1.isr |= dma.flags;
+    }
+}
+
+/* CPU time spent in an SPI helper, which must not race a DMA transfer. */
+static void pio_enter(void)
+{
+    dma_sync();
+    if (dma.state == DMA_RUN)
+        fatal("programmed I/O during a DMA transfer");
+    spi_sim_ns += spi_sim_cfg.pio_ns;
+}
+
+/*
+ * SPI helpers (spi.h).
+ */
+
+void spi_quiesce(SPI spi)
+{
+    pio_enter();
+    spi_sim_ns = max(spi_sim_ns, bus_free);
+    rx_full = FALSE;
+}
+
+void spi_16bit_frame(SPI spi)
+{
+    spi_quiesce(spi);
+    spi->cr1 |= SPI_CR1_DFF;
+}
+
+void spi_8bit_frame(SPI spi)
+{
+    spi_quiesce(spi);
+    spi->cr1 &= ~SPI_CR1_DFF;
+}
+
+void spi_xmit16(SPI spi, uint16_t out)
+{
+    pio_enter();
+    (void)frame(out);
+}
+
+uint16_t spi_xchg16(SPI spi, uint16_t out)
+{
+    bool_t stale;
+    uint16_t in;
+
+    pio_enter();
+    stale = rx_full;
+    (void)frame(out);
+    /* Wait for a received frame, unless a stale one is already waiting. */
+    if (!stale)
+        spi_sim_ns = max(spi_sim_ns, bus_free);
+    in = rx_dr;
+    rx_full = FALSE;
+    return in;
+}
+
+/*
+ * Clock and polling.
+ */
+
+/* Time passes: first start any DMA transfer the CPU has just enabled. */
+static void elapse(uint64_t ns)
+{
+    dma_sync();
+    spi_sim_ns += ns;
+    dma_sync();
+}
+
+void spi_sim_relax(void)
+{
+    elapse(spi_sim_cfg.relax_ns);
+}
+
+stk_time_t spi_sim_stk_now(void)
+{
+    dma_sync();
+    return -(stk_time_t)(spi_sim_ns * STK_MHZ / 1000) & STK_MASK;
+}
+
+void delay_us(unsigned int us)
+{
+    elapse(us * 1000ull);
+}
+
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
+{
+    /* Outputs and pulled inputs are driven to the level in @mode. */
+    gpio_write_pin(gpio, pin, mode >> 4);
+    mode &= 0xfu;
+    if (pin >= 8) {
+        pin -= 8;
+        gpio->crh = (gpio->crh & ~(0xfu<<(pin<<2))) | (mode<<(pin<<2));
+    } else {
+        gpio->crl = (gpio->crl & ~(0xfu<<(pin<<2))) | (mode<<(pin<<2));
+    }
+    dma_sync();
+}
+
+/* CRC16 is computed by the CPU, perhaps while a DMA transfer runs. */
+uint16_t __real_crc16_ccitt(const void *buf, size_t len, uint16_t crc);
+uint16_t __wrap_crc16_ccitt(const void *buf, size_t len, uint16_t crc)
+{
+    elapse(len * spi_sim_cfg.crc_ns);
+    return __real_crc16_ccitt(buf, len, crc);
+}
+
+void spi_sim_attach(const struct spi_sim_dev *_dev)
+{
+    dev = _dev;
+    spi_sim_gpioc.idr |= 1u << PIN_CD;
+    if (dev)
+        dev->select(selected);
+}
+
+void spi_sim_detach(void)
+{
+    dev = NULL;
+    spi_sim_gpioc.idr &= ~(1u << PIN_CD);
+}
+
+void spi_sim_dma_fault(unsigned int nth)
+{
+    dma.fault = nth;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
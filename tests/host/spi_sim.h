@@ -0,0 +1,88 @@
+/*
+ * spi_sim.h
+ *
+ * Host model of SPI2 and its DMA1 channels (4: RX, 5: TX), as driven by
+ * sd_spi.c. Force-included after decls.h: the peripherals sd_spi.c uses are
+ * redirected to host memory, and its polling loops (cpu_relax(), stk_now())
+ * into the model, which keeps a simulated clock.
+ *
+ * The SPI helper functions (spi.h) are implemented by the model: each
+ * clocks bytes through the device on the bus (struct spi_sim_dev). DMA
+ * transfers run when the model next sees SPI DMA requests enabled, and
+ * complete after the time taken to clock their bytes.
+ *
+ * DMA addresses are 32 bits, so buffers must lie in the low 4GB: the test
+ * is linked non-PIE and uses static buffers.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef SPI_SIM_H
+#define SPI_SIM_H
+
+/* The macro rcc would otherwise hide struct rcc. */
+typedef volatile struct rcc spi_sim_rcc_t;
+
+extern volatile struct spi spi_sim_spi2;
+extern volatile struct dma spi_sim_dma1;
+extern volatile struct gpio spi_sim_gpiob, spi_sim_gpioc;
+extern spi_sim_rcc_t spi_sim_rcc;
+
+#define spi2  (&spi_sim_spi2)
+#define dma1  (&spi_sim_dma1)
+#define gpiob (&spi_sim_gpiob)
+#define gpioc (&spi_sim_gpioc)
+#define rcc   (&spi_sim_rcc)
+
+void spi_sim_relax(void);
+stk_time_t spi_sim_stk_now(void);
+
+#undef cpu_relax
+#define cpu_relax() spi_sim_relax()
+#undef stk_now
+#define stk_now() spi_sim_stk_now()
+
+/* The card on the bus, selected by PB12 (active low). Card-detect is PC9. */
+struct spi_sim_dev {
+    void (*select)(bool_t sel);
+    uint8_t (*xchg)(uint8_t mosi); /* returns MISO */
+};
+
+/* Costs of CPU work which the model cannot observe directly, in ns. */
+struct spi_sim_cfg {
+    uint32_t pio_ns;   /* one call of an SPI helper function */
+    uint32_t relax_ns; /* one cpu_relax() */
+    uint32_t crc_ns;   /* crc16_ccitt(), per byte */
+};
+
+struct spi_sim_stats {
+    uint32_t bytes;     /* clocked on the bus, by any means */
+    uint32_t dma_bytes; /* ...of which by DMA */
+    uint32_t dma_xfers;
+    uint32_t dma_errs;  /* injected DMA transfer errors */
+};
+
+extern uint64_t spi_sim_ns;     /* simulated time */
+extern uint64_t spi_sim_bus_ns; /* ...at which the current byte is clocked */
+extern struct spi_sim_cfg spi_sim_cfg;
+extern struct spi_sim_stats spi_sim_stats;
+
+void spi_sim_attach(const struct spi_sim_dev *dev);
+void spi_sim_detach(void);
+/* Fail the @nth DMA transfer from now, with a transfer error. */
+void spi_sim_dma_fault(unsigned int nth);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
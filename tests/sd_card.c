@@ -0,0 +1,601 @@
+/*
+ * sd_card.c
+ *
+ * Host test: the firmware's SD card driver (sd_spi.c), unmodified, driving a
+ * model SD card (host/sd_dev.c) through a model of SPI2 and its DMA channels
+ * (host/spi_dma.c). Everything runs on the model's simulated clock.
+ *
+ * Checks card initialisation, data integrity, the open multi-block read and
+ * write streams and their stopping when idle, and recovery from CRC errors,
+ * DMA errors and card removal.
+ * Every byte and command on the bus must be accounted by the driver's own
+ * per-operation statistics, and known single-block traffic must match them
+ * exactly: commands, bytes, ready-wait time and CRC errors. Then reports the
+ * cost of each disk operation, with DMA and with programmed I/O.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fatfs/diskio.h"
+#include "host/sd_dev.h"
+
+#define NR_BLKS 4096
+
+static uint8_t img[NR_BLKS * 512];
+static uint8_t buf[64 * 512];
+
+extern struct volume_ops sd_ops;
+
+uint8_t display_mode;
+
+static unsigned int failures;
+static bool_t verbose;
+
+#define CHECK(cond, fmt, ...) do {                              \
+    if (!(cond)) {                                              \
+        printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,     \
+               ## __VA_ARGS__);                                 \
+        failures++;                                             \
+    }                                                           \
+} while (0)
+
+int printk(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    if (!verbose)
+        return 0;
+    va_start(ap, format);
+    n = vprintf(format, ap);
+    va_end(ap);
+    return n;
+}
+
+/* Deterministic contents for block @lba, generation @gen. */
+static void fill(uint8_t *p, uint32_t lba, unsigned int nr, unsigned int gen)
+{
+    unsigned int i;
+    for (i = 0; i < nr * 512; i++)
+        p[i] = (lba + i / 512) * 7 + (i % 512) * 13 + gen;
+}
+
+/* Commands received by the card, and issued by the driver. */
+static uint32_t dev_cmds(void)
+{
+    uint32_t n = 0;
+    unsigned int i;
+    for (i = 0; i < 64; i++)
+        n += sd_dev_stats.cmd[i] + sd_dev_stats.acmd[i];
+    return n;
+}
+
+static struct sd_op_stats op_total(void)
+{
+    const struct sd_stats *st = sd_stats();
+    struct sd_op_stats t = { 0 };
+    unsigned int i;
+    for (i = 0; i < SD_OP_nr; i++) {
+        t.ops += st->op[i].ops;
+        t.cmds += st->op[i].cmds;
+        t.bytes += st->op[i].bytes;
+        t.wait_us += st->op[i].wait_us;
+        t.crc_errs += st->op[i].crc_errs;
+    }
+    return t;
+}
+
+/* The driver accounts every byte it clocks, and every command it sends.
+ * @lost bytes were accounted to a DMA transfer which failed part way. */
+static void check_accounting(const char *what, uint32_t lost)
+{
+    struct sd_op_stats t = op_total();
+
+    CHECK(t.bytes == spi_sim_stats.bytes + lost,
+          "%s: %u bytes accounted, %u clocked", what, t.bytes,
+          spi_sim_stats.bytes + lost);
+    CHECK(t.cmds == dev_cmds(), "%s: %u commands accounted, %u received",
+          what, t.cmds, dev_cmds());
+    CHECK(sd_dev_stats.protocol_errs == 0, "%s: %u protocol errors",
+          what, sd_dev_stats.protocol_errs);
+}
+
+static DRESULT disk_io(bool_t write, void *p, uint32_t lba, unsigned int nr)
+{
+    return write ? sd_ops.write(0, p, lba, nr) : sd_ops.read(0, p, lba, nr);
+}
+
+static DRESULT disk_sync(void)
+{
+    return sd_ops.ioctl(0, CTRL_SYNC, NULL);
+}
+
+static void test_init(void)
+{
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "card not initialised");
+    CHECK(sd_ops.connected(), "card not connected");
+    CHECK(sd_ops.status(0) == 0, "status %02x", sd_ops.status(0));
+    CHECK(sd_dev_stats.cmd[59] == 1, "CRCs not enabled");
+    CHECK(sd_dev_stats.acmd[41] == sd_dev_cfg.init_polls, "%u ACMD41s",
+          sd_dev_stats.acmd[41]);
+    /* The card ID is read and CRC checked. */
+    CHECK(sd_dev_stats.cmd[10] == 1, "CID not read");
+    CHECK(sd_stats()->op[SD_OP_init].crc_errs == 0, "bad CID CRC");
+    check_accounting("init", 0);
+}
+
+static void test_rw(void)
+{
+    static const struct { uint32_t lba, nr; } io[] = {
+        { 0, 1 }, { 1, 2 }, { 5, 7 }, { 100, 64 }, { 164, 1 },
+        { NR_BLKS - 33, 33 }
+    };
+    unsigned int i;
+    DRESULT res;
+
+    for (i = 0; i < ARRAY_SIZE(io); i++) {
+        memset(buf, 0xaa, io[i].nr * 512);
+        res = disk_io(FALSE, buf, io[i].lba, io[i].nr);
+        CHECK(res == RES_OK, "read %u+%u: %d", io[i].lba, io[i].nr, res);
+        CHECK(!memcmp(buf, &img[io[i].lba * 512], io[i].nr * 512),
+              "read %u+%u: bad data", io[i].lba, io[i].nr);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(io); i++) {
+        fill(buf, io[i].lba, io[i].nr, i + 1);
+        res = disk_io(TRUE, buf, io[i].lba, io[i].nr);
+        CHECK(res == RES_OK, "write %u+%u: %d", io[i].lba, io[i].nr, res);
+        CHECK(!memcmp(buf, &img[io[i].lba * 512], io[i].nr * 512),
+              "write %u+%u: bad data", io[i].lba, io[i].nr);
+    }
+
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    CHECK(!sd_dev_busy(), "card busy after sync");
+
+    /* Out of range. */
+    CHECK(disk_io(FALSE, buf, NR_BLKS, 1) != RES_OK, "read past end");
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "no recovery after error");
+
+    check_accounting("rw", 0);
+}
+
+/* A sequential read continues the open READ_MULTIPLE_BLOCK. */
+static void test_read_stream(void)
+{
+    const struct sd_op_stats *rd = &sd_stats()->op[SD_OP_read];
+    uint32_t cmds, c12, c17, c18;
+
+    CHECK(disk_io(FALSE, buf, 200, 4) == RES_OK, "read 200+4");
+    c12 = sd_dev_stats.cmd[12];
+    c17 = sd_dev_stats.cmd[17];
+    c18 = sd_dev_stats.cmd[18];
+    cmds = rd->cmds;
+
+    CHECK(disk_io(FALSE, buf, 204, 1) == RES_OK, "read 204");
+    CHECK(disk_io(FALSE, buf + 512, 205, 8) == RES_OK, "read 205+8");
+    CHECK(!memcmp(buf, &img[204 * 512], 9 * 512), "stream: bad data");
+    CHECK(rd->cmds == cmds, "stream: %u commands", rd->cmds - cmds);
+
+    /* Elsewhere: stop the stream, and read a single block. */
+    CHECK(disk_io(FALSE, buf, 300, 1) == RES_OK, "read 300");
+    CHECK(!memcmp(buf, &img[300 * 512], 512), "read 300: bad data");
+    CHECK(sd_dev_stats.cmd[12] == c12 + 1, "%u STOP_TRANSMISSIONs",
+          sd_dev_stats.cmd[12] - c12);
+    CHECK(sd_dev_stats.cmd[17] == c17 + 1, "no READ_SINGLE_BLOCK");
+
+    /* Then sequentially on from there: a new stream. */
+    CHECK(disk_io(FALSE, buf, 301, 1) == RES_OK, "read 301");
+    CHECK(disk_io(FALSE, buf + 512, 302, 1) == RES_OK, "read 302");
+    CHECK(!memcmp(buf, &img[301 * 512], 2 * 512), "read 301: bad data");
+    CHECK(sd_dev_stats.cmd[18] == c18 + 1, "%u READ_MULTIPLE_BLOCKs",
+          sd_dev_stats.cmd[18] - c18);
+
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    check_accounting("read stream", 0);
+}
+
+/* A sequential write continues the open WRITE_MULTIPLE_BLOCK, without
+ * waiting for the card to program the last block. */
+static void test_write_stream(void)
+{
+    const struct sd_stats *st = sd_stats();
+    uint32_t cmds, blocks = st->blocks_written, stop = sd_dev_stats.stop_tran;
+    uint32_t busy_us = st->busy_us;
+
+    fill(buf, 400, 4, 10);
+    CHECK(disk_io(TRUE, buf, 400, 4) == RES_OK, "write 400+4");
+    CHECK(sd_dev_stats.pre_erase == 4, "pre-erase %u blocks",
+          sd_dev_stats.pre_erase);
+    CHECK(sd_dev_busy(), "write waited for the card");
+    cmds = st->op[SD_OP_write].cmds;
+
+    fill(buf, 404, 2, 11);
+    CHECK(disk_io(TRUE, buf, 404, 2) == RES_OK, "write 404+2");
+    CHECK(st->op[SD_OP_write].cmds == cmds, "stream: %u commands",
+          st->op[SD_OP_write].cmds - cmds);
+    CHECK(sd_dev_stats.stop_tran == stop, "stream stopped early");
+
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    CHECK(sd_dev_stats.stop_tran == stop + 1, "stream not stopped");
+    CHECK(!sd_dev_busy(), "card busy after sync");
+    CHECK(st->blocks_written == blocks + 6, "%u blocks written",
+          st->blocks_written - blocks);
+    CHECK(st->busy_us > busy_us, "busy time not accounted");
+    CHECK(st->busy_max_us >= sd_dev_cfg.stop_us, "busy max %uus",
+          st->busy_max_us);
+
+    fill(buf, 400, 4, 10);
+    CHECK(!memcmp(buf, &img[400 * 512], 4 * 512), "write 400: bad data");
+    fill(buf, 404, 2, 11);
+    CHECK(!memcmp(buf, &img[404 * 512], 2 * 512), "write 404: bad data");
+    check_accounting("write stream", 0);
+}
+
+/* A transfer left open is stopped once the bus has been idle a while. */
+static void test_idle_stream(void)
+{
+    uint32_t stop = sd_dev_stats.stop_tran, c12 = sd_dev_stats.cmd[12];
+
+    fill(buf, 420, 2, 12);
+    CHECK(disk_io(TRUE, buf, 420, 2) == RES_OK, "write 420+2");
+    sd_ops.idle();
+    CHECK(sd_dev_stats.stop_tran == stop, "write stream stopped at once");
+    spi_sim_ns += 5000000;
+    sd_ops.idle();
+    CHECK(sd_dev_stats.stop_tran == stop + 1, "idle write stream not stopped");
+    CHECK(!memcmp(buf, &img[420 * 512], 2 * 512), "write 420: bad data");
+
+    CHECK(disk_io(FALSE, buf, 500, 2) == RES_OK, "read 500+2");
+    sd_ops.idle();
+    CHECK(sd_dev_stats.cmd[12] == c12, "read stream stopped at once");
+    spi_sim_ns += 5000000;
+    sd_ops.idle();
+    CHECK(sd_dev_stats.cmd[12] == c12 + 1, "idle read stream not stopped");
+
+    /* Nothing left to stop. */
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    CHECK((sd_dev_stats.stop_tran == stop + 1)
+          && (sd_dev_stats.cmd[12] == c12 + 1), "stream stopped twice");
+    check_accounting("idle stream", 0);
+}
+
+/* Single-block traffic on the bus, as scripted by the card model with no 
+ * access delay: a command is its 6 bytes, one ready poll, one byte of Ncr 
+ * and R1; a read adds the start token, the block, its CRC16 and one byte to
+ * deselect; a write adds a ready poll, the token, the block, its CRC16, the
+ * data response and one byte to deselect. */
+#define CMD_BYTES   (1 + 6 + 1 + 1)
+#define READ_BYTES  (CMD_BYTES + 1 + 512 + 2 + 1)
+#define WRITE_BYTES (CMD_BYTES + 1 + 1 + 512 + 2 + 1 + 1)
+
+/* Per-operation statistics of @type since @o0. Other types must not move. */
+static void check_op(const char *what, unsigned int type,
+                     const struct sd_op_stats *o0, uint32_t ops,
+                     uint32_t cmds, uint32_t bytes, uint32_t crc_errs)
+{
+    const struct sd_op_stats *o = sd_stats()->op;
+    unsigned int i;
+
+    for (i = 0; i < SD_OP_nr; i++) {
+        if (i == type)
+            continue;
+        CHECK(!memcmp(&o[i], &o0[i], sizeof(o[i])),
+              "%s: operation type %u accounted", what, i);
+    }
+    o += type;
+    o0 += type;
+    CHECK(o->ops - o0->ops == ops, "%s: %u operations, expected %u",
+          what, o->ops - o0->ops, ops);
+    CHECK(o->cmds - o0->cmds == cmds, "%s: %u commands, expected %u",
+          what, o->cmds - o0->cmds, cmds);
+    CHECK(o->bytes - o0->bytes == bytes, "%s: %u bytes, expected %u",
+          what, o->bytes - o0->bytes, bytes);
+    CHECK(o->crc_errs - o0->crc_errs == crc_errs,
+          "%s: %u CRC errors, expected %u",
+          what, o->crc_errs - o0->crc_errs, crc_errs);
+}
+
+/* Each counter of each operation type matches known traffic exactly. */
+static void test_op_stats(void)
+{
+    const struct sd_stats *st = sd_stats();
+    struct sd_op_stats o0[SD_OP_nr];
+    uint32_t access_us = sd_dev_cfg.access_us, bytes, wait_us, busy_us;
+
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    sd_dev_cfg.access_us = 0;
+
+    memcpy(o0, st->op, sizeof(o0));
+    CHECK(disk_io(FALSE, buf, 1000, 1) == RES_OK, "read 1000");
+    check_op("read", SD_OP_read, o0, 1, 1, READ_BYTES, 0);
+    CHECK(st->op[SD_OP_read].wait_us == o0[SD_OP_read].wait_us,
+          "read: waited %uus", st->op[SD_OP_read].wait_us
+          - o0[SD_OP_read].wait_us);
+
+    /* A bad CRC16 costs the whole command again. */
+    memcpy(o0, st->op, sizeof(o0));
+    sd_dev_fault(SD_FAULT_READ_CRC, 1);
+    CHECK(disk_io(FALSE, buf, 1002, 1) == RES_OK, "read 1002");
+    check_op("read CRC", SD_OP_read, o0, 1, 2, 2 * READ_BYTES, 1);
+
+    memcpy(o0, st->op, sizeof(o0));
+    fill(buf, 1010, 1, 60);
+    CHECK(disk_io(TRUE, buf, 1010, 1) == RES_OK, "write 1010");
+    check_op("write", SD_OP_write, o0, 1, 1, WRITE_BYTES, 0);
+    CHECK(!memcmp(buf, &img[1010 * 512], 512), "write 1010: bad data");
+
+    /* The card programs the block while the sync waits. */
+    memcpy(o0, st->op, sizeof(o0));
+    bytes = spi_sim_stats.bytes;
+    busy_us = st->busy_us;
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    check_op("sync", SD_OP_sync, o0, 1, 0, spi_sim_stats.bytes - bytes, 0);
+    wait_us = st->op[SD_OP_sync].wait_us - o0[SD_OP_sync].wait_us;
+    CHECK((wait_us + 2 >= sd_dev_cfg.prog_us)
+          && (wait_us <= sd_dev_cfg.prog_us + 2),
+          "sync: waited %uus for %uus programming", wait_us,
+          sd_dev_cfg.prog_us);
+    CHECK(st->busy_us - busy_us == wait_us, "sync: %uus busy, waited %uus",
+          st->busy_us - busy_us, wait_us);
+
+    /* A written block rejected for its CRC16 is written again. */
+    memcpy(o0, st->op, sizeof(o0));
+    sd_dev_fault(SD_FAULT_WRITE_CRC, 1);
+    fill(buf, 1020, 1, 61);
+    CHECK(disk_io(TRUE, buf, 1020, 1) == RES_OK, "write 1020");
+    check_op("write CRC", SD_OP_write, o0, 1, 2, 2 * WRITE_BYTES, 1);
+    CHECK(!memcmp(buf, &img[1020 * 512], 512), "write 1020: bad data");
+
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    sd_dev_cfg.access_us = access_us;
+    check_accounting("op stats", 0);
+}
+
+/* A CRC error in either direction is retried. */
+static void test_crc(unsigned int fault)
+{
+    const struct sd_op_stats *rd = &sd_stats()->op[SD_OP_read];
+    const struct sd_op_stats *wr = &sd_stats()->op[SD_OP_write];
+    uint32_t crc_errs = sd_dev_stats.crc_errs, rd_crc = rd->crc_errs;
+    uint32_t wr_crc = wr->crc_errs;
+    DRESULT res;
+
+    sd_dev_fault(fault, 3);
+    fill(buf, 500, 8, 20);
+    res = disk_io(fault == SD_FAULT_WRITE_CRC, buf, 500, 8);
+    CHECK(res == RES_OK, "fault %u: %d", fault, res);
+    if (fault != SD_FAULT_WRITE_CRC) {
+        res = disk_io(FALSE, buf, 500, 8);
+        CHECK(res == RES_OK, "fault %u: %d", fault, res);
+    }
+    CHECK(disk_sync() == RES_OK, "fault %u: sync failed", fault);
+    CHECK(!memcmp(buf, &img[500 * 512], 8 * 512), "fault %u: bad data",
+          fault);
+
+    switch (fault) {
+    case SD_FAULT_READ_CRC:
+        CHECK(rd->crc_errs == rd_crc + 1, "read CRC error not counted");
+        break;
+    case SD_FAULT_WRITE_CRC:
+        CHECK(wr->crc_errs == wr_crc + 1, "write CRC error not counted");
+        /* fall through */
+    default:
+        CHECK(sd_dev_stats.crc_errs == crc_errs + 1, "fault %u: %u CRC errors",
+              fault, sd_dev_stats.crc_errs - crc_errs);
+        break;
+    }
+    check_accounting("crc", 0);
+}
+
+/* A DMA error falls back to programmed I/O, until the card is
+ * reinitialised. */
+static void test_dma_fault(void)
+{
+    uint32_t xfers;
+
+    spi_sim_dma_fault(1);
+    CHECK(disk_io(FALSE, buf, 600, 4) == RES_OK, "read with DMA error");
+    CHECK(!memcmp(buf, &img[600 * 512], 4 * 512), "DMA error: bad data");
+    CHECK(spi_sim_stats.dma_errs == 1, "no DMA error");
+    /* Half of the failed 512-byte transfer was never clocked. */
+    check_accounting("DMA error", 256);
+
+    xfers = spi_sim_stats.dma_xfers;
+    fill(buf, 600, 4, 30);
+    CHECK(disk_io(TRUE, buf, 600, 4) == RES_OK, "write after DMA error");
+    CHECK(disk_io(FALSE, buf, 700, 4) == RES_OK, "read after DMA error");
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    CHECK(spi_sim_stats.dma_xfers == xfers, "DMA used after error");
+
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "reinitialise failed");
+    CHECK(disk_io(FALSE, buf, 700, 4) == RES_OK, "read after reinitialise");
+    CHECK(spi_sim_stats.dma_xfers == xfers + 4, "DMA not restored");
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    check_accounting("DMA error", 256);
+}
+
+/* With a 1602 LCD, the DMA RX channel is used for I2C: reads use PIO. */
+static void test_lcd(void)
+{
+    uint32_t xfers = spi_sim_stats.dma_xfers;
+
+    display_mode = DM_LCD_1602;
+    CHECK(disk_io(FALSE, buf, 800, 16) == RES_OK, "read with LCD");
+    CHECK(!memcmp(buf, &img[800 * 512], 16 * 512), "read with LCD: bad data");
+    CHECK(spi_sim_stats.dma_xfers == xfers, "read with LCD used DMA");
+    fill(buf, 800, 2, 40);
+    CHECK(disk_io(TRUE, buf, 800, 2) == RES_OK, "write with LCD");
+    CHECK(spi_sim_stats.dma_xfers == xfers + 2, "write with LCD: no DMA");
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    CHECK(!memcmp(buf, &img[800 * 512], 2 * 512), "write with LCD: bad data");
+    display_mode = DM_NONE;
+    check_accounting("LCD", 256);
+}
+
+/* A standard-capacity card is byte addressed. */
+static void test_sdsc(void)
+{
+    sd_dev_cfg.sdsc = TRUE;
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "SDSC not initialised");
+    CHECK(disk_io(FALSE, buf, 900, 4) == RES_OK, "SDSC read");
+    CHECK(disk_io(FALSE, buf + 4 * 512, 904, 1) == RES_OK, "SDSC read");
+    CHECK(!memcmp(buf, &img[900 * 512], 5 * 512), "SDSC read: bad data");
+    fill(buf, 900, 5, 50);
+    CHECK(disk_io(TRUE, buf, 900, 4) == RES_OK, "SDSC write");
+    CHECK(disk_io(TRUE, buf + 4 * 512, 904, 1) == RES_OK, "SDSC write");
+    CHECK(disk_sync() == RES_OK, "SDSC sync failed");
+    CHECK(!memcmp(buf, &img[900 * 512], 5 * 512), "SDSC write: bad data");
+    sd_dev_cfg.sdsc = FALSE;
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "SDHC not initialised");
+    check_accounting("SDSC", 256);
+}
+
+static void test_remove(void)
+{
+    spi_sim_detach();
+    CHECK(!sd_ops.connected(), "connected after removal");
+    CHECK(sd_ops.initialize(0) & STA_NOINIT, "initialised without a card");
+    CHECK(disk_io(FALSE, buf, 0, 1) == RES_NOTRDY, "read without a card");
+
+    spi_sim_attach(&sd_dev);
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "no init after reinsertion");
+    CHECK(disk_io(FALSE, buf, 0, 1) == RES_OK, "read after reinsertion");
+    CHECK(!memcmp(buf, img, 512), "read after reinsertion: bad data");
+    CHECK(disk_sync() == RES_OK, "sync failed");
+    check_accounting("remove", 256);
+}
+
+/* Time @n disk operations of @nr blocks, sequential or scattered, and report
+ * the cost per operation. A sync follows, and is accounted to the writes. */
+static double bench(bool_t write, bool_t seq, unsigned int nr, unsigned int n)
+{
+    const struct sd_stats *st = sd_stats();
+    unsigned int type = write ? SD_OP_write : SD_OP_read;
+    struct sd_op_stats o0 = st->op[type], s0 = st->op[SD_OP_sync], o;
+    uint32_t busy0 = st->busy_us, bytes0 = spi_sim_stats.bytes;
+    uint64_t t0 = spi_sim_ns;
+    double us;
+    unsigned int i;
+    uint32_t lba;
+    DRESULT res;
+
+    for (i = 0; i < n; i++) {
+        lba = seq ? 1024 + i * nr : 1024 + (i * 37 * nr) % 2048;
+        if (write)
+            fill(buf, lba, nr, i);
+        res = disk_io(write, buf, lba, nr);
+        CHECK(res == RES_OK, "bench %s %u: %d", write ? "write" : "read",
+              nr, res);
+    }
+    if (write)
+        CHECK(disk_sync() == RES_OK, "bench: sync failed");
+
+    o = st->op[type];
+    o.ops -= o0.ops;
+    o.cmds = o.cmds - o0.cmds + st->op[SD_OP_sync].cmds - s0.cmds;
+    o.bytes = o.bytes - o0.bytes + st->op[SD_OP_sync].bytes - s0.bytes;
+    o.wait_us = o.wait_us - o0.wait_us
+        + st->op[SD_OP_sync].wait_us - s0.wait_us;
+    CHECK(o.ops == n, "bench: %u operations, expected %u", o.ops, n);
+    CHECK(o.bytes == spi_sim_stats.bytes - bytes0,
+          "bench: %u bytes accounted, %u clocked", o.bytes,
+          spi_sim_stats.bytes - bytes0);
+
+    us = (spi_sim_ns - t0) / 1e3 / n;
+    printf("  %-5s %-4s %2u | %7.0f %6.0f | %6u %5.1f %7.0f %7.0f\n",
+           write ? "write" : "read", seq ? "seq" : "rand", nr, us,
+           nr * 512 * 1e6 / 1024 / us, o.bytes / n,
+           (double)o.cmds / n, (double)o.wait_us / n,
+           (double)(st->busy_us - busy0) / n);
+
+    return us;
+}
+
+static void bench_all(const char *mode, double *rd64, double *wr64)
+{
+    static const unsigned int sizes[] = { 1, 8, 64 };
+    unsigned int i;
+    double us;
+
+    printf("  -- %s\n", mode);
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        us = bench(FALSE, TRUE, sizes[i], 128 / sizes[i]);
+        if (sizes[i] == 64)
+            *rd64 = us;
+    }
+    bench(FALSE, FALSE, 1, 32);
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        us = bench(TRUE, TRUE, sizes[i], 128 / sizes[i]);
+        if (sizes[i] == 64)
+            *wr64 = us;
+    }
+    bench(TRUE, FALSE, 1, 32);
+}
+
+static void test_bench(void)
+{
+    double dma_rd, dma_wr, pio_rd, pio_wr;
+
+    printf("sd_card: per disk operation: time, throughput, bus bytes,"
+           " commands,\n"
+           "         time in wait_ready() and of which card busy\n"
+           "  op    addr nr |   total   KB/s |  bytes  cmds    wait"
+           "    busy\n");
+    bench_all("DMA", &dma_rd, &dma_wr);
+
+    /* A DMA error leaves the driver on PIO. */
+    spi_sim_dma_fault(1);
+    CHECK(disk_io(FALSE, buf, 0, 1) == RES_OK, "bench: DMA error");
+    bench_all("PIO", &pio_rd, &pio_wr);
+    CHECK(!(sd_ops.initialize(0) & STA_NOINIT), "reinitialise failed");
+
+    /* DMA overlaps the CRC of each block with the transfer of the next. */
+    CHECK(dma_rd < pio_rd, "DMA read %.0fus, PIO %.0fus", dma_rd, pio_rd);
+    CHECK(dma_wr < pio_wr, "DMA write %.0fus, PIO %.0fus", dma_wr, pio_wr);
+}
+
+int main(int argc, char **argv)
+{
+    verbose = (argc > 1) && !strcmp(argv[1], "-v");
+
+    fill(img, 0, NR_BLKS, 0);
+    sd_dev_init(img, NR_BLKS);
+    spi_sim_attach(&sd_dev);
+
+    test_init();
+    if (failures)
+        goto out;
+    test_rw();
+    test_read_stream();
+    test_write_stream();
+    test_idle_stream();
+    test_op_stats();
+    test_crc(SD_FAULT_CMD_CRC);
+    test_crc(SD_FAULT_READ_CRC);
+    test_crc(SD_FAULT_WRITE_CRC);
+    test_dma_fault();
+    test_lcd();
+    test_sdsc();
+    test_remove();
+    test_bench();
+
+out:
+    printf("sd_card: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,452 @@
+/*
+ * usb_msc.c
+ *
+ * Host test: the firmware's USB host stack and MSC/FatFS glue, unmodified,
+ * driving a scripted mass-storage device through a model of the OTG_FS core
+ * (host/otg_fs.c, host/msc_dev.c). Everything runs on the model's simulated
+ * clock.
+ *
+ * Checks enumeration, data integrity of reads and writes (including those
+ * which are split into several commands), and recovery from NAKs, STALLs
+ * and phase errors on reads and writes (including part way through a split
+ * request) and from surprise removal; and that the volume layer above
+ * serialises its background reads ahead with other requests, including
+ * those which image handlers submit. Then reports the cost of each BOT
+ * transaction (CBW, data, CSW): its time on the bus, the time the device
+ * took to respond, and the host overhead which remains.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+/* Not <stdlib.h>: its time_t would clash with the firmware's. */
+void exit(int status) __attribute__((noreturn));
+
+#include "usbh_msc_core.h"
+#include "host/msc_dev.h"
+
+#define NR_BLKS 2048
+
+static uint8_t img[NR_BLKS * 512];
+static uint8_t buf[256 * 512];
+static uint8_t rx_buf[512];
+
+extern struct volume_ops usb_ops;
+
+/* Firmware globals used by the volume layer. */
+struct ff_cfg ff_cfg;
+struct volume_ops sd_ops;
+uint8_t board_id;
+
+static unsigned int failures;
+static bool_t verbose;
+
+#define CHECK(cond, fmt, ...) do {                              \
+    if (!(cond)) {                                              \
+        printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__,     \
+               ## __VA_ARGS__);                                 \
+        failures++;                                             \
+    }                                                           \
+} while (0)
+
+int printk(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    if (!verbose)
+        return 0;
+    va_start(ap, format);
+    n = vprintf(format, ap);
+    va_end(ap);
+    return n;
+}
+
+/* Deterministic contents for block @lba, generation @gen. */
+static void fill(uint8_t *p, uint32_t lba, unsigned int nr, unsigned int gen)
+{
+    unsigned int i;
+    for (i = 0; i < nr * 512; i++)
+        p[i] = (lba + i / 512) * 7 + (i % 512) * 13 + gen;
+}
+
+#define SIM_S(s) ((uint64_t)((s) * 1e9))
+
+/* Run the USB host state machine until the volume is ready. */
+static bool_t mount(void)
+{
+    uint64_t deadline = otg_sim_ns + SIM_S(5);
+
+    while (usb_ops.initialize(0) & STA_NOINIT) {
+        if (otg_sim_ns > deadline)
+            return FALSE;
+        usbh_msc_process();
+        otg_sim_poll();
+    }
+    return TRUE;
+}
+
+static DRESULT disk_io(bool_t write, void *p, uint32_t lba, unsigned int nr)
+{
+    uint64_t deadline = otg_sim_ns + SIM_S(5);
+    DRESULT res;
+
+    if ((res = usb_ops.submit(write, p, lba, nr)) != RES_OK)
+        return res;
+    while (!usb_ops.poll(&res)) {
+        if (otg_sim_ns > deadline) {
+            printf("FAIL: %s %u+%u timed out\n",
+                   write ? "write" : "read", lba, nr);
+            exit(1);
+        }
+        otg_sim_poll();
+    }
+    return res;
+}
+
+static void test_enumerate(void)
+{
+    CHECK(mount(), "device not mounted");
+    CHECK(usbh_msc_id() == ((MSC_DEV_VID << 16) | MSC_DEV_PID),
+          "id %08x", usbh_msc_id());
+    CHECK(!strcmp(usbh_msc_lat()->serial, MSC_DEV_SERIAL),
+          "serial '%s'", usbh_msc_lat()->serial);
+    /* As READ CAPACITY reports it: the last block address. */
+    CHECK(USBH_MSC_Param.MSCapacity == NR_BLKS - 1,
+          "capacity %u", USBH_MSC_Param.MSCapacity);
+    CHECK(USBH_MSC_Param.MSPageLength == 512,
+          "block size %u", USBH_MSC_Param.MSPageLength);
+    CHECK(!usb_ops.readonly(), "write protected");
+}
+
+static void test_rw(void)
+{
+    static const struct { uint32_t lba, nr; } io[] = {
+        { 0, 1 }, { 1, 2 }, { 5, 7 }, { 100, 64 }, { 300, 128 },
+        /* Split into 128 + 128 and 128 + 72 sectors. */
+        { 500, 256 }, { NR_BLKS - 200, 200 }
+    };
+    unsigned int i;
+    DRESULT res;
+
+    for (i = 0; i < ARRAY_SIZE(io); i++) {
+        memset(buf, 0xaa, io[i].nr * 512);
+        res = disk_io(FALSE, buf, io[i].lba, io[i].nr);
+        CHECK(res == RES_OK, "read %u+%u: %d", io[i].lba, io[i].nr, res);
+        CHECK(!memcmp(buf, &img[io[i].lba * 512], io[i].nr * 512),
+              "read %u+%u: bad data", io[i].lba, io[i].nr);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(io); i++) {
+        fill(buf, io[i].lba, io[i].nr, i + 1);
+        res = disk_io(TRUE, buf, io[i].lba, io[i].nr);
+        CHECK(res == RES_OK, "write %u+%u: %d", io[i].lba, io[i].nr, res);
+        CHECK(!memcmp(buf, &img[io[i].lba * 512], io[i].nr * 512),
+              "write %u+%u: bad data", io[i].lba, io[i].nr);
+        /* Neighbouring blocks are untouched. */
+        if (io[i].lba != 0)
+            CHECK(img[io[i].lba * 512 - 1] != buf[io[i].nr * 512 - 1]
+                  || io[i].nr == 1, "write %u+%u: overrun",
+                  io[i].lba, io[i].nr);
+    }
+}
+
+/* NAKs: bulk IN NAKs are retried by the core; bulk OUT NAKs by BOT layer. */
+static void test_nak(void)
+{
+    uint16_t nak = usbh_msc_lat()->bot.nak;
+    uint32_t naks = otg_sim_stats.naks;
+    DRESULT res;
+
+    msc_dev_fault(0x28, 1, MSC_FAULT_NAK, 3);
+    res = disk_io(FALSE, buf, 40, 4);
+    CHECK(res == RES_OK, "read with NAKs: %d", res);
+    CHECK(!memcmp(buf, &img[40 * 512], 4 * 512), "read with NAKs: bad data");
+    CHECK(otg_sim_stats.naks - naks >= 3 * (4 * 512 / 64 + 1),
+          "read: %u NAKs", otg_sim_stats.naks - naks);
+
+    msc_dev_fault(0x2a, 1, MSC_FAULT_NAK, 2);
+    fill(buf, 40, 4, 99);
+    res = disk_io(TRUE, buf, 40, 4);
+    CHECK(res == RES_OK, "write with NAKs: %d", res);
+    CHECK(!memcmp(buf, &img[40 * 512], 4 * 512), "write with NAKs: bad data");
+    CHECK(usbh_msc_lat()->bot.nak - nak >= 2 * (4 * 512 / 64),
+          "write: %u NAKs", usbh_msc_lat()->bot.nak - nak);
+    CHECK(msc_dev_stats.dup_out == 0, "%u duplicate OUT packets",
+          msc_dev_stats.dup_out);
+}
+
+/* Failed commands force re-enumeration, after which I/O works again. */
+static void test_fault(uint8_t op, unsigned int fault)
+{
+    const struct msc_bot_stats *bot = &usbh_msc_lat()->bot;
+    struct msc_bot_stats old = *bot;
+    bool_t write = (op == 0x2a);
+    const char *what = (fault == MSC_FAULT_STALL) ? "STALL" : "phase error";
+    DRESULT res;
+
+    msc_dev_fault(op, 1, fault, 0);
+    fill(buf, 60, 8, 50);
+    res = disk_io(write, buf, 60, 8);
+    CHECK(res != RES_OK, "%s %s: not reported", write ? "write" : "read",
+          what);
+    if (fault == MSC_FAULT_STALL)
+        CHECK(bot->stall > old.stall, "%s STALL: not counted",
+              write ? "write" : "read");
+    else
+        CHECK(bot->phase_err > old.phase_err, "%s phase error: not counted",
+              write ? "write" : "read");
+    CHECK(!usb_ops.connected(), "still connected after %s", what);
+
+    CHECK(mount(), "no recovery from %s", what);
+    res = disk_io(write, buf, 60, 8);
+    CHECK(res == RES_OK, "%s after %s: %d", write ? "write" : "read",
+          what, res);
+    CHECK(!memcmp(buf, &img[60 * 512], 8 * 512), "%s after %s: bad data",
+          write ? "write" : "read", what);
+}
+
+/* Faults on the second command of a split request: NAKs are ridden out, 
+ * and a STALL fails the request after the first command's blocks are 
+ * written. */
+static void test_split_fault(void)
+{
+    const struct msc_bot_stats *bot = &usbh_msc_lat()->bot;
+    uint32_t stall = bot->stall, cmds = msc_dev_stats.cmds;
+    DRESULT res;
+
+    msc_dev_fault(0x28, 2, MSC_FAULT_NAK, 2);
+    memset(buf, 0xaa, 256 * 512);
+    res = disk_io(FALSE, buf, 500, 256);
+    CHECK(res == RES_OK, "split read with NAKs: %d", res);
+    CHECK(!memcmp(buf, &img[500 * 512], 256 * 512),
+          "split read with NAKs: bad data");
+    CHECK(msc_dev_stats.cmds - cmds == 2, "split read: %u commands",
+          msc_dev_stats.cmds - cmds);
+
+    msc_dev_fault(0x2a, 2, MSC_FAULT_STALL, 0);
+    fill(buf, 600, 200, 77);
+    res = disk_io(TRUE, buf, 600, 200);
+    CHECK(res != RES_OK, "split write STALL: not reported");
+    CHECK(bot->stall == stall + 1, "split write: %u STALLs",
+          bot->stall - stall);
+    CHECK(!memcmp(buf, &img[600 * 512], 128 * 512),
+          "split write STALL: first command not written");
+
+    CHECK(mount(), "no recovery from split write STALL");
+    res = disk_io(TRUE, buf, 600, 200);
+    CHECK(res == RES_OK, "split write after STALL: %d", res);
+    CHECK(!memcmp(buf, &img[600 * 512], 200 * 512),
+          "split write after STALL: bad data");
+}
+
+static void test_detach(void)
+{
+    uint64_t t;
+
+    otg_sim_detach();
+    for (t = otg_sim_ns + SIM_S(0.1); otg_sim_ns < t; otg_sim_poll())
+        usbh_msc_process();
+    CHECK(!usb_ops.connected(), "connected after detach");
+    CHECK(usbh_msc_id() == 0, "id after detach");
+
+    otg_sim_attach(&msc_dev);
+    CHECK(mount(), "no mount after reattach");
+    CHECK(disk_io(FALSE, buf, 0, 1) == RES_OK, "read after reattach");
+    CHECK(!memcmp(buf, img, 512), "read after reattach: bad data");
+}
+
+/* Volume layer: metadata (FatFS sector window) is cached and read ahead in 
+ * the background, while file data bypasses the cache. A data read issued 
+ * while a read ahead is in flight must wait for it: the BOT layer handles 
+ * one command at a time. */
+static void test_volume_ra(void)
+{
+    static uint8_t win[512], cache_buf[64 * 512];
+    const struct cache_stats *s = volume_cache_stats(VOL_TAG_fatfs);
+    uint32_t lba, hits;
+    DRESULT res;
+
+    ff_cfg.read_ahead = 8;
+    ff_cfg.metadata_cache_pct = ff_cfg.data_cache_pct = 50;
+    volume_set_metadata_window(win);
+    volume_cache_init(cache_buf, cache_buf + sizeof(cache_buf));
+    volume_cache_metadata_only();
+
+    /* A second sequential metadata read starts a read ahead of 202-209. */
+    for (lba = 200; lba < 202; lba++) {
+        res = disk_read(0, win, lba, 1);
+        CHECK(res == RES_OK, "metadata read %u: %d", lba, res);
+    }
+
+    memset(buf, 0xaa, 4 * 512);
+    res = disk_read(0, buf, 1000, 4);
+    CHECK(res == RES_OK, "data read during read ahead: %d", res);
+    CHECK(!memcmp(buf, &img[1000 * 512], 4 * 512),
+          "data read during read ahead: bad data");
+
+    /* The read ahead completed intact, and serves the metadata stream. */
+    hits = s->hits;
+    for (lba = 202; lba < 210; lba++) {
+        memset(win, 0xaa, 512);
+        res = disk_read(0, win, lba, 1);
+        CHECK(res == RES_OK, "metadata read %u: %d", lba, res);
+        CHECK(!memcmp(win, &img[lba * 512], 512),
+              "metadata read %u: bad data", lba);
+    }
+    CHECK(s->hits - hits == 8, "%u of 8 reads ahead hit", s->hits - hits);
+
+    volume_cache_destroy();
+    volume_set_metadata_window(NULL);
+}
+
+/* Volume layer: requests submitted by an image handler are queued behind 
+ * a read ahead, complete in the background, and may be waited for. */
+static void test_volume_req(void)
+{
+    static uint8_t win[512], cache_buf[64 * 512];
+    struct volume_req req[2];
+    uint64_t deadline;
+    unsigned int i;
+    DRESULT res;
+
+    ff_cfg.read_ahead = 8;
+    volume_set_metadata_window(win);
+    volume_cache_init(cache_buf, cache_buf + sizeof(cache_buf));
+    volume_cache_metadata_only();
+    for (i = 0; i < 2; i++)
+        (void)disk_read(0, win, 300 + i, 1);
+
+    memset(buf, 0xaa, 16 * 512);
+    for (i = 0; i < 2; i++) {
+        memset(&req[i], 0, sizeof(req[i]));
+        req[i].buff = buf + i * 8 * 512;
+        req[i].lba = 1200 + i * 8;
+        req[i].count = 8;
+        res = volume_submit(&req[i]);
+        CHECK(res == RES_OK, "submit %u: %d", i, res);
+    }
+    CHECK(req[1].busy, "request 1 complete on submission");
+
+    deadline = otg_sim_ns + SIM_S(1);
+    while (!volume_req_done(&req[0]) && (otg_sim_ns < deadline))
+        otg_sim_poll();
+    CHECK(!req[0].busy && (req[0].res == RES_OK), "request 0: %d",
+          req[0].res);
+    res = volume_complete(&req[1]);
+    CHECK(res == RES_OK, "request 1: %d", res);
+    CHECK(!memcmp(buf, &img[1200 * 512], 16 * 512), "requests: bad data");
+
+    volume_cache_destroy();
+    volume_set_metadata_window(NULL);
+}
+
+/* Time one type of command, @n times, and report the cost per command. */
+static void bench(bool_t write, unsigned int nr, unsigned int n)
+{
+    const struct msc_bot_stats *bot = &usbh_msc_lat()->bot;
+    struct msc_bot_stats b0 = *bot;
+    struct otg_sim_stats s0 = otg_sim_stats;
+    uint64_t lat0 = msc_dev_stats.lat_ns, t0 = otg_sim_ns;
+    double tot, bus, dev, cbw, data, csw;
+    unsigned int i, xacts;
+    uint32_t lba;
+    DRESULT res;
+
+    for (i = 0; i < n; i++) {
+        lba = 256 + (i * nr) % 1024;
+        if (write)
+            fill(buf, lba, nr, i);
+        res = disk_io(write, buf, lba, nr);
+        CHECK(res == RES_OK, "bench %s %u: %d", write ? "write" : "read",
+              nr, res);
+    }
+
+    CHECK(bot->cmds - b0.cmds == n, "bench: %u BOT commands, expected %u",
+          bot->cmds - b0.cmds, n);
+    tot = (otg_sim_ns - t0) / 1e3 / n;
+    bus = (otg_sim_stats.bus_ns - s0.bus_ns) / 1e3 / n;
+    dev = (msc_dev_stats.lat_ns - lat0) / 1e3 / n;
+    cbw = (double)(bot->cbw_us - b0.cbw_us) / n;
+    data = (double)(bot->data_us - b0.data_us) / n;
+    csw = (double)(bot->csw_us - b0.csw_us) / n;
+    xacts = (otg_sim_stats.xacts - s0.xacts) / n;
+
+    /* The firmware's own phase timing accounts for the whole command. */
+    CHECK(cbw + data + csw <= tot + 1, "bench: BOT phases exceed total");
+    CHECK(cbw + data + csw >= tot * 0.9, "bench: BOT phases %.0f of %.0fus",
+          cbw + data + csw, tot);
+    CHECK(tot >= bus + dev, "bench: total %.0f < bus %.0f + device %.0f",
+          tot, bus, dev);
+
+    printf("  %-5s %3u | %7.0f %7.0f %7.0f %7.0f | %5.0f %5.0f %5.0f |"
+           " %4u %4u\n",
+           write ? "write" : "read", nr, tot, bus, dev, tot - bus - dev,
+           cbw, data, csw, xacts, (otg_sim_stats.isrs - s0.isrs) / n);
+}
+
+static void test_bench(void)
+{
+    static const unsigned int sizes[] = { 1, 8, 64, 128 };
+    unsigned int i;
+
+    printf("usb_msc: per BOT command, in us: overhead = total - bus"
+           " - device\n"
+           "  cmd   nr  |   total     bus  device overhead |"
+           "   cbw  data   csw | xact isrs\n");
+    for (i = 0; i < ARRAY_SIZE(sizes); i++)
+        bench(FALSE, sizes[i], 16);
+    for (i = 0; i < ARRAY_SIZE(sizes); i++)
+        bench(TRUE, sizes[i], 16);
+}
+
+int main(int argc, char **argv)
+{
+    verbose = (argc > 1) && !strcmp(argv[1], "-v");
+
+    fill(img, 0, NR_BLKS, 0);
+    msc_dev_init(img, NR_BLKS);
+    /* Typical of a flash drive: a few hundred microseconds per command. */
+    msc_dev_latency(0x28, 250);
+    msc_dev_latency(0x2a, 600);
+
+    usbh_msc_init();
+    usbh_msc_buffer_set(rx_buf);
+    otg_sim_attach(&msc_dev);
+
+    test_enumerate();
+    if (failures)
+        goto out;
+    test_rw();
+    test_nak();
+    test_fault(0x28, MSC_FAULT_STALL);
+    test_fault(0x2a, MSC_FAULT_STALL);
+    test_fault(0x28, MSC_FAULT_PHASE);
+    test_fault(0x2a, MSC_FAULT_PHASE);
+    test_split_fault();
+    test_detach();
+    test_volume_ra();
+    test_volume_req();
+    test_bench();
+    CHECK(otg_sim_stats.toggle_err == 0, "%u bulk IN toggle errors",
+          otg_sim_stats.toggle_err);
+
+out:
+    printf("usb_msc: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */